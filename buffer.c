@@ -22,11 +22,24 @@
 #include <grp.h>
 #include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
 #include "includes/buffer.h"
+#include "includes/trigram.h"
+#include "includes/search.h"
+#include "includes/jobs.h"
+#include "includes/du.h"
 
 #define UNDO_MAX_DEPTH 256
 
+static void dired_drop(Buffer *b);
+static void dired_stash(Buffer *b);
+static void dired_du_start(Buffer *b, int all, int fresh);
+
 void *xmalloc(size_t n) {
     void *p = malloc(n);
     if (!p) {
@@ -54,6 +67,56 @@ char *xstrdup(const char *s) {
     return d;
 }
 
+static unsigned long last_version;
+
+static void (*change_hook)(void *ctx, Buffer *b);
+static void *change_ctx;
+
+void buffer_set_change_hook(void (*fn)(void *ctx, Buffer *b), void *ctx) {
+    change_hook = fn;
+    change_ctx = ctx;
+}
+
+void buffer_will_change(Buffer *b) {
+    if (b && b->copied && change_hook) change_hook(change_ctx, b);
+}
+
+// Lines [y, y + n) are stamped with the new version and the stamps of
+// the lines after them move with their lines. When the line count does
+// not add up (lines replaced wholesale), every line is stamped.
+static void stamps_changed(Buffer *b, int y, int n, int delta) {
+    if (b->stamps_cap < b->nlines) {
+        b->stamps_cap = b->nlines * 2;
+        b->stamps = xrealloc(b->stamps, b->stamps_cap * sizeof(unsigned long));
+    }
+    int from = y + n - delta; // where the lines after the change were
+    if (b->nstamps == b->nlines - delta && y >= 0 && n >= 0 && from >= 0
+        && from <= b->nstamps && y + n <= b->nlines) {
+        memmove(b->stamps + y + n, b->stamps + from, (b->nstamps - from) * sizeof(unsigned long));
+    } else {
+        y = 0;
+        n = b->nlines;
+    }
+    for (int k = y; k < y + n; ++k) b->stamps[k] = b->version;
+    b->nstamps = b->nlines;
+}
+
+void buffer_changed(Buffer *b, int y, int n, int delta) {
+    b->modified = 1;
+    b->version = ++last_version;
+    stamps_changed(b, y, n, delta);
+    if (b->index) trigram_index_edit(b->index, y, n, delta);
+}
+
+unsigned long buffer_line_stamp(const Buffer *b, int y) {
+    return y < b->nstamps ? b->stamps[y] : b->version;
+}
+
+void buffer_drop_index(Buffer *b) {
+    trigram_index_free(b->index);
+    b->index = NULL;
+}
+
 Buffer *buffer_new(void) {
     Buffer *b = xmalloc(sizeof(Buffer));
     memset(b, 0, sizeof(Buffer));
@@ -61,6 +124,7 @@ Buffer *buffer_new(void) {
     b->lines = xmalloc(b->capacity * sizeof(char*));
     b->nlines = 1;
     b->lines[0] = xstrdup("");
+    b->version = ++last_version;
     return b;
 }
 
@@ -82,13 +146,10 @@ void buffer_clear_undo(Buffer *b) {
     b->undo_depth = 0;
 }
 
-void buffer_push_undo(Buffer *b, int cx, int cy) {
-    UndoState *u = xmalloc(sizeof(UndoState));
-    u->nlines = b->nlines;
+// Push u, whose lines are already filled in.
+static void undo_push_state(Buffer *b, UndoState *u, int cx, int cy) {
     u->cx = cx;
     u->cy = cy;
-    u->lines = xmalloc(b->nlines * sizeof(char*));
-    for (int i = 0; i < b->nlines; ++i) u->lines[i] = xstrdup(b->lines[i]);
     u->next = b->undo_stack;
     b->undo_stack = u;
     b->undo_depth++;
@@ -103,17 +164,65 @@ void buffer_push_undo(Buffer *b, int cx, int cy) {
     }
 }
 
+void buffer_push_undo(Buffer *b, int cx, int cy) {
+    UndoState *u = xmalloc(sizeof(UndoState));
+    u->nlines = b->nlines;
+    u->lines = xmalloc(b->nlines * sizeof(char*));
+    for (int i = 0; i < b->nlines; ++i) u->lines[i] = xstrdup(b->lines[i]);
+    undo_push_state(b, u, cx, cy);
+}
+
+int buffer_filter_lines(Buffer *b, int y0, int y1, const unsigned char *keep, int cx, int cy) {
+    buffer_will_change(b);
+    int removed = 0;
+    for (int y = y0; y < y1; ++y) removed += !keep[y - y0];
+    if (removed == 0) return 0;
+    // the current array becomes the undo snapshot as it is, so only the
+    // surviving lines are copied and nothing is freed
+    UndoState *u = xmalloc(sizeof(UndoState));
+    u->nlines = b->nlines;
+    u->lines = b->lines;
+    char **lines = xmalloc(b->capacity * sizeof(char*));
+    int o = 0;
+    for (int y = 0; y < b->nlines; ++y) {
+        if (y < y0 || y >= y1 || keep[y - y0]) lines[o++] = xstrdup(b->lines[y]);
+    }
+    // keep at least one empty line
+    if (o == 0) lines[o++] = xstrdup("");
+    b->lines = lines;
+    b->nlines = o;
+    undo_push_state(b, u, cx, cy);
+    buffer_changed(b, y0, o - (u->nlines - y1) - y0, o - u->nlines);
+    return removed;
+}
+
 int buffer_undo(Buffer *b, int *cx, int *cy) {
+    buffer_will_change(b);
     UndoState *u = b->undo_stack;
     if (!u) return -1;
     b->undo_stack = u->next;
     b->undo_depth--;
 
-    for (int i = 0; i < b->nlines; ++i) free(b->lines[i]);
+    // find the lines the snapshot differs in: the common head and tail
+    // keep their strings, so they stay indexed and the screen rows and
+    // highlights cached for them stay valid
+    int head = 0, tail = 0, on = b->nlines, nn = u->nlines;
+    while (head < on && head < nn && strcmp(b->lines[head], u->lines[head]) == 0) head++;
+    while (tail < on - head && tail < nn - head
+           && strcmp(b->lines[on - 1 - tail], u->lines[nn - 1 - tail]) == 0) tail++;
+    for (int i = 0; i < head; ++i) {
+        free(u->lines[i]);
+        u->lines[i] = b->lines[i];
+    }
+    for (int i = 0; i < tail; ++i) {
+        free(u->lines[nn - 1 - i]);
+        u->lines[nn - 1 - i] = b->lines[on - 1 - i];
+    }
+    for (int i = head; i < on - tail; ++i) free(b->lines[i]);
     buffer_ensure_capacity(b, u->nlines);
     for (int i = 0; i < u->nlines; ++i) b->lines[i] = u->lines[i];
     b->nlines = u->nlines;
-    b->modified = 1;
+    buffer_changed(b, head, nn - tail - head, nn - on);
     if (cx) *cx = u->cx;
     if (cy) *cy = u->cy;
 
@@ -124,9 +233,13 @@ int buffer_undo(Buffer *b, int *cx, int *cy) {
 
 void buffer_free(Buffer *b) {
     if (!b) return;
+    buffer_will_change(b);
+    dired_drop(b);
+    buffer_drop_index(b);
     buffer_clear_undo(b);
     for (int i = 0; i < b->nlines; ++i) free(b->lines[i]);
     free(b->lines);
+    free(b->stamps);
     free(b->filename);
     free(b);
 }
@@ -138,35 +251,40 @@ void buffer_ensure_capacity(Buffer *b, int newcap) {
 }
 
 void buffer_insert_line(Buffer *b, int idx, const char *s) {
+    buffer_will_change(b);
     if (idx < 0) idx = 0;
     if (idx > b->nlines) idx = b->nlines;
     buffer_ensure_capacity(b, b->nlines + 1);
     memmove(&b->lines[idx + 1], &b->lines[idx], (b->nlines - idx) * sizeof(char*));
     b->lines[idx] = xstrdup(s);
     b->nlines++;
-    b->modified = 1;
+    buffer_changed(b, idx, 1, 1);
 }
 
 void buffer_delete_line(Buffer *b, int idx) {
+    buffer_will_change(b);
     if (idx < 0 || idx >= b->nlines) return;
     if (b->nlines <= 1) {
         // keep at least one empty line
         free(b->lines[0]);
         b->lines[0] = xstrdup("");
         b->nlines = 1;
-        b->modified = 1;
+        buffer_changed(b, 0, 1, 0);
         return;
     }
     free(b->lines[idx]);
     memmove(&b->lines[idx], &b->lines[idx + 1], (b->nlines - idx - 1) * sizeof(char*));
     b->nlines--;
-    b->modified = 1;
+    buffer_changed(b, idx, 0, -1);
 }
 
 int buffer_load_file(Buffer *b, const char *path) {
+    buffer_will_change(b);
     FILE *f = fopen(path, "r");
     if (!f) return -1;
     // clear buffer
+    buffer_drop_index(b);
+    dired_stash(b);
     for (int i = 0; i < b->nlines; ++i) free(b->lines[i]);
     b->nlines = 0;
     buffer_clear_undo(b);
@@ -186,8 +304,11 @@ int buffer_load_file(Buffer *b, const char *path) {
     fclose(f);
     free(b->filename);
     b->filename = xstrdup(path);
+    buffer_changed(b, 0, b->nlines, 0);
     b->modified = 0;
     b->is_dired = 0;
+    b->is_occur = 0;
+    b->is_grep = 0;
     if (b->nlines == 0) {
         buffer_insert_line(b, 0, "");
         b->modified = 0;
@@ -195,21 +316,42 @@ int buffer_load_file(Buffer *b, const char *path) {
     return 0;
 }
 
-// dired: one directory entry with everything needed for an ls -al line
+// dired: one directory entry with everything needed for its ls -al row
 typedef struct {
     char *name;
     char *link_target;   // NULL unless a symlink
-    char perms[12];
-    char owner[64];
-    char group[64];
-    char mtime[24];
+    char mtime[24];      // as shown
+    time_t mtime_sec;
+    mode_t mode;
     long nlink;
     long long size;
     long long blocks;
+    long uid, gid;
+    int ok;              // 0 if the entry could not be stat'ed
+    int layout;          // the column widths its row was formatted for
+    int has_du;          // a directory whose tree was added up:
+    long long du;        // its size shows in place of size
+    char mark;           // '*' or 'D' (see buffer_dired_mark()), or 0
 } DiredEnt;
 
-static int dired_entry_cmp(const void *a, const void *b) {
-    return strcmp(((const DiredEnt *)a)->name, ((const DiredEnt *)b)->name);
+static int dired_name_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Path order, with '/' before every other character, so that the entries
+// under a directory come right after it.
+static int dired_path_cmp(const char *a, const char *b) {
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    int x = *a == '/' ? 1 : (unsigned char)*a;
+    int y = *b == '/' ? 1 : (unsigned char)*b;
+    return x - y;
+}
+
+static int dired_path_name_cmp(const void *a, const void *b) {
+    return dired_path_cmp(*(char *const *)a, *(char *const *)b);
 }
 
 static void dired_format_perms(mode_t m, char *out) {
@@ -234,19 +376,85 @@ static void dired_format_perms(mode_t m, char *out) {
     out[10] = '\0';
 }
 
-static void dired_format_mtime(time_t t, char *out, size_t outcap) {
-    time_t now = time(NULL);
+// localtime_r() does not recheck the time zone on every call the way
+// localtime() does; the caller runs tzset() once per listing.
+static void dired_format_mtime(time_t t, time_t now, char *out, size_t outcap) {
     const long six_months = 15552000; // ~180 days, same cutoff as ls
-    struct tm *tm = localtime(&t);
-    if (!tm) {
+    struct tm tm;
+    if (!localtime_r(&t, &tm)) {
         snprintf(out, outcap, "%12s", "?");
         return;
     }
+    // a file written while the listing is read is not in the future;
+    // like ls, look at the clock again
+    if (t > now) now = time(NULL);
     if (t > now || now - t > six_months) {
-        strftime(out, outcap, "%b %e  %Y", tm);
+        strftime(out, outcap, "%b %e  %Y", &tm);
+    } else {
+        strftime(out, outcap, "%b %e %H:%M", &tm);
+    }
+}
+
+// Names of user and group ids, looked up once per id rather than once
+// per entry, and kept across listings. A name is looked up again once it
+// is DIRED_NAME_TTL seconds old, so renamed accounts show up in time.
+#define DIRED_NAME_TTL 60
+
+typedef struct {
+    long id;            // -1 if the slot is free
+    time_t stamp;       // when the name was looked up
+    char name[64];
+} NameSlot;
+
+// Open addressing with linear probing; cap is a power of two.
+typedef struct {
+    NameSlot *slots;
+    int cap, n;
+} NameCache;
+
+static NameCache user_names, group_names;
+
+static NameSlot *name_slot(NameCache *c, long id) {
+    unsigned long h = (unsigned long)id * 2654435761u;
+    int i = (int)(h & (c->cap - 1));
+    while (c->slots[i].id != -1 && c->slots[i].id != id) i = (i + 1) & (c->cap - 1);
+    return &c->slots[i];
+}
+
+static void name_cache_grow(NameCache *c) {
+    NameSlot *old = c->slots;
+    int oldcap = c->cap;
+    c->cap = oldcap ? oldcap * 2 : 16;
+    c->slots = xmalloc(c->cap * sizeof(NameSlot));
+    for (int i = 0; i < c->cap; ++i) c->slots[i].id = -1;
+    for (int i = 0; i < oldcap; ++i) {
+        if (old[i].id != -1) *name_slot(c, old[i].id) = old[i];
+    }
+    free(old);
+}
+
+// The user (or with `group`, group) name of id, or the id as a number
+// if it has none.
+static const char *cached_name(NameCache *c, long id, int group, time_t now) {
+    if (2 * (c->n + 1) > c->cap) name_cache_grow(c);
+    NameSlot *s = name_slot(c, id);
+    if (s->id == id && now - s->stamp < DIRED_NAME_TTL) return s->name;
+    if (s->id != id) {
+        s->id = id;
+        c->n++;
+    }
+    const char *name = NULL;
+    if (group) {
+        struct group *gr = getgrgid((gid_t)id);
+        if (gr) name = gr->gr_name;
     } else {
-        strftime(out, outcap, "%b %e %H:%M", tm);
+        struct passwd *pw = getpwuid((uid_t)id);
+        if (pw) name = pw->pw_name;
     }
+    if (name) snprintf(s->name, sizeof(s->name), "%s", name);
+    else snprintf(s->name, sizeof(s->name), "%ld", id);
+    s->stamp = now;
+    return s->name;
 }
 
 static int num_width(long long v) {
@@ -255,105 +463,1565 @@ static int num_width(long long v) {
     return w;
 }
 
-int buffer_load_dir(Buffer *b, const char *path) {
-    char real[PATH_MAX];
-    if (!realpath(path, real)) return -1;
-    DIR *d = opendir(real);
-    if (!d) return -1;
+// The entries of a listing are stat'ed on worker threads, this many per
+// work item. A directory with no more entries than this is done here.
+#define DIRED_STAT_CHUNK 256
+// "Jan  1 12:00" or "Jan  1  2025"
+#define DIRED_MTIME_WIDTH 12
 
-    int cap = 32, n = 0;
-    DiredEnt *ents = xmalloc(cap * sizeof(DiredEnt));
-    long long total_blocks = 0;
-    struct dirent *entry;
-    while ((entry = readdir(d)) != NULL) {
-        char full[PATH_MAX + 512];
-        snprintf(full, sizeof(full), "%s/%s", real, entry->d_name);
-        struct stat st;
-        if (lstat(full, &st) != 0) continue;
+// The model behind a dired buffer: the entries, kept for as long as the
+// buffer lists them, and the order its rows show them in. The rows are
+// rendered from the entries, so the entry on a row is found without
+// parsing it, and sorting the listing another way stats nothing.
+//
+// While the entries are being stat'ed the rows show the names right
+// away, in name order, and a chunk's rows fill in once the chunk is
+// stat'ed. Columns widen as wider values come in; rows formatted for
+// narrower columns are redone only while on screen, until the last
+// chunk is in and every row is formatted for the final widths.
+typedef struct Dired {
+    DiredEnt *ents;      // in name order
+    int n;
+    int *order;          // row 2 + k shows ents[order[k]]
+    int nrows;           // the entries with a row: all of them unless narrowed
+    int sort;            // DIRED_SORT_*
+    time_t now;          // when the directory was read
+    int w_nlink, w_owner, w_group, w_size;
+    int layout;          // bumped whenever a column widens
+    long long total_blocks;
 
-        if (n >= cap) {
-            cap *= 2;
-            ents = xrealloc(ents, cap * sizeof(DiredEnt));
-        }
-        DiredEnt *e = &ents[n++];
-        memset(e, 0, sizeof(*e));
-        e->name = xstrdup(entry->d_name);
-        e->nlink = (long)st.st_nlink;
-        e->size = (long long)st.st_size;
-        e->blocks = (long long)st.st_blocks;
-        total_blocks += e->blocks;
-        dired_format_perms(st.st_mode, e->perms);
-        dired_format_mtime(st.st_mtime, e->mtime, sizeof(e->mtime));
-
-        struct passwd *pw = getpwuid(st.st_uid);
-        if (pw) snprintf(e->owner, sizeof(e->owner), "%s", pw->pw_name);
-        else snprintf(e->owner, sizeof(e->owner), "%ld", (long)st.st_uid);
-        struct group *gr = getgrgid(st.st_gid);
-        if (gr) snprintf(e->group, sizeof(e->group), "%s", gr->gr_name);
-        else snprintf(e->group, sizeof(e->group), "%ld", (long)st.st_gid);
+    // while the entries are being stat'ed; the rows are in name order
+    int loading;
+    Job job;             // one item per chunk of entries
+    int waited;          // job_wait() ran, so the job's lock is gone
+    DIR *dir;
+    int dfd;             // the directory; names are looked up relative to it
+    int nchunks, nshown;
+    unsigned char *done;  // per chunk: stat'ed; job's lock
+    unsigned char *shown; // per chunk: its rows show the stats
+
+    // auto-revert: an inotify watch on the directory
+    int watch;           // wanted; kept when the buffer lists again
+    int watch_fd;        // -1 if there is no watch
+    char **dirty;        // names the watch reported, to stat again
+    int ndirty, dirty_cap;
+    int dirty_all;       // the watch lost track: read everything again
+    int watch_gone;      // the directory was deleted or moved
+
+    // M-x find-dired: the entries were found under the directory, and
+    // their names are paths relative to it. While more are added the
+    // rows show them in the order found.
+    int found;
+    int growing;
+    int cap;             // ents and order have room for this many
+
+    // the directory as it was just before it was read, to tell whether
+    // a cached listing still shows it
+    int stamped;
+    dev_t dev;
+    ino_t ino;
+    time_t dir_mtime, dir_ctime;
+    int view_cy, view_top; // the cursor and top line when it was left
+
+    // M-x dired-du-mode: the trees under the subdirectories are added up
+    // on worker threads, one item each, and each row shows its total as
+    // soon as it is in
+    int du;              // wanted; kept when the buffer lists again
+    int du_running;
+    Job du_job;
+    int du_fresh;        // nothing is taken from du_tree()'s cache
+    int du_n;
+    char **du_paths;     // per item: the subdirectory
+    int *du_ents;        // per item: its entry, or -1 once taken
+    long long *du_sizes; // per item: its total, -1 if none; du_job's lock
+    unsigned char *du_done; // per item; du_job's lock
+
+    // narrowed: only the entries whose names match the filter have rows;
+    // the rows the others had are kept, per entry, for when they match
+    // again, unless their entries changed since
+    char *filter;        // NULL unless narrowed
+    int fuzzy;           // the filter's characters in order, not a substring
+    SearchPattern pat;   // the filter, folded unless it has a capital
+    char **hidden;       // per entry: its row while it has none, or NULL
+} Dired;
+
+static void dired_ent_set(const Dired *d, DiredEnt *e, const struct stat *st) {
+    e->ok = 1;
+    e->mode = st->st_mode;
+    e->nlink = (long)st->st_nlink;
+    e->size = (long long)st->st_size;
+    e->blocks = (long long)st->st_blocks;
+    e->uid = (long)st->st_uid;
+    e->gid = (long)st->st_gid;
+    e->mtime_sec = st->st_mtime;
+    dired_format_mtime(st->st_mtime, d->now, e->mtime, sizeof(e->mtime));
+}
+
+static void dired_stat_chunk(void *ctx, int worker, int item) {
+    Dired *d = ctx;
+    (void)worker;
+    int end = (item + 1) * DIRED_STAT_CHUNK;
+    if (end > d->n) end = d->n;
+    for (int i = item * DIRED_STAT_CHUNK; i < end; ++i) {
+        DiredEnt *e = &d->ents[i];
+        struct stat st;
+        if (fstatat(d->dfd, e->name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+        dired_ent_set(d, e, &st);
 
         if (S_ISLNK(st.st_mode)) {
             char target[PATH_MAX];
-            ssize_t tl = readlink(full, target, sizeof(target) - 1);
+            ssize_t tl = readlinkat(d->dfd, e->name, target, sizeof(target) - 1);
             if (tl >= 0) {
                 target[tl] = '\0';
                 e->link_target = xstrdup(target);
             }
         }
     }
-    closedir(d);
-    qsort(ents, n, sizeof(DiredEnt), dired_entry_cmp);
+    job_lock(&d->job);
+    d->done[item] = 1;
+    job_unlock(&d->job);
+}
+
+// Stop stat'ing and let go of the directory.
+static void dired_end_load(Dired *d) {
+    if (!d->loading) return;
+    if (!d->waited) job_stop(&d->job);
+    closedir(d->dir);
+    free(d->done);
+    free(d->shown);
+    d->loading = 0;
+}
+
+static void dired_du_item(void *ctx, int worker, int item) {
+    Dired *d = ctx;
+    (void)worker;
+    long long size = du_tree(d->du_paths[item], d->du_fresh, &d->du_job);
+    job_lock(&d->du_job);
+    d->du_sizes[item] = size;
+    d->du_done[item] = 1;
+    job_unlock(&d->du_job);
+}
+
+// Stop adding up trees. The totals already taken stay.
+static void dired_du_stop(Dired *d) {
+    if (!d->du_running) return;
+    job_stop(&d->du_job);
+    for (int k = 0; k < d->du_n; ++k) free(d->du_paths[k]);
+    free(d->du_paths);
+    free(d->du_ents);
+    free(d->du_sizes);
+    free(d->du_done);
+    d->du_running = 0;
+}
+
+static void dired_clear_dirty(Dired *d) {
+    for (int i = 0; i < d->ndirty; ++i) free(d->dirty[i]);
+    d->ndirty = 0;
+    d->dirty_all = 0;
+}
+
+static void dired_watch_close(Dired *d) {
+    if (d->watch_fd >= 0) close(d->watch_fd);
+    d->watch_fd = -1;
+    dired_clear_dirty(d);
+}
+
+static void dired_free_hidden(Dired *d) {
+    if (!d->hidden) return;
+    for (int i = 0; i < d->n; ++i) free(d->hidden[i]);
+    free(d->hidden);
+    d->hidden = NULL;
+}
+
+static void dired_free(Dired *d) {
+    dired_end_load(d);
+    dired_du_stop(d);
+    dired_watch_close(d);
+    free(d->dirty);
+    for (int i = 0; i < d->n; ++i) {
+        free(d->ents[i].name);
+        free(d->ents[i].link_target);
+    }
+    free(d->ents);
+    free(d->order);
+    if (d->filter) search_pattern_free(&d->pat);
+    free(d->filter);
+    dired_free_hidden(d);
+    free(d);
+}
+
+// Note how the directory looks before it is read.
+static void dired_stamp(Dired *d, int dfd) {
+    struct stat st;
+    d->stamped = fstat(dfd, &st) == 0;
+    if (!d->stamped) return;
+    d->dev = st.st_dev;
+    d->ino = st.st_ino;
+    d->dir_mtime = st.st_mtime;
+    d->dir_ctime = st.st_ctime;
+}
+
+// Whether the directory `st` is still what the listing shows. Only whole
+// seconds are compared, so a directory changed in the second it was read
+// may have changed after it was read, and does not count as unchanged.
+static int dired_unchanged(const Dired *d, const struct stat *st) {
+    return d->stamped && st->st_dev == d->dev && st->st_ino == d->ino
+           && st->st_mtime == d->dir_mtime && st->st_ctime == d->dir_ctime
+           && d->dir_mtime < d->now && d->dir_ctime < d->now;
+}
+
+// Drop the buffer's listing model, stopping the stats if they still
+// run. The rows keep whatever they show.
+static void dired_drop(Buffer *b) {
+    if (!b->dired) return;
+    dired_free(b->dired);
+    b->dired = NULL;
+}
+
+// Whether ents[i] is stat'ed and its chunk taken.
+static int dired_ent_ready(Dired *d, int i) {
+    return !d->loading || (d->shown[i / DIRED_STAT_CHUNK] && d->ents[i].ok);
+}
+
+// The size column of e: with M-x dired-du-mode, a directory's tree.
+static long long dired_ent_size(const DiredEnt *e) {
+    return e->has_du ? e->du : e->size;
+}
+
+// The row of ents[i]: its ls -al line or, until the entry is ready,
+// just the name, where the name column is.
+static char *dired_row_text(Dired *d, int i) {
+    DiredEnt *e = &d->ents[i];
+    e->layout = d->layout;
+    if (dired_ent_ready(d, i)) {
+        char perms[12];
+        dired_format_perms(e->mode, perms);
+        const char *owner = cached_name(&user_names, e->uid, 0, d->now);
+        const char *group = cached_name(&group_names, e->gid, 1, d->now);
+        char line[PATH_MAX * 2 + 256];
+        snprintf(line, sizeof(line), "%c %s %*ld %-*s %-*s %*lld %s %s%s%s",
+                 e->mark ? e->mark : ' ',
+                 perms,
+                 d->w_nlink, e->nlink,
+                 d->w_owner, owner,
+                 d->w_group, group,
+                 d->w_size, dired_ent_size(e),
+                 e->mtime,
+                 e->name,
+                 e->link_target ? " -> " : "",
+                 e->link_target ? e->link_target : "");
+        return xstrdup(line);
+    }
+    // built by hand: every row starts out like this
+    size_t pad = 2 + 10 + d->w_nlink + d->w_owner + d->w_group + d->w_size + DIRED_MTIME_WIDTH + 6;
+    size_t len = strlen(e->name);
+    char *row = xmalloc(pad + len + 1);
+    memset(row, ' ', pad);
+    if (e->mark) row[0] = e->mark;
+    memcpy(row + pad, e->name, len + 1);
+    return row;
+}
+
+// Render row 2 + k.
+static void dired_set_row(Buffer *b, Dired *d, int k) {
+    buffer_will_change(b);
+    free(b->lines[2 + k]);
+    b->lines[2 + k] = dired_row_text(d, d->order[k]);
+}
+
+static void dired_set_total(Buffer *b, long long total_blocks) {
+    buffer_will_change(b);
+    char total[64];
+    snprintf(total, sizeof(total), "  total %lld", total_blocks);
+    free(b->lines[1]);
+    b->lines[1] = xstrdup(total);
+}
+
+// Widen the columns w (links, owner, group, size), ls-style, to fit e.
+// The owner names come from the name cache, which is not shared with
+// the workers, so this runs here.
+static void dired_fit(Dired *d, const DiredEnt *e, int *w) {
+    int v;
+    v = num_width(e->nlink);          if (v > w[0]) w[0] = v;
+    v = (int)strlen(cached_name(&user_names, e->uid, 0, d->now));
+    if (v > w[1]) w[1] = v;
+    v = (int)strlen(cached_name(&group_names, e->gid, 1, d->now));
+    if (v > w[2]) w[2] = v;
+    v = num_width(dired_ent_size(e)); if (v > w[3]) w[3] = v;
+}
+
+// Lay the columns out with widths w. Returns 1 if one changed, which
+// makes every row formatted before out of date.
+static int dired_set_widths(Dired *d, const int *w) {
+    if (w[0] == d->w_nlink && w[1] == d->w_owner && w[2] == d->w_group && w[3] == d->w_size)
+        return 0;
+    d->w_nlink = w[0];
+    d->w_owner = w[1];
+    d->w_group = w[2];
+    d->w_size = w[3];
+    d->layout++;
+    return 1;
+}
+
+// Take a stat'ed chunk: widen the columns for it.
+static void dired_take_chunk(Dired *d, int c) {
+    int end = (c + 1) * DIRED_STAT_CHUNK;
+    if (end > d->n) end = d->n;
+    int w[4] = { d->w_nlink, d->w_owner, d->w_group, d->w_size };
+    for (int i = c * DIRED_STAT_CHUNK; i < end; ++i) {
+        DiredEnt *e = &d->ents[i];
+        if (!e->ok) continue;
+        d->total_blocks += e->blocks;
+        dired_fit(d, e, w);
+    }
+    dired_set_widths(d, w);
+    d->shown[c] = 1;
+    d->nshown++;
+}
+
+static const DiredEnt *sort_ents;
+static int sort_key;
+
+// Largest or newest first, like ls -S and ls -t; ties and the name
+// order keep the entries' order, which is by name.
+static int dired_order_cmp(const void *a, const void *b) {
+    int i = *(const int *)a, j = *(const int *)b;
+    const DiredEnt *x = &sort_ents[i], *y = &sort_ents[j];
+    long long xs = dired_ent_size(x), ys = dired_ent_size(y);
+    if (sort_key == DIRED_SORT_SIZE && xs != ys) return xs < ys ? 1 : -1;
+    if (sort_key == DIRED_SORT_TIME && x->mtime_sec != y->mtime_sec)
+        return x->mtime_sec < y->mtime_sec ? 1 : -1;
+    return i - j;
+}
+
+static void dired_sort_order(Dired *d) {
+    sort_ents = d->ents;
+    sort_key = d->sort;
+    qsort(d->order, d->nrows, sizeof(int), dired_order_cmp);
+}
+
+// Whether `name` matches the narrowing filter: holds it or, fuzzy, its
+// characters in the same order.
+static int dired_matches(const Dired *d, const char *name) {
+    if (!d->filter) return 1;
+    if (!d->fuzzy) return search_find(&d->pat, name, strlen(name)) >= 0;
+    const unsigned char *q = (const unsigned char *)d->pat.needle;
+    for (const unsigned char *s = (const unsigned char *)name; *s && *q; ++s) {
+        if ((d->pat.fold ? search_fold_lower[*s] : *s) == *q) q++;
+    }
+    return *q == '\0';
+}
+
+// Give the entries that match the filter rows, in the listing's order.
+static void dired_order_rows(Dired *d) {
+    int m = 0;
+    for (int i = 0; i < d->n; ++i) {
+        if (dired_matches(d, d->ents[i].name)) d->order[m++] = i;
+    }
+    d->nrows = m;
+    if (d->sort != DIRED_SORT_NAME) dired_sort_order(d);
+}
+
+// Every chunk is in: drop the entries that vanished before they could
+// be stat'ed, put the rows in the listing's order, and format every row
+// for the final widths. *cy stays with its entry.
+static void dired_finish_rows(Buffer *b, int *cy) {
+    buffer_will_change(b);
+    Dired *d = b->dired;
+    int old_nlines = b->nlines;
+    int at = cy && *cy >= 2 && *cy < b->nlines ? *cy - 2 : -1;
+    int kept = 0;
+    for (int i = 0; i < d->n; ++i) {
+        DiredEnt *e = &d->ents[i];
+        free(b->lines[2 + i]);
+        b->lines[2 + i] = NULL;
+        if (!e->ok) {
+            // the cursor goes on to the next entry
+            if (at == i) at++;
+            free(e->name);
+            free(e->link_target);
+            continue;
+        }
+        if (at == i) at = kept;
+        d->ents[kept++] = *e;
+    }
+    if (at >= kept) at = kept - 1;
+    d->n = kept;
+    dired_end_load(d);
+    dired_order_rows(d);
+    for (int k = 0; k < d->nrows; ++k) {
+        dired_set_row(b, d, k);
+        if (cy && d->order[k] == at) *cy = 2 + k;
+    }
+    b->nlines = 2 + d->nrows;
+    if (cy && *cy >= b->nlines) *cy = b->nlines - 1;
+    dired_set_total(b, d->total_blocks);
+    buffer_changed(b, 0, b->nlines, b->nlines - old_nlines);
+    b->modified = 0;
+    dired_du_start(b, 0, 0);
+}
+
+// The names in a directory, in name order.
+static char **dired_read_names(DIR *dir, int *count) {
+    int cap = 32, n = 0;
+    char **names = xmalloc(cap * sizeof(char*));
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (n >= cap) {
+            cap *= 2;
+            names = xrealloc(names, cap * sizeof(char*));
+        }
+        names[n++] = xstrdup(entry->d_name);
+    }
+    qsort(names, n, sizeof(char*), dired_name_cmp);
+    *count = n;
+    return names;
+}
+
+// Stat ents[0..n) in the directory dfd, on the worker threads if there
+// are enough of them, and wait for them.
+static void dired_stat_ents(DiredEnt *ents, int n, int dfd, time_t now) {
+    Dired tmp;
+    memset(&tmp, 0, sizeof(tmp));
+    tmp.ents = ents;
+    tmp.n = n;
+    tmp.dfd = dfd;
+    tmp.now = now;
+    tmp.nchunks = (n + DIRED_STAT_CHUNK - 1) / DIRED_STAT_CHUNK;
+    tmp.done = xmalloc(tmp.nchunks + 1);
+    job_start(&tmp.job, tmp.nchunks, tmp.nchunks > 1 ? job_threads() : 0, dired_stat_chunk, &tmp);
+    job_wait(&tmp.job);
+    free(tmp.done);
+}
+
+static void dired_ent_free(DiredEnt *e) {
+    free(e->name);
+    free(e->link_target);
+}
+
+// Whether two stats of an entry show the same row.
+static int dired_same(const DiredEnt *a, const DiredEnt *b) {
+    if (a->mode != b->mode || a->nlink != b->nlink || a->size != b->size
+        || a->blocks != b->blocks || a->uid != b->uid || a->gid != b->gid
+        || a->mtime_sec != b->mtime_sec || strcmp(a->mtime, b->mtime) != 0) return 0;
+    if (!a->link_target || !b->link_target) return a->link_target == b->link_target;
+    return strcmp(a->link_target, b->link_target) == 0;
+}
+
+// Fit the columns and the total to all the entries. Returns 1 if a
+// column changed width.
+static int dired_measure(Dired *d) {
+    int w[4] = { 1, 1, 1, 1 };
+    d->total_blocks = 0;
+    for (int i = 0; i < d->n; ++i) {
+        d->total_blocks += d->ents[i].blocks;
+        dired_fit(d, &d->ents[i], w);
+    }
+    return dired_set_widths(d, w);
+}
+
+// Merge fresh stats into a listing that is read. upd[0..nupd) is in the
+// entries' order, by name (or path, for found ones), and an entry of it
+// that is not ok is gone; with `all` it is the whole directory, so the
+// entries it lacks are gone too. upd's names and link targets are taken
+// over or freed. An entry stat'ed again keeps its mark.
+// A row whose entry is unchanged keeps its text unless a column changed
+// width, and only the lines that differ are marked changed. *cy stays
+// with its entry, or on its line if the entry is gone.
+static void dired_merge(Buffer *b, DiredEnt *upd, int nupd, int all, int *cy) {
+    buffer_will_change(b);
+    Dired *d = b->dired;
+    int n = d->n, nrows = d->nrows;
+    int *row_of = xmalloc((n + 1) * sizeof(int));
+    for (int i = 0; i < n; ++i) row_of[i] = -1;
+    for (int k = 0; k < nrows; ++k) row_of[d->order[k]] = k;
+    int at = *cy >= 2 && *cy < 2 + nrows ? d->order[*cy - 2] : -1;
+
+    DiredEnt *ents = xmalloc((n + nupd + 1) * sizeof(DiredEnt));
+    int *from = xmalloc((n + nupd + 1) * sizeof(int)); // the old entry kept as is, or -1
+    int m = 0, new_at = -1;
+    for (int i = 0, j = 0; i < n || j < nupd; ) {
+        int c = i == n ? 1 : j == nupd ? -1
+                : d->found ? dired_path_cmp(d->ents[i].name, upd[j].name)
+                : strcmp(d->ents[i].name, upd[j].name);
+        int oi = c <= 0 ? i++ : -1;
+        DiredEnt *o = oi >= 0 ? &d->ents[oi] : NULL;
+        DiredEnt *u = c >= 0 ? &upd[j++] : NULL;
+        if (!u) {
+            // not looked at again
+            if (all) {
+                dired_ent_free(o);
+                continue;
+            }
+            ents[m] = *o;
+            from[m] = oi;
+        } else if (!u->ok) {
+            if (o) dired_ent_free(o);
+            dired_ent_free(u);
+            continue;
+        } else if (o && dired_same(o, u)) {
+            dired_ent_free(u);
+            ents[m] = *o;
+            from[m] = oi;
+        } else {
+            if (o) {
+                u->mark = o->mark;
+                dired_ent_free(o);
+            }
+            ents[m] = *u;
+            from[m] = -1;
+        }
+        if (oi >= 0 && oi == at) new_at = m;
+        m++;
+    }
+    free(d->ents);
+    d->ents = ents;
+    d->n = m;
+    if (d->hidden) {
+        // a hidden row stays with its entry, unless that changed
+        char **hidden = xmalloc((m + 1) * sizeof(char*));
+        for (int k = 0; k < m; ++k) {
+            hidden[k] = from[k] >= 0 ? d->hidden[from[k]] : NULL;
+            if (from[k] >= 0) d->hidden[from[k]] = NULL;
+        }
+        for (int i = 0; i < n; ++i) free(d->hidden[i]);
+        free(d->hidden);
+        d->hidden = hidden;
+    }
+    int relayout = dired_measure(d);
+    free(d->order);
+    d->order = xmalloc((m + 1) * sizeof(int));
+    dired_order_rows(d);
+    // n and m count the rows from here on
+    n = nrows;
+    m = d->nrows;
+
+    char **rows = xmalloc((m + 1) * sizeof(char*));
+    unsigned char *reused = xmalloc(n + 1);
+    memset(reused, 0, n + 1);
+    for (int k = 0; k < m; ++k) {
+        int e = d->order[k];
+        if (from[e] >= 0 && row_of[from[e]] >= 0 && !relayout) {
+            rows[k] = b->lines[2 + row_of[from[e]]];
+            reused[row_of[from[e]]] = 1;
+        } else {
+            rows[k] = dired_row_text(d, e);
+        }
+        if (e == new_at) *cy = 2 + k;
+    }
+
+    // lines [lo, 2 + n - tail) become [lo, 2 + m - tail)
+    int lo = 2, tail = 0;
+    while (lo - 2 < n && lo - 2 < m && b->lines[lo] == rows[lo - 2]) lo++;
+    while (tail < n - (lo - 2) && tail < m - (lo - 2) && b->lines[1 + n - tail] == rows[m - 1 - tail])
+        tail++;
+    for (int k = 0; k < n; ++k) {
+        if (!reused[k]) free(b->lines[2 + k]);
+    }
+    buffer_ensure_capacity(b, m + 2);
+    memcpy(b->lines + 2, rows, m * sizeof(char*));
+    b->nlines = 2 + m;
+    char total[64];
+    snprintf(total, sizeof(total), "  total %lld", d->total_blocks);
+    if (strcmp(total, b->lines[1]) != 0) {
+        dired_set_total(b, d->total_blocks);
+        lo = 1;
+    }
+    if (lo < 2 + m - tail || m != n) {
+        buffer_changed(b, lo, 2 + m - tail - lo, m - n);
+        b->modified = 0;
+    }
+    if (*cy >= b->nlines) *cy = b->nlines - 1;
+    free(reused);
+    free(rows);
+    free(from);
+    free(row_of);
+}
+
+// Whether the buffer's index is still being built, which its lines must
+// not change under.
+static int dired_index_busy(Buffer *b) {
+    int nblocks;
+    return b->index && trigram_index_progress(b->index, &nblocks) < nblocks;
+}
+
+// Read the directory again; the trees under it are added up again, with
+// du_tree()'s cache or with `fresh` without.
+static int dired_reread(Buffer *b, int *cy, int fresh) {
+    Dired *d = b->dired;
+    if (!d) return -1;
+    if (d->found) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    DIR *dir = opendir(b->filename);
+    if (!dir) return -1;
+    buffer_dired_finish(b, cy);
+    if (dired_index_busy(b)) buffer_drop_index(b);
+    dired_stamp(d, dirfd(dir));
+    int n;
+    char **names = dired_read_names(dir, &n);
+    DiredEnt *upd = xmalloc((n + 1) * sizeof(DiredEnt));
+    memset(upd, 0, (n + 1) * sizeof(DiredEnt));
+    for (int i = 0; i < n; ++i) upd[i].name = names[i];
+    free(names);
+    d->now = time(NULL);
+    tzset();
+    // a change does not show in readdir unless it adds, removes or
+    // renames an entry, so everything is stat'ed again
+    dired_stat_ents(upd, n, dirfd(dir), d->now);
+    closedir(dir);
+    dired_du_stop(d);
+    dired_merge(b, upd, n, 1, cy);
+    free(upd);
+    // this covers whatever the watch has reported
+    dired_clear_dirty(d);
+    dired_du_start(b, 1, fresh);
+    return 0;
+}
+
+int buffer_dired_refresh(Buffer *b, int *cy) {
+    return dired_reread(b, cy, 1);
+}
 
-    // column widths, ls-style
-    int w_nlink = 1, w_owner = 1, w_group = 1, w_size = 1;
+// Auto-revert: an inotify watch reports what changes a listing. The
+// directory's own events have no name and stand for ".".
+#ifdef __linux__
+#define DIRED_WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY \
+                            | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+#endif
+// Names reported at once beyond this many refresh the whole listing.
+#define DIRED_WATCH_MAX_NAMES 1024
+
+static int dired_watch_open(Dired *d, const char *path) {
+#ifdef __linux__
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) return -1;
+    if (inotify_add_watch(fd, path, DIRED_WATCH_EVENTS) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    d->watch_fd = fd;
+    return 0;
+#else
+    (void)d;
+    (void)path;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static void dired_add_dirty(Dired *d, const char *name) {
+    if (d->dirty_all) return;
+    if (d->ndirty == DIRED_WATCH_MAX_NAMES) {
+        dired_clear_dirty(d);
+        d->dirty_all = 1;
+        return;
+    }
+    if (d->ndirty == d->dirty_cap) {
+        d->dirty_cap = d->dirty_cap ? d->dirty_cap * 2 : 16;
+        d->dirty = xrealloc(d->dirty, d->dirty_cap * sizeof(char*));
+    }
+    d->dirty[d->ndirty++] = xstrdup(name);
+}
+
+// Take the events the watch has queued.
+static void dired_watch_read(Dired *d) {
+#ifdef __linux__
+    union {
+        struct inotify_event ev; // for the alignment
+        char buf[8192];
+    } u;
+    ssize_t r;
+    while ((r = read(d->watch_fd, u.buf, sizeof(u.buf))) > 0) {
+        for (char *p = u.buf; p < u.buf + r; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                dired_clear_dirty(d);
+                d->dirty_all = 1;
+            } else if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                d->watch_gone = 1;
+            } else {
+                dired_add_dirty(d, ev->len > 0 ? ev->name : ".");
+                // an entry coming or going changes the directory's own
+                // size, time and (for subdirectories) link count
+                if (ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) {
+                    dired_add_dirty(d, ".");
+                }
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+#else
+    (void)d;
+#endif
+}
+
+// Stat names[0..n) again, relative to the directory, and merge them into
+// the listing. The names are taken over, unless the directory cannot be
+// opened (-1).
+static int dired_update(Buffer *b, char **names, int n, int *cy) {
+    Dired *d = b->dired;
+    int dfd = open(b->filename, O_RDONLY | O_DIRECTORY);
+    if (dfd < 0) return -1;
+    qsort(names, n, sizeof(char*), d->found ? dired_path_name_cmp : dired_name_cmp);
+    DiredEnt *upd = xmalloc((n + 1) * sizeof(DiredEnt));
+    memset(upd, 0, (n + 1) * sizeof(DiredEnt));
+    int m = 0;
     for (int i = 0; i < n; ++i) {
-        int w;
-        w = num_width(ents[i].nlink);          if (w > w_nlink) w_nlink = w;
-        w = (int)strlen(ents[i].owner);        if (w > w_owner) w_owner = w;
-        w = (int)strlen(ents[i].group);        if (w > w_group) w_group = w;
-        w = num_width(ents[i].size);           if (w > w_size)  w_size = w;
+        if (m > 0 && strcmp(upd[m - 1].name, names[i]) == 0) free(names[i]);
+        else upd[m++].name = names[i];
+    }
+    d->now = time(NULL);
+    dired_stat_ents(upd, m, dfd, d->now);
+    close(dfd);
+    dired_du_stop(d);
+    dired_merge(b, upd, m, 0, cy);
+    free(upd);
+    dired_du_start(b, 0, 0);
+    return 0;
+}
+
+// Bring the listing up to date with what the watch reported: only the
+// reported names are stat'ed, and the directory is not read.
+static void dired_watch_poll(Buffer *b, int *cy) {
+    Dired *d = b->dired;
+    if (d->watch_fd < 0) return;
+    dired_watch_read(d);
+    if (d->watch_gone) {
+        dired_watch_close(d);
+        d->watch = 0;
+        return;
+    }
+    if ((!d->ndirty && !d->dirty_all) || dired_index_busy(b)) return;
+    if (d->dirty_all) {
+        dired_reread(b, cy, 0);
+        return;
+    }
+    if (dired_update(b, d->dirty, d->ndirty, cy) == 0) d->ndirty = 0;
+}
+
+int buffer_dired_watch(Buffer *b, int on) {
+    Dired *d = b->dired;
+    if (!d) {
+        errno = ENOTDIR;
+        return -1;
+    }
+    if (!on) {
+        dired_watch_close(d);
+        d->watch = 0;
+        return 0;
+    }
+    // found entries may lie anywhere in the tree
+    if (d->found) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    if (d->watch_fd < 0 && dired_watch_open(d, b->filename) < 0) return -1;
+    d->watch = 1;
+    // catch up with what changed before the watch began
+    d->dirty_all = 1;
+    return 0;
+}
+
+int buffer_dired_watching(const Buffer *b) {
+    return b->dired && b->dired->watch_fd >= 0;
+}
+
+void buffer_dired_update(Buffer *b, const char *const *names, int n, int *cy) {
+    Dired *d = b->dired;
+    if (!d || d->growing || n <= 0) return;
+    buffer_dired_finish(b, cy);
+    if (dired_index_busy(b)) buffer_drop_index(b);
+    char **copy = xmalloc(n * sizeof(char*));
+    for (int i = 0; i < n; ++i) copy[i] = xstrdup(names[i]);
+    if (dired_update(b, copy, n, cy) < 0) {
+        for (int i = 0; i < n; ++i) free(copy[i]);
+    }
+    free(copy);
+}
+
+// The rows on screen, [top, top + rows), follow the widest columns so
+// far; rows [lo, hi) have changed already.
+static void dired_relayout(Buffer *b, int top, int rows, int lo, int hi) {
+    Dired *d = b->dired;
+    for (int y = top > 2 ? top : 2; y < top + rows && y < 2 + d->nrows; ++y) {
+        if (d->ents[d->order[y - 2]].layout == d->layout) continue;
+        dired_set_row(b, d, y - 2);
+        if (lo > y) lo = y;
+        if (hi < y + 1) hi = y + 1;
+    }
+    if (hi > lo) {
+        buffer_changed(b, lo, hi - lo, 0);
+        b->modified = 0;
+    }
+}
+
+// Add up the trees under the subdirectories with no total yet, or with
+// `all` under every subdirectory; their rows keep the totals they show
+// until the new ones are in. Does nothing unless dired-du-mode is on.
+static void dired_du_start(Buffer *b, int all, int fresh) {
+    Dired *d = b->dired;
+    dired_du_stop(d);
+    if (!d->du || d->loading || d->found) return;
+    int n = 0;
+    int *ents = xmalloc((d->n + 1) * sizeof(int));
+    for (int i = 0; i < d->n; ++i) {
+        const DiredEnt *e = &d->ents[i];
+        if (!e->ok || !S_ISDIR(e->mode) || (e->has_du && !all)) continue;
+        if (strcmp(e->name, ".") == 0 || strcmp(e->name, "..") == 0) continue;
+        ents[n++] = i;
+    }
+    if (n == 0) {
+        free(ents);
+        return;
+    }
+    d->du_n = n;
+    d->du_ents = ents;
+    d->du_paths = xmalloc(n * sizeof(char*));
+    for (int k = 0; k < n; ++k) {
+        const char *name = d->ents[ents[k]].name;
+        size_t len = strlen(b->filename) + strlen(name) + 2;
+        d->du_paths[k] = xmalloc(len);
+        snprintf(d->du_paths[k], len, "%s/%s", b->filename, name);
+    }
+    d->du_sizes = xmalloc(n * sizeof(long long));
+    d->du_done = xmalloc(n);
+    memset(d->du_done, 0, n);
+    d->du_fresh = fresh;
+    d->du_running = 1;
+    job_start(&d->du_job, n, job_threads(), dired_du_item, d);
+}
+
+// Show the totals added up since the last call, and redo the rows among
+// [top, top + rows) formatted for a narrower size column; once the last
+// is in, every row. Returns 1 while more are coming.
+static int dired_du_poll(Buffer *b, int top, int rows) {
+    Dired *d = b->dired;
+    if (!d->du_running) return 0;
+    if (dired_index_busy(b)) return 1;
+    int *row_of = NULL;
+    int *taken = xmalloc(d->du_n * sizeof(int));
+    int ntaken = 0, left = 0;
+    int w[4] = { d->w_nlink, d->w_owner, d->w_group, d->w_size };
+    for (int k = 0; k < d->du_n; ++k) {
+        int i = d->du_ents[k];
+        if (i < 0) continue;
+        job_lock(&d->du_job);
+        int done = d->du_done[k];
+        long long size = d->du_sizes[k];
+        job_unlock(&d->du_job);
+        if (!done) {
+            left++;
+            continue;
+        }
+        d->du_ents[k] = -1;
+        if (size < 0) continue;
+        d->ents[i].has_du = 1;
+        d->ents[i].du = size;
+        dired_fit(d, &d->ents[i], w);
+        taken[ntaken++] = i;
+    }
+    dired_set_widths(d, w);
+    int lo = b->nlines, hi = 0;
+    if (ntaken > 0) {
+        row_of = xmalloc((d->n + 1) * sizeof(int));
+        for (int i = 0; i < d->n; ++i) row_of[i] = -1;
+        for (int k = 0; k < d->nrows; ++k) row_of[d->order[k]] = k;
+    }
+    for (int j = 0; j < ntaken; ++j) {
+        int k = row_of[taken[j]];
+        if (k < 0) {
+            // shown with its total if it matches again
+            free(d->hidden[taken[j]]);
+            d->hidden[taken[j]] = NULL;
+            continue;
+        }
+        dired_set_row(b, d, k);
+        if (lo > 2 + k) lo = 2 + k;
+        if (hi < 3 + k) hi = 3 + k;
+    }
+    free(row_of);
+    free(taken);
+    if (left > 0) {
+        dired_relayout(b, top, rows, lo, hi);
+        return 1;
+    }
+    dired_du_stop(d);
+    dired_relayout(b, 2, d->nrows, lo, hi);
+    return 0;
+}
+
+// Show the directories' own sizes again.
+static void dired_du_clear(Buffer *b) {
+    Dired *d = b->dired;
+    dired_du_stop(d);
+    int had = 0;
+    for (int i = 0; i < d->n; ++i) {
+        had |= d->ents[i].has_du;
+        d->ents[i].has_du = 0;
+    }
+    if (!had || d->loading) return;
+    dired_measure(d);
+    d->layout++;
+    dired_relayout(b, 2, d->nrows, b->nlines, 0);
+}
+
+int buffer_dired_du(Buffer *b, int on) {
+    Dired *d = b->dired;
+    if (!d) {
+        errno = ENOTDIR;
+        return -1;
+    }
+    if (!on) {
+        d->du = 0;
+        dired_du_clear(b);
+        return 0;
+    }
+    // found entries are added up by whoever lists the directories
+    if (d->found) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    d->du = 1;
+    dired_du_start(b, 0, 0);
+    return 0;
+}
+
+int buffer_dired_du_on(const Buffer *b) {
+    return b->dired && b->dired->du;
+}
+
+int buffer_dired_poll(Buffer *b, int top, int rows, int *cy) {
+    Dired *d = b->dired;
+    if (!d) return 0;
+    if (d->growing) {
+        dired_relayout(b, top, rows, b->nlines, 0);
+        return 1;
+    }
+    if (!d->loading) {
+        int y = 0;
+        dired_watch_poll(b, cy ? cy : &y);
+        return dired_du_poll(b, top, rows);
+    }
+    int lo = b->nlines, hi = 0;
+    for (int c = 0; c < d->nchunks; ++c) {
+        if (d->shown[c]) continue;
+        if (!d->waited) job_lock(&d->job);
+        int done = d->done[c];
+        if (!d->waited) job_unlock(&d->job);
+        if (!done) continue;
+        dired_take_chunk(d, c);
+        int end = (c + 1) * DIRED_STAT_CHUNK;
+        if (end > d->n) end = d->n;
+        for (int i = c * DIRED_STAT_CHUNK; i < end; ++i) dired_set_row(b, d, i);
+        if (lo > 1) lo = 1; // and the total
+        if (hi < 2 + end) hi = 2 + end;
+    }
+    if (d->nshown == d->nchunks) {
+        dired_finish_rows(b, cy);
+        return d->du_running;
+    }
+    if (hi > 0) dired_set_total(b, d->total_blocks);
+    dired_relayout(b, top, rows, lo, hi);
+    return 1;
+}
+
+void buffer_dired_finish(Buffer *b, int *cy) {
+    Dired *d = b->dired;
+    if (!d || !d->loading) return;
+    if (!d->waited) {
+        job_wait(&d->job);
+        d->waited = 1;
+    }
+    buffer_dired_poll(b, 0, 0, cy);
+}
+
+int buffer_dired_loading(const Buffer *b) {
+    return b->dired && (b->dired->loading || b->dired->growing);
+}
+
+int buffer_dired_busy(const Buffer *b) {
+    return b->dired && (b->dired->loading || b->dired->growing || b->dired->du_running);
+}
+
+int buffer_dired_ready(Buffer *b, int y) {
+    Dired *d = b->dired;
+    if (!d || y < 2 || y >= 2 + d->nrows) return 1;
+    return dired_ent_ready(d, d->order[y - 2]);
+}
+
+const char *buffer_dired_name(Buffer *b, int y) {
+    Dired *d = b->dired;
+    if (!d || y < 2 || y >= 2 + d->nrows) return NULL;
+    return d->ents[d->order[y - 2]].name;
+}
+
+// Show ents[order[k]]'s mark in the first column of its row.
+static void dired_show_mark(Buffer *b, Dired *d, int k) {
+    buffer_will_change(b);
+    char *row = xstrdup(b->lines[2 + k]);
+    char mark = d->ents[d->order[k]].mark;
+    row[0] = mark ? mark : ' ';
+    free(b->lines[2 + k]);
+    b->lines[2 + k] = row;
+}
+
+int buffer_dired_mark(Buffer *b, int y, int mark) {
+    Dired *d = b->dired;
+    if (!d || y < 2 || y >= 2 + d->nrows) return -1;
+    DiredEnt *e = &d->ents[d->order[y - 2]];
+    if (strcmp(e->name, ".") == 0 || strcmp(e->name, "..") == 0) return -1;
+    if (e->mark == mark) return 0;
+    if (dired_index_busy(b)) buffer_drop_index(b);
+    e->mark = (char)mark;
+    dired_show_mark(b, d, y - 2);
+    buffer_changed(b, y, 1, 0);
+    b->modified = 0;
+    return 0;
+}
+
+int buffer_dired_unmark_all(Buffer *b, int mark) {
+    Dired *d = b->dired;
+    if (!d) return 0;
+    int count = 0, lo = b->nlines, hi = 0;
+    for (int k = 0; k < d->nrows; ++k) {
+        DiredEnt *e = &d->ents[d->order[k]];
+        if (!e->mark || (mark && e->mark != mark)) continue;
+        if (count++ == 0 && dired_index_busy(b)) buffer_drop_index(b);
+        e->mark = 0;
+        dired_show_mark(b, d, k);
+        if (lo > 2 + k) lo = 2 + k;
+        hi = 3 + k;
+    }
+    if (count > 0) {
+        buffer_changed(b, lo, hi - lo, 0);
+        b->modified = 0;
+    }
+    return count;
+}
+
+char **buffer_dired_marked(Buffer *b, int mark, int *count) {
+    Dired *d = b->dired;
+    *count = 0;
+    if (!d) return NULL;
+    int n = 0;
+    for (int k = 0; k < d->nrows; ++k) n += d->ents[d->order[k]].mark == mark;
+    if (n == 0) return NULL;
+    char **names = xmalloc(n * sizeof(char*));
+    n = 0;
+    for (int k = 0; k < d->nrows; ++k) {
+        const DiredEnt *e = &d->ents[d->order[k]];
+        if (e->mark == mark) names[n++] = xstrdup(e->name);
+    }
+    *count = n;
+    return names;
+}
+
+int buffer_dired_sort(Buffer *b, int sort, int cy) {
+    buffer_will_change(b);
+    Dired *d = b->dired;
+    if (!d || d->loading || d->growing) return cy;
+    if (dired_index_busy(b)) buffer_drop_index(b);
+    int n = d->nrows;
+    // the rows' text stays the same, only their order changes
+    int *row_of = xmalloc((d->n + 1) * sizeof(int));
+    for (int k = 0; k < n; ++k) row_of[d->order[k]] = k;
+    char **rows = xmalloc((n + 1) * sizeof(char*));
+    memcpy(rows, b->lines + 2, n * sizeof(char*));
+    int at = cy >= 2 && cy < 2 + n ? d->order[cy - 2] : -1;
+    d->sort = sort;
+    dired_sort_order(d);
+    for (int k = 0; k < n; ++k) {
+        b->lines[2 + k] = rows[row_of[d->order[k]]];
+        if (d->order[k] == at) cy = 2 + k;
     }
+    free(rows);
+    free(row_of);
+    buffer_changed(b, 2, n, 0);
+    b->modified = 0;
+    return cy;
+}
 
-    // rebuild the buffer as a listing
+int buffer_dired_sorted_by(const Buffer *b) {
+    return b->dired ? b->dired->sort : DIRED_SORT_NAME;
+}
+
+int buffer_dired_narrow(Buffer *b, const char *filter, int fuzzy, int *cy) {
+    buffer_will_change(b);
+    Dired *d = b->dired;
+    if (!d) {
+        errno = ENOTDIR;
+        return -1;
+    }
+    if (d->growing) {
+        errno = EBUSY;
+        return -1;
+    }
+    buffer_dired_finish(b, cy);
+    if (dired_index_busy(b)) buffer_drop_index(b);
+    if (filter && !filter[0]) filter = NULL;
+    if (!filter && !d->filter) return d->nrows;
+    // a filter that only adds to the end of the last one keeps fewer of
+    // the same rows, so only those are looked at
+    int narrower = filter && d->filter && fuzzy == d->fuzzy
+                   && strncmp(filter, d->filter, strlen(d->filter)) == 0;
+    int n = d->nrows;
+    int *row_of = xmalloc((d->n + 1) * sizeof(int));
+    for (int i = 0; i < d->n; ++i) row_of[i] = -1;
+    for (int k = 0; k < n; ++k) row_of[d->order[k]] = k;
+    int *was = xmalloc((n + 1) * sizeof(int));
+    memcpy(was, d->order, n * sizeof(int));
+    int at = *cy >= 2 && *cy < 2 + n ? d->order[*cy - 2] : -1;
+
+    if (d->filter) search_pattern_free(&d->pat);
+    free(d->filter);
+    d->filter = NULL;
+    if (filter) {
+        // smart case, as in isearch
+        int fold = 1;
+        for (const char *p = filter; *p; ++p) {
+            if (isupper((unsigned char)*p)) fold = 0;
+        }
+        d->filter = xstrdup(filter);
+        d->fuzzy = fuzzy;
+        search_compile(&d->pat, filter, strlen(filter), fold);
+    }
+    if (narrower) {
+        int m = 0;
+        for (int k = 0; k < n; ++k) {
+            if (dired_matches(d, d->ents[d->order[k]].name)) d->order[m++] = d->order[k];
+        }
+        d->nrows = m;
+    } else {
+        dired_order_rows(d);
+    }
+
+    // the rows still shown keep their text, and the ones shown again get
+    // back theirs if it is not out of date
+    int m = d->nrows;
+    char **rows = xmalloc((m + 1) * sizeof(char*));
+    for (int k = 0; k < m; ++k) {
+        int e = d->order[k];
+        char *row = NULL;
+        if (row_of[e] >= 0) {
+            row = b->lines[2 + row_of[e]];
+            b->lines[2 + row_of[e]] = NULL;
+        } else if (d->hidden && d->hidden[e]) {
+            row = d->hidden[e];
+            d->hidden[e] = NULL;
+            if (d->ents[e].layout != d->layout) {
+                free(row);
+                row = NULL;
+            }
+        }
+        rows[k] = row ? row : dired_row_text(d, e);
+    }
+    if (d->filter && !d->hidden) {
+        d->hidden = xmalloc((d->n + 1) * sizeof(char*));
+        memset(d->hidden, 0, (d->n + 1) * sizeof(char*));
+    }
+    // the rows no longer shown
+    for (int k = 0; k < n; ++k) {
+        if (!b->lines[2 + k]) continue;
+        if (d->hidden) d->hidden[was[k]] = b->lines[2 + k];
+        else free(b->lines[2 + k]);
+    }
+    if (!d->filter) dired_free_hidden(d);
+    buffer_ensure_capacity(b, m + 2);
+    memcpy(b->lines + 2, rows, m * sizeof(char*));
+    b->nlines = 2 + m;
+    free(rows);
+    free(was);
+    free(row_of);
+
+    // the cursor stays with its entry if that is still shown
+    *cy = 2;
+    for (int k = 0; k < m && at >= 0; ++k) {
+        if (d->order[k] == at) *cy = 2 + k;
+    }
+    if (*cy >= b->nlines) *cy = b->nlines - 1;
+    buffer_changed(b, 2, m, m - n);
+    b->modified = 0;
+    return m;
+}
+
+const char *buffer_dired_filter(const Buffer *b, int *fuzzy) {
+    *fuzzy = b->dired && b->dired->fuzzy;
+    return b->dired ? b->dired->filter : NULL;
+}
+
+int buffer_dired_count(const Buffer *b) {
+    return b->dired ? b->dired->n : 0;
+}
+
+// Listings the buffer went away from are kept, rows and all, so going
+// back to one shows it at once: it is shown again as it was if its
+// directory's mtime and ctime say nothing was added, removed or renamed
+// in it since it was read, and read again otherwise. At most this many
+// entries are kept in all; the listings left longest ago go first.
+#define DIRED_CACHE_ENTRIES 100000
+
+typedef struct {
+    char *path;
+    Dired *d;
+    char **lines;        // its rows
+    int nlines, capacity;
+} DiredCached;
+
+static DiredCached *dired_cache; // the most recently left first
+static int dired_ncached, dired_cache_cap;
+static long dired_cached_entries;
+
+static void dired_cache_remove(int i) {
+    dired_cached_entries -= dired_cache[i].d->n;
+    memmove(dired_cache + i, dired_cache + i + 1, (dired_ncached - i - 1) * sizeof(DiredCached));
+    dired_ncached--;
+}
+
+static void dired_cached_free(DiredCached *c) {
+    for (int i = 0; i < c->nlines; ++i) free(c->lines[i]);
+    free(c->lines);
+    free(c->path);
+    dired_free(c->d);
+}
+
+static int dired_cache_find(const char *path) {
+    for (int i = 0; i < dired_ncached; ++i) {
+        if (strcmp(dired_cache[i].path, path) == 0) return i;
+    }
+    return -1;
+}
+
+// The buffer lets go of its listing: keep it, with the rows, in the
+// cache. A listing not read through is dropped instead.
+static void dired_stash(Buffer *b) {
+    buffer_will_change(b);
+    Dired *d = b->dired;
+    if (!d) return;
+    if (d->loading || d->found || !d->stamped || d->n > DIRED_CACHE_ENTRIES) {
+        dired_drop(b);
+        return;
+    }
+    // it comes back whole, like one read again
+    if (d->filter) buffer_dired_narrow(b, NULL, 0, &d->view_cy);
+    int i = dired_cache_find(b->filename);
+    if (i >= 0) {
+        DiredCached old = dired_cache[i];
+        dired_cache_remove(i);
+        dired_cached_free(&old);
+    }
+    while (dired_ncached > 0 && dired_cached_entries + d->n > DIRED_CACHE_ENTRIES) {
+        DiredCached old = dired_cache[dired_ncached - 1];
+        dired_cache_remove(dired_ncached - 1);
+        dired_cached_free(&old);
+    }
+    if (dired_ncached == dired_cache_cap) {
+        dired_cache_cap = dired_cache_cap ? dired_cache_cap * 2 : 16;
+        dired_cache = xrealloc(dired_cache, dired_cache_cap * sizeof(DiredCached));
+    }
+    memmove(dired_cache + 1, dired_cache, dired_ncached * sizeof(DiredCached));
+    dired_ncached++;
+    dired_cached_entries += d->n;
+    // a watch is opened again if the listing is, and its trees added up
+    dired_watch_close(d);
+    dired_du_stop(d);
+    DiredCached *c = &dired_cache[0];
+    c->path = xstrdup(b->filename);
+    c->d = d;
+    c->lines = b->lines;
+    c->nlines = b->nlines;
+    c->capacity = b->capacity;
+    b->dired = NULL;
+    b->capacity = 16;
+    b->lines = xmalloc(b->capacity * sizeof(char*));
+    b->nlines = 0;
+}
+
+void buffer_dired_leave(Buffer *b, int cy, int top) {
+    if (!b->dired) return;
+    b->dired->view_cy = cy;
+    b->dired->view_top = top;
+}
+
+int buffer_dired_view(const Buffer *b, int *top) {
+    if (!b->dired) {
+        *top = 0;
+        return 2;
+    }
+    *top = b->dired->view_top;
+    return b->dired->view_cy;
+}
+
+int buffer_load_dir(Buffer *b, const char *path) {
+    buffer_will_change(b);
+    char real[PATH_MAX];
+    if (!realpath(path, real)) return -1;
+    struct stat st;
+    if (stat(real, &st) != 0) return -1;
+    // a listing read again keeps its order, its watch and dired-du-mode
+    int sort = b->dired ? b->dired->sort : DIRED_SORT_NAME;
+    int watch = b->dired && b->dired->watch;
+    int du = b->dired && b->dired->du;
+    // the buffer's listing is kept unless this lists its directory again
+    int again = b->is_dired && b->filename && strcmp(b->filename, real) == 0;
+
+    // a kept listing of an unchanged directory is shown as it was left;
+    // of a changed one, the cursor goes back to the entry it was on
+    char *at = NULL;
+    int at_dy = 0;
+    int ci = dired_cache_find(real);
+    if (ci >= 0) {
+        DiredCached c = dired_cache[ci];
+        dired_cache_remove(ci);
+        if (dired_unchanged(c.d, &st)) {
+            buffer_drop_index(b);
+            if (again) {
+                dired_drop(b);
+            } else {
+                dired_stash(b);
+            }
+            for (int i = 0; i < b->nlines; ++i) free(b->lines[i]);
+            free(b->lines);
+            buffer_clear_undo(b);
+            b->lines = c.lines;
+            b->nlines = c.nlines;
+            b->capacity = c.capacity;
+            b->dired = c.d;
+            free(b->filename);
+            b->filename = c.path;
+            buffer_changed(b, 0, b->nlines, 0);
+            b->modified = 0;
+            b->readonly = 1;
+            b->is_dired = 1;
+            b->is_occur = 0;
+            b->is_grep = 0;
+            if (watch && dired_watch_open(c.d, real) == 0) c.d->watch = 1;
+            else c.d->watch = 0;
+            if (c.d->sort != sort) c.d->view_cy = buffer_dired_sort(b, sort, c.d->view_cy);
+            // the totals it shows are added up again, from du_tree()'s
+            // cache where the directories under it did not change
+            c.d->du = du;
+            if (du) dired_du_start(b, 1, 0);
+            else dired_du_clear(b);
+            return 0;
+        }
+        const char *name = c.d->view_cy >= 2 && c.d->view_cy < c.nlines
+                           ? c.d->ents[c.d->order[c.d->view_cy - 2]].name : NULL;
+        if (name) {
+            at = xstrdup(name);
+            at_dy = c.d->view_cy - c.d->view_top;
+        }
+        dired_cached_free(&c);
+    }
+
+    DIR *dir = opendir(real);
+    if (!dir) {
+        free(at);
+        return -1;
+    }
+
+    Dired *d = xmalloc(sizeof(Dired));
+    memset(d, 0, sizeof(*d));
+    // the watch starts first so that no change slips by
+    d->sort = sort;
+    d->du = du;
+    d->watch_fd = -1;
+    if (watch && dired_watch_open(d, real) == 0) d->watch = 1;
+    dired_stamp(d, dirfd(dir));
+
+    // the names are all there is to sort by, so the rows keep their
+    // places while the stats come in
+    int n;
+    char **names = dired_read_names(dir, &n);
+    d->view_cy = 2;
+    if (at) {
+        char **hit = n > 0 ? bsearch(&at, names, n, sizeof(char*), dired_name_cmp) : NULL;
+        if (hit) {
+            d->view_cy = 2 + (int)(hit - names);
+            d->view_top = d->view_cy - at_dy > 0 ? d->view_cy - at_dy : 0;
+        }
+        free(at);
+    }
+    d->n = d->nrows = n;
+    d->ents = xmalloc((n + 1) * sizeof(DiredEnt));
+    memset(d->ents, 0, (n + 1) * sizeof(DiredEnt));
+    d->order = xmalloc((n + 1) * sizeof(int));
+    for (int i = 0; i < n; ++i) {
+        d->ents[i].name = names[i];
+        d->order[i] = i;
+    }
+    free(names);
+    d->now = time(NULL);
+    tzset();
+    d->w_nlink = d->w_owner = d->w_group = d->w_size = 1;
+    d->layout = 1;
+    d->loading = 1;
+    d->dir = dir;
+    d->dfd = dirfd(dir);
+    d->nchunks = (n + DIRED_STAT_CHUNK - 1) / DIRED_STAT_CHUNK;
+    d->done = xmalloc(d->nchunks + 1);
+    d->shown = xmalloc(d->nchunks + 1);
+    memset(d->done, 0, d->nchunks + 1);
+    memset(d->shown, 0, d->nchunks + 1);
+
+    // rebuild the buffer as a listing of the names
+    buffer_drop_index(b);
+    if (again) {
+        dired_drop(b);
+    } else {
+        dired_stash(b);
+    }
     for (int i = 0; i < b->nlines; ++i) free(b->lines[i]);
     b->nlines = 0;
     buffer_clear_undo(b);
     buffer_ensure_capacity(b, n + 2);
 
     char header[PATH_MAX + 8];
-    snprintf(header, sizeof(header), "%s:", real);
-    b->lines[b->nlines++] = xstrdup(header);
-    char total[64];
-    snprintf(total, sizeof(total), "total %lld", total_blocks);
-    b->lines[b->nlines++] = xstrdup(total);
-
+    snprintf(header, sizeof(header), "  %s:", real);
+    b->lines[0] = xstrdup(header);
+    b->lines[1] = NULL;
+    dired_set_total(b, 0);
     for (int i = 0; i < n; ++i) {
-        DiredEnt *e = &ents[i];
-        char line[PATH_MAX * 2 + 256];
-        snprintf(line, sizeof(line), "%s %*ld %-*s %-*s %*lld %s %s%s%s",
-                 e->perms,
-                 w_nlink, e->nlink,
-                 w_owner, e->owner,
-                 w_group, e->group,
-                 w_size, e->size,
-                 e->mtime,
-                 e->name,
-                 e->link_target ? " -> " : "",
-                 e->link_target ? e->link_target : "");
-        b->lines[b->nlines++] = xstrdup(line);
-        free(e->name);
-        free(e->link_target);
+        b->lines[2 + i] = NULL;
+        dired_set_row(b, d, i);
     }
-    free(ents);
+    b->nlines = 2 + n;
 
     free(b->filename);
     b->filename = xstrdup(real);
+    buffer_changed(b, 0, b->nlines, 0);
     b->modified = 0;
     b->readonly = 1;
     b->is_dired = 1;
+    b->is_occur = 0;
+    b->is_grep = 0;
+    b->dired = d;
+
+    // with no threads the chunk runs before job_start() returns
+    job_start(&d->job, d->nchunks, d->nchunks > 1 ? job_threads() : 0, dired_stat_chunk, d);
+    if (job_done(&d->job)) buffer_dired_finish(b, &d->view_cy);
     return 0;
 }
 
+static int dired_path_order_cmp(const void *a, const void *b) {
+    return dired_path_cmp(sort_ents[*(const int *)a].name, sort_ents[*(const int *)b].name);
+}
+
+int buffer_dired_begin(Buffer *b, const char *dir, const char *what) {
+    buffer_will_change(b);
+    char real[PATH_MAX];
+    if (!realpath(dir, real)) return -1;
+    Dired *d = xmalloc(sizeof(Dired));
+    memset(d, 0, sizeof(*d));
+    d->sort = b->dired ? b->dired->sort : DIRED_SORT_NAME;
+    d->watch_fd = -1;
+    d->found = 1;
+    d->growing = 1;
+    d->cap = 256;
+    d->ents = xmalloc(d->cap * sizeof(DiredEnt));
+    d->order = xmalloc(d->cap * sizeof(int));
+    d->now = time(NULL);
+    tzset();
+    d->w_nlink = d->w_owner = d->w_group = d->w_size = 1;
+    d->layout = 1;
+
+    buffer_drop_index(b);
+    dired_stash(b);
+    for (int i = 0; i < b->nlines; ++i) free(b->lines[i]);
+    b->nlines = 0;
+    buffer_clear_undo(b);
+    buffer_ensure_capacity(b, 2);
+    char header[PATH_MAX + 256];
+    snprintf(header, sizeof(header), "  %s: find %s", real, what);
+    b->lines[0] = xstrdup(header);
+    b->lines[1] = NULL;
+    dired_set_total(b, 0);
+    b->nlines = 2;
+
+    free(b->filename);
+    b->filename = xstrdup(real);
+    buffer_changed(b, 0, b->nlines, 0);
+    b->modified = 0;
+    b->readonly = 1;
+    b->is_dired = 1;
+    b->is_occur = 0;
+    b->is_grep = 0;
+    b->dired = d;
+    return 0;
+}
+
+void buffer_dired_add(Buffer *b, DiredFile *files, int n) {
+    Dired *d = b->dired;
+    if (!d || !d->growing || n <= 0) return;
+    if (d->n + n > d->cap) {
+        while (d->n + n > d->cap) d->cap *= 2;
+        d->ents = xrealloc(d->ents, d->cap * sizeof(DiredEnt));
+        d->order = xrealloc(d->order, d->cap * sizeof(int));
+    }
+    buffer_ensure_capacity(b, 2 + d->n + n);
+    int w[4] = { d->w_nlink, d->w_owner, d->w_group, d->w_size };
+    for (int i = 0; i < n; ++i) {
+        DiredEnt *e = &d->ents[d->n + i];
+        memset(e, 0, sizeof(*e));
+        e->name = files[i].name;
+        e->link_target = files[i].link_target;
+        dired_ent_set(d, e, &files[i].st);
+        d->total_blocks += e->blocks;
+        dired_fit(d, e, w);
+        d->order[d->n + i] = d->n + i;
+        b->lines[2 + d->n + i] = NULL;
+    }
+    // the rows before these are redone once they are on screen
+    dired_set_widths(d, w);
+    int first = d->n;
+    d->n += n;
+    d->nrows = d->n;
+    for (int k = first; k < d->n; ++k) dired_set_row(b, d, k);
+    b->nlines = 2 + d->n;
+    dired_set_total(b, d->total_blocks);
+    buffer_changed(b, 1, 1, 0);
+    buffer_changed(b, 2 + first, n, n);
+    b->modified = 0;
+}
+
+void buffer_dired_end(Buffer *b, int *cy) {
+    Dired *d = b->dired;
+    if (!d || !d->growing) return;
+    int n = d->n;
+    int at = cy && *cy >= 2 && *cy < 2 + n ? d->order[*cy - 2] : -1;
+    // the entries go in path order, which the rows then follow
+    int *perm = xmalloc((n + 1) * sizeof(int));
+    for (int i = 0; i < n; ++i) perm[i] = i;
+    sort_ents = d->ents;
+    qsort(perm, n, sizeof(int), dired_path_order_cmp);
+    DiredEnt *ents = xmalloc((d->cap + 1) * sizeof(DiredEnt));
+    int moved = -1;
+    for (int i = 0; i < n; ++i) {
+        ents[i] = d->ents[perm[i]];
+        if (perm[i] == at) moved = i;
+    }
+    at = moved;
+    free(perm);
+    free(d->ents);
+    d->ents = ents;
+    d->growing = 0;
+    for (int i = 0; i < n; ++i) d->order[i] = i;
+    if (d->sort != DIRED_SORT_NAME) dired_sort_order(d);
+    for (int k = 0; k < n; ++k) {
+        dired_set_row(b, d, k);
+        if (cy && d->order[k] == at) *cy = 2 + k;
+    }
+    buffer_changed(b, 2, n, 0);
+    b->modified = 0;
+}
+
+int buffer_dired_found(const Buffer *b) {
+    return b->dired && b->dired->found;
+}
+
 int buffer_save_file(Buffer *b, const char *path) {
     FILE *f = fopen(path, "w");
     if (!f) return -1;
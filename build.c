@@ -14,17 +14,27 @@ int main() {
         { "buffer.c", "out/buffer.o" },
         { "display.c", "out/display.o" },
         { "input.c", "out/input.o" },
+        { "killring.c", "out/killring.o" },
+        { "search.c", "out/search.o" },
+        { "regex.c", "out/regex.o" },
+        { "jobs.c", "out/jobs.o" },
+        { "trigram.c", "out/trigram.o" },
+        { "grep.c", "out/grep.o" },
+        { "find.c", "out/find.o" },
+        { "du.c", "out/du.o" },
+        { "fileop.c", "out/fileop.o" },
+        { "preview.c", "out/preview.o" },
     };
 
     for (size_t i = 0; i < ARRAY_LEN(source_files); i++) {
         push(&cmd, "cc", "-c", source_files[i][0]);
-        push(&cmd, "-g", "-O2", "-Wall", "-Wextra", "-std=c99");
+        push(&cmd, "-g", "-O2", "-Wall", "-Wextra", "-std=c99", "-pthread");
         push(&cmd, "-o", source_files[i][1]);
         if (!run(&cmd)) return EXIT_FAILURE;
     }
 
     push(&cmd, "cc", "-g", "-O2", "-Wall", "-Wextra");
-    push(&cmd, "-std=c99", "-lncurses");
+    push(&cmd, "-std=c99", "-pthread", "-lncurses");
     for (size_t i = 0; i < ARRAY_LEN(source_files); i++) {
         push(&cmd, source_files[i][1]);
     }
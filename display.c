@@ -24,8 +24,15 @@ void editor_update_screen_size(EditorState *E) {
     if (E->screen_cols < 1) E->screen_cols = 1;
 }
 
+int editor_preview_rows(EditorState *E) {
+    if (!E->preview || !E->buf->is_dired) return 0;
+    int rows = (E->screen_rows - 2) / 2;
+    return rows >= 2 ? rows : 0;
+}
+
 static int text_rows(EditorState *E) {
-    int rows = E->screen_rows - 2; // keep last 2 lines for status & minibuffer
+    // keep last 2 lines for status & minibuffer, and dired-preview-mode's
+    int rows = E->screen_rows - 2 - editor_preview_rows(E);
     return rows > 0 ? rows : 1;
 }
 
@@ -76,47 +83,160 @@ int editor_region_bounds(EditorState *E, int *sy, int *sx, int *ey, int *ex) {
     return 1;
 }
 
+// What each text row showed at the last draw. A row is only repainted
+// when its line or the line's stamp, the horizontal scroll or its
+// attribute runs differ; ncurses then sends just the changed cells.
+typedef struct {
+    const char *line;       // NULL past the end of the buffer
+    unsigned long stamp;
+    int col_offset;
+    unsigned long runs;     // hash of the row's attribute runs
+} RowState;
+
+// An attribute over screen columns [start, end) of a row. Runs are
+// applied in order, so later ones win where they overlap.
+typedef struct {
+    int start, end;
+    attr_t attr;
+} AttrRun;
+
+static RowState *drawn;
+static int drawn_rows, drawn_cols;
+static unsigned long drawn_preview; // Preview.id of the preview shown, 0 for none
+static int preview_drawn;
+static chtype *cells;
+static AttrRun *runs;
+static int nruns, runs_cap;
+
+static void push_run(int start, int end, attr_t attr, int col_offset, int cols) {
+    start -= col_offset;
+    end -= col_offset;
+    if (start < 0) start = 0;
+    if (end > cols) end = cols;
+    if (start >= end) return;
+    if (nruns == runs_cap) {
+        runs_cap = runs_cap ? runs_cap * 2 : 16;
+        runs = xrealloc(runs, runs_cap * sizeof(AttrRun));
+    }
+    runs[nruns].start = start;
+    runs[nruns].end = end;
+    runs[nruns].attr = attr;
+    nruns++;
+}
+
+static unsigned long runs_hash(void) {
+    unsigned long h = 14695981039346656037UL;
+    for (int i = 0; i < nruns; ++i) {
+        unsigned long v[3] = { (unsigned long)runs[i].start, (unsigned long)runs[i].end,
+                               (unsigned long)runs[i].attr };
+        for (int k = 0; k < 3; ++k) h = (h ^ v[k]) * 1099511628211UL;
+    }
+    return h;
+}
+
+// The cell a byte starts with when drawn by addch(): tab and the
+// cursor-moving controls leave a blank, other bytes the first character
+// of their unctrl() form.
+static chtype cell_char(unsigned char c) {
+    if (c == '\t' || c == '\b' || c == '\r') return ' ';
+    return (chtype)(unsigned char)unctrl(c)[0];
+}
+
+// dired-preview-mode's area, rows [top, top + prows): a title, then the
+// preview's lines, from their first column. Drawn again only when it
+// shows another preview.
+static void draw_preview(EditorState *E, int top, int prows) {
+    const Preview *p = E->preview_shown;
+    unsigned long id = p ? p->id : 0;
+    if (preview_drawn && drawn_preview == id) return;
+    preview_drawn = 1;
+    drawn_preview = id;
+    int cols = E->screen_cols;
+
+    char title[512];
+    if (p) snprintf(title, sizeof(title), " Preview: %s  (%lld bytes)", p->path, p->size);
+    else snprintf(title, sizeof(title), " Preview: no file on this line");
+    attron(A_REVERSE);
+    mvaddnstr(top, 0, title, cols);
+    for (int i = (int)strlen(title); i < cols; ++i) mvaddch(top, i, ' ');
+    attroff(A_REVERSE);
+
+    for (int i = 1; i < prows; ++i) {
+        const char *ln = NULL;
+        if (p && p->note[0]) ln = i == 1 ? p->note : NULL;
+        else if (p && i - 1 < p->nlines) ln = p->lines[i - 1];
+        int len = ln ? (int)strlen(ln) : 0;
+        for (int c = 0; c < cols; ++c) cells[c] = c < len ? cell_char((unsigned char)ln[c]) : ' ';
+        mvaddchnstr(top + i, 0, cells, cols);
+    }
+}
+
 void editor_draw(EditorState *E, const char *message) {
     editor_update_screen_size(E);
     editor_clamp_cursor(E);
     editor_scroll_to_cursor(E);
 
-    erase();
     int rows = text_rows(E);
     int cols = E->screen_cols;
+    if (rows != drawn_rows || cols != drawn_cols) {
+        // new geometry: every row is repainted below
+        drawn = xrealloc(drawn, rows * sizeof(RowState));
+        memset(drawn, 0, rows * sizeof(RowState));
+        cells = xrealloc(cells, cols * sizeof(chtype));
+        drawn_rows = rows;
+        drawn_cols = cols;
+        preview_drawn = 0;
+        erase();
+    }
 
     int sy = 0, sx = 0, ey = 0, ex = 0;
     int has_region = editor_region_bounds(E, &sy, &sx, &ey, &ex);
+    Highlight *hl = E->highlight;
 
     // draw buffer lines
     for (int i = 0; i < rows; ++i) {
         int lineno = E->row_offset + i;
-        if (lineno >= E->buf->nlines) break;
-        const char *ln = E->buf->lines[lineno];
-        int len = (int)strlen(ln);
-
-        // selection span on this line, in buffer columns
-        int hs = -1, he = -1;
-        if (has_region && lineno >= sy && lineno <= ey) {
-            hs = (lineno == sy) ? sx : 0;
-            he = (lineno == ey) ? ex : len;
+        const char *ln = lineno < E->buf->nlines ? E->buf->lines[lineno] : NULL;
+        int len = ln ? (int)strlen(ln) : 0;
+
+        nruns = 0;
+        if (ln && hl) {
+            int n;
+            const int *spans = highlight_line(hl, E->buf, lineno, rows, &n);
+            for (int k = 0; k < n && spans[2 * k] < E->col_offset + cols; ++k)
+                push_run(spans[2 * k], spans[2 * k + 1], A_UNDERLINE, E->col_offset, cols);
         }
-
-        for (int col = E->col_offset; col < len && col - E->col_offset < cols; ++col) {
-            int highlighted = (hs >= 0 && col >= hs && col < he);
-            if (highlighted) attron(A_REVERSE);
-            mvaddch(i, col - E->col_offset, (chtype)(unsigned char)ln[col]);
-            if (highlighted) attroff(A_REVERSE);
+        if (ln && has_region && lineno >= sy && lineno <= ey) {
+            int hs = (lineno == sy) ? sx : 0;
+            int he = (lineno == ey) ? ex : len;
+            // the line's newline is selected when the region continues past it
+            if (he >= len && lineno < ey) he = len + 1;
+            push_run(hs, he, A_REVERSE, E->col_offset, cols);
         }
-        // show selection of the line's newline (region continues past EOL)
-        if (hs >= 0 && he >= len && lineno < ey && len - E->col_offset >= 0
-            && len - E->col_offset < cols) {
-            attron(A_REVERSE);
-            mvaddch(i, len - E->col_offset, ' ');
-            attroff(A_REVERSE);
+        if (ln && hl && hl->cur_len > 0 && hl->cur_y == lineno)
+            push_run(hl->cur_x, hl->cur_x + hl->cur_len, A_REVERSE, E->col_offset, cols);
+
+        RowState st = { ln, ln ? buffer_line_stamp(E->buf, lineno) : 0, E->col_offset, runs_hash() };
+        RowState *old = &drawn[i];
+        if (old->line == st.line && old->stamp == st.stamp
+            && old->col_offset == st.col_offset && old->runs == st.runs)
+            continue;
+        *old = st;
+
+        for (int c = 0; c < cols; ++c) {
+            int col = E->col_offset + c;
+            cells[c] = col < len ? cell_char((unsigned char)ln[col]) : ' ';
         }
+        for (int r = 0; r < nruns; ++r)
+            for (int c = runs[r].start; c < runs[r].end; ++c)
+                cells[c] = (cells[c] & A_CHARTEXT) | runs[r].attr;
+        mvaddchnstr(i, 0, cells, cols);
     }
 
+    int prows = editor_preview_rows(E);
+    if (prows > 0) draw_preview(E, rows, prows);
+    rows += prows;
+
     // status line
     attron(A_REVERSE);
     char status[512];
@@ -133,11 +253,12 @@ void editor_draw(EditorState *E, const char *message) {
 
     // minibuffer line
     mvaddnstr(rows + 1, 0, message && *message ? message : E->minibuf, cols);
+    clrtoeol();
 
     // move cursor
     int curs_y = E->cy - E->row_offset;
     int curs_x = E->cx - E->col_offset;
-    if (curs_y >= 0 && curs_y < rows && curs_x >= 0 && curs_x < cols)
+    if (curs_y >= 0 && curs_y < rows - prows && curs_x >= 0 && curs_x < cols)
         move(curs_y, curs_x);
     else
         move(rows, 0);
@@ -0,0 +1,273 @@
+/*
+ * du.c
+ *
+ * Recursive directory sizes, for M-x dired-du-mode.
+ *
+ * Created at:  18. Oct 2026
+ * Author:      Raphaele Salvatore Licciardo
+ *
+ *
+ * Copyright (c) 2025 Raphaele Salvatore Licciardo
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "includes/du.h"
+#include "includes/buffer.h"
+
+// A file with several links, counted once per tree.
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    long long size;      // -1 in a free slot of a set
+} DuLink;
+
+// What reading a directory gives.
+typedef struct {
+    long long own;       // its size and its entries', but for the ones below
+    char *subdirs;       // the subdirectories' names, each ending in '\0'
+    size_t subdirs_len;
+    DuLink *links;       // the files with several links
+    int nlinks;
+} DuRead;
+
+typedef struct {
+    int used;
+    dev_t dev;
+    ino_t ino;
+    time_t mtime, ctime; // the directory's when it was read
+    DuRead r;
+} DuDir;
+
+// ------------------------------------------------------------------
+// the cache: open addressing on (dev, ino) with linear probing; cap is
+// a power of two
+
+static pthread_mutex_t du_lock = PTHREAD_MUTEX_INITIALIZER;
+static DuDir *du_dirs;
+static int du_cap, du_n;
+
+static unsigned long du_hash(dev_t dev, ino_t ino) {
+    unsigned long long h = (unsigned long long)ino * 0x9E3779B97F4A7C15ull;
+    h ^= (unsigned long long)dev;
+    return (unsigned long)(h ^ (h >> 29));
+}
+
+static DuDir *du_slot(DuDir *dirs, int cap, dev_t dev, ino_t ino) {
+    int i = (int)(du_hash(dev, ino) & (unsigned long)(cap - 1));
+    while (dirs[i].used && (dirs[i].dev != dev || dirs[i].ino != ino)) i = (i + 1) & (cap - 1);
+    return &dirs[i];
+}
+
+static void du_read_free(DuRead *r) {
+    free(r->subdirs);
+    free(r->links);
+}
+
+static void du_read_copy(DuRead *to, const DuRead *r) {
+    *to = *r;
+    to->subdirs = xmalloc(r->subdirs_len + 1);
+    if (r->subdirs_len > 0) memcpy(to->subdirs, r->subdirs, r->subdirs_len);
+    to->links = xmalloc((r->nlinks + 1) * sizeof(DuLink));
+    if (r->nlinks > 0) memcpy(to->links, r->links, r->nlinks * sizeof(DuLink));
+}
+
+static void du_cache_grow(void) {
+    DuDir *old = du_dirs;
+    int oldcap = du_cap;
+    du_cap = oldcap ? oldcap * 2 : 1024;
+    du_dirs = xmalloc(du_cap * sizeof(DuDir));
+    memset(du_dirs, 0, du_cap * sizeof(DuDir));
+    for (int i = 0; i < oldcap; ++i) {
+        if (old[i].used) *du_slot(du_dirs, du_cap, old[i].dev, old[i].ino) = old[i];
+    }
+    free(old);
+}
+
+static void du_cache_clear(void) {
+    for (int i = 0; i < du_cap; ++i) {
+        if (du_dirs[i].used) du_read_free(&du_dirs[i].r);
+        du_dirs[i].used = 0;
+    }
+    du_n = 0;
+}
+
+// A copy of what the directory `st` held when it was last read, if it
+// has not changed since.
+static int du_cache_get(const struct stat *st, DuRead *out) {
+    int hit = 0;
+    pthread_mutex_lock(&du_lock);
+    if (du_cap > 0) {
+        DuDir *s = du_slot(du_dirs, du_cap, st->st_dev, st->st_ino);
+        if (s->used && s->mtime == st->st_mtime && s->ctime == st->st_ctime) {
+            du_read_copy(out, &s->r);
+            hit = 1;
+        }
+    }
+    pthread_mutex_unlock(&du_lock);
+    return hit;
+}
+
+// Keep a copy of r, read from the directory `st` at `when`. Only whole
+// seconds are compared, so a directory changed in the second it was read
+// is not kept: it may have changed after.
+static void du_cache_put(const struct stat *st, time_t when, const DuRead *r) {
+    if (st->st_mtime >= when || st->st_ctime >= when) return;
+    pthread_mutex_lock(&du_lock);
+    DuDir *s = du_cap > 0 ? du_slot(du_dirs, du_cap, st->st_dev, st->st_ino) : NULL;
+    if (s && s->used) {
+        du_read_free(&s->r);
+    } else {
+        if (2 * (du_n + 1) > du_cap) {
+            if (du_n >= DU_CACHE_DIRS) du_cache_clear();
+            else du_cache_grow();
+        }
+        s = du_slot(du_dirs, du_cap, st->st_dev, st->st_ino);
+        s->used = 1;
+        s->dev = st->st_dev;
+        s->ino = st->st_ino;
+        du_n++;
+    }
+    s->mtime = st->st_mtime;
+    s->ctime = st->st_ctime;
+    du_read_copy(&s->r, r);
+    pthread_mutex_unlock(&du_lock);
+}
+
+// ------------------------------------------------------------------
+// walking a tree
+
+typedef struct {
+    Job *job;
+    int fresh;
+    int stopped;
+    char path[PATH_MAX]; // the directory being added up
+    long long total;
+    DuLink *seen;        // a set of the links counted
+    int nseen, seen_cap;
+} DuWalk;
+
+static int du_stopped(DuWalk *w) {
+    if (!w->stopped && w->job) {
+        job_lock(w->job);
+        w->stopped = w->job->cancel;
+        job_unlock(w->job);
+    }
+    return w->stopped;
+}
+
+static DuLink *du_seen_slot(DuLink *set, int cap, dev_t dev, ino_t ino) {
+    int i = (int)(du_hash(dev, ino) & (unsigned long)(cap - 1));
+    while (set[i].size >= 0 && (set[i].dev != dev || set[i].ino != ino)) i = (i + 1) & (cap - 1);
+    return &set[i];
+}
+
+// Count the file l unless the tree has counted it already.
+static void du_count_link(DuWalk *w, const DuLink *l) {
+    if (2 * (w->nseen + 1) > w->seen_cap) {
+        DuLink *old = w->seen;
+        int oldcap = w->seen_cap;
+        w->seen_cap = oldcap ? oldcap * 2 : 64;
+        w->seen = xmalloc(w->seen_cap * sizeof(DuLink));
+        for (int i = 0; i < w->seen_cap; ++i) w->seen[i].size = -1;
+        for (int i = 0; i < oldcap; ++i) {
+            if (old[i].size >= 0) *du_seen_slot(w->seen, w->seen_cap, old[i].dev, old[i].ino) = old[i];
+        }
+        free(old);
+    }
+    DuLink *s = du_seen_slot(w->seen, w->seen_cap, l->dev, l->ino);
+    if (s->size >= 0) return;
+    *s = *l;
+    w->nseen++;
+    w->total += l->size;
+}
+
+// Read the directory at w->path, which st is a stat of. One that cannot
+// be read counts only its own size.
+static void du_read(DuWalk *w, const struct stat *st, DuRead *r) {
+    memset(r, 0, sizeof(*r));
+    r->own = (long long)st->st_size;
+    time_t when = time(NULL);
+    DIR *dir = opendir(w->path);
+    if (!dir) return;
+    int dfd = dirfd(dir);
+    size_t subdirs_cap = 0;
+    int links_cap = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+        struct stat est;
+        if (fstatat(dfd, name, &est, AT_SYMLINK_NOFOLLOW) != 0) continue;
+        if (S_ISDIR(est.st_mode)) {
+            size_t len = strlen(name) + 1;
+            if (r->subdirs_len + len > subdirs_cap) {
+                subdirs_cap = subdirs_cap ? subdirs_cap * 2 : 256;
+                if (subdirs_cap < r->subdirs_len + len) subdirs_cap = r->subdirs_len + len;
+                r->subdirs = xrealloc(r->subdirs, subdirs_cap);
+            }
+            memcpy(r->subdirs + r->subdirs_len, name, len);
+            r->subdirs_len += len;
+        } else if (est.st_nlink > 1) {
+            if (r->nlinks == links_cap) {
+                links_cap = links_cap ? links_cap * 2 : 16;
+                r->links = xrealloc(r->links, links_cap * sizeof(DuLink));
+            }
+            DuLink *l = &r->links[r->nlinks++];
+            l->dev = est.st_dev;
+            l->ino = est.st_ino;
+            l->size = (long long)est.st_size;
+        } else {
+            r->own += (long long)est.st_size;
+        }
+    }
+    closedir(dir);
+    du_cache_put(st, when, r);
+}
+
+// Add the tree at w->path, of length len, to w->total; st is a stat of
+// the directory.
+static void du_walk(DuWalk *w, size_t len, const struct stat *st) {
+    if (du_stopped(w)) return;
+    DuRead r;
+    if (w->fresh || !du_cache_get(st, &r)) du_read(w, st, &r);
+    w->total += r.own;
+    for (int i = 0; i < r.nlinks; ++i) du_count_link(w, &r.links[i]);
+    for (size_t off = 0; off < r.subdirs_len && !w->stopped; ) {
+        const char *name = r.subdirs + off;
+        size_t nlen = strlen(name);
+        off += nlen + 1;
+        if (len + 1 + nlen >= sizeof(w->path)) continue;
+        w->path[len] = '/';
+        memcpy(w->path + len + 1, name, nlen + 1);
+        struct stat sst;
+        if (lstat(w->path, &sst) == 0 && S_ISDIR(sst.st_mode)) du_walk(w, len + 1 + nlen, &sst);
+    }
+    w->path[len] = '\0';
+    du_read_free(&r);
+}
+
+long long du_tree(const char *path, int fresh, Job *job) {
+    DuWalk w;
+    memset(&w, 0, sizeof(w));
+    w.job = job;
+    w.fresh = fresh;
+    size_t len = strlen(path);
+    if (len >= sizeof(w.path)) return -1;
+    memcpy(w.path, path, len + 1);
+    struct stat st;
+    if (lstat(path, &st) != 0 || !S_ISDIR(st.st_mode)) return -1;
+    du_walk(&w, len, &st);
+    free(w.seen);
+    return w.stopped ? -1 : w.total;
+}
@@ -0,0 +1,497 @@
+/*
+ * fileop.c
+ *
+ * Background copy, rename and delete, for dired's marked files.
+ *
+ * Created at:  18. Oct 2026
+ * Author:      Raphaele Salvatore Licciardo
+ *
+ *
+ * Copyright (c) 2025 Raphaele Salvatore Licciardo
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L
+// copy_file_range()
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#endif
+
+#include "includes/fileop.h"
+#include "includes/buffer.h"
+#include "includes/du.h"
+
+// Bytes copied by one call, between looks at whether to stop.
+#define FILEOP_CHUNK (8 << 20)
+// The buffer of the read() and write() fallback.
+#define FILEOP_BUF (128 << 10)
+
+static int op_stopped(FileOp *op) {
+    job_lock(&op->job);
+    int stop = op->job.cancel;
+    job_unlock(&op->job);
+    return stop;
+}
+
+// Count n more bytes copied. Returns -1 with errno ECANCELED if the
+// operation is being stopped.
+static int op_copied(FileOp *op, long long n) {
+    job_lock(&op->job);
+    op->copied += n;
+    int stop = op->job.cancel;
+    job_unlock(&op->job);
+    if (stop) {
+        errno = ECANCELED;
+        return -1;
+    }
+    return 0;
+}
+
+// Note errno as item k's error, about `path`, unless it has one.
+static void op_fail(FileOp *op, int k, const char *path) {
+    if (op->errs[k]) return;
+    op->errs[k] = errno ? errno : EIO;
+    op->failed[k] = xstrdup(path);
+}
+
+static char *join_path(const char *dir, const char *name) {
+    size_t len = strlen(dir) + strlen(name) + 2;
+    char *path = xmalloc(len);
+    snprintf(path, len, "%s/%s", dir, name);
+    return path;
+}
+
+// The names in the directory at `path`, but for . and ..; NULL if it
+// cannot be read.
+static char **read_names(const char *path, int *count) {
+    DIR *dir = opendir(path);
+    if (!dir) return NULL;
+    int cap = 16, n = 0;
+    char **names = xmalloc(cap * sizeof(char*));
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        if (n == cap) {
+            cap *= 2;
+            names = xrealloc(names, cap * sizeof(char*));
+        }
+        names[n++] = xstrdup(entry->d_name);
+    }
+    closedir(dir);
+    *count = n;
+    return names;
+}
+
+static void free_names(char **names, int n) {
+    for (int i = 0; i < n; ++i) free(names[i]);
+    free(names);
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, buf, len);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += w;
+        len -= (size_t)w;
+    }
+    return 0;
+}
+
+// Ways to copy data, from the cheapest.
+enum { COPY_RANGE, COPY_SENDFILE, COPY_READ };
+
+// Copy up to a chunk from in to out the way `how` says. Returns the
+// bytes copied, 0 at the end of in, or -1.
+static ssize_t copy_step(int in, int out, int how, char *buf) {
+#ifdef __linux__
+    if (how == COPY_RANGE) return copy_file_range(in, NULL, out, NULL, FILEOP_CHUNK, 0);
+    if (how == COPY_SENDFILE) return sendfile(out, in, NULL, FILEOP_CHUNK);
+#endif
+    (void)how;
+    ssize_t r = read(in, buf, FILEOP_BUF);
+    if (r > 0 && write_all(out, buf, (size_t)r) < 0) return -1;
+    return r;
+}
+
+// Whether `how` cannot copy between these files at all, so the next way
+// should be tried.
+static int copy_unsupported(int err) {
+    return err == EXDEV || err == EINVAL || err == ENOSYS || err == EOPNOTSUPP
+           || err == ENOTSUP || err == EBADF;
+}
+
+// Copy the data of in, from its start, to out, which is empty.
+static int copy_data(FileOp *op, int in, int out, long long size) {
+#ifdef FICLONE
+    // the filesystem shares the blocks: nothing is copied
+    if (ioctl(out, FICLONE, in) == 0) return op_copied(op, size);
+#endif
+#ifdef __linux__
+    int how = COPY_RANGE;
+#else
+    int how = COPY_READ;
+#endif
+    char *buf = NULL;
+    long long done = 0;
+    for (;;) {
+        if (how == COPY_READ && !buf) buf = xmalloc(FILEOP_BUF);
+        ssize_t r = copy_step(in, out, how, buf);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0 && done == 0 && how != COPY_READ && copy_unsupported(errno)) {
+            how++;
+            continue;
+        }
+        if (r < 0) break;
+        if (r == 0) {
+            free(buf);
+            return 0;
+        }
+        done += r;
+        if (op_copied(op, r) < 0) break;
+    }
+    int err = errno;
+    free(buf);
+    errno = err;
+    return -1;
+}
+
+// Copy the regular file src, whose stat is st, to the new file dst. A
+// copy that fails, or is stopped, is removed.
+static void copy_file(FileOp *op, int k, const char *src, const char *dst, const struct stat *st) {
+    int in = open(src, O_RDONLY);
+    if (in < 0) {
+        op_fail(op, k, src);
+        return;
+    }
+    // the permission bits only: like cp without -p, a copy (now owned by
+    // whoever runs the editor) is not made setuid, setgid or sticky
+    int out = open(dst, O_WRONLY | O_CREAT | O_EXCL, st->st_mode & 0777);
+    if (out < 0) {
+        op_fail(op, k, dst);
+        close(in);
+        return;
+    }
+    int r = copy_data(op, in, out, (long long)st->st_size);
+    if (r == 0) {
+        struct timespec times[2] = { st->st_atim, st->st_mtim };
+        fchmod(out, st->st_mode & 0777);
+        futimens(out, times);
+    }
+    if (close(out) != 0 && r == 0) r = -1;
+    if (r < 0) {
+        op_fail(op, k, dst);
+        unlink(dst);
+    }
+    close(in);
+}
+
+// Copy src to dst, which does not exist, with everything under it.
+static void copy_tree(FileOp *op, int k, const char *src, const char *dst) {
+    if (op_stopped(op)) {
+        errno = ECANCELED;
+        op_fail(op, k, src);
+        return;
+    }
+    struct stat st;
+    if (lstat(src, &st) != 0) {
+        op_fail(op, k, src);
+        return;
+    }
+    if (S_ISREG(st.st_mode)) {
+        copy_file(op, k, src, dst, &st);
+    } else if (S_ISDIR(st.st_mode)) {
+        // writable until its entries are in
+        if (mkdir(dst, (st.st_mode & 0777) | S_IRWXU) != 0) {
+            op_fail(op, k, dst);
+            return;
+        }
+        op_copied(op, (long long)st.st_size);
+        int n = 0;
+        char **names = read_names(src, &n);
+        if (!names) op_fail(op, k, src);
+        for (int i = 0; i < n; ++i) {
+            char *s = join_path(src, names[i]);
+            char *d = join_path(dst, names[i]);
+            copy_tree(op, k, s, d);
+            free(s);
+            free(d);
+        }
+        if (names) free_names(names, n);
+        struct timespec times[2] = { st.st_atim, st.st_mtim };
+        chmod(dst, st.st_mode & 0777);
+        utimensat(AT_FDCWD, dst, times, 0);
+    } else if (S_ISLNK(st.st_mode)) {
+        char target[PATH_MAX];
+        ssize_t len = readlink(src, target, sizeof(target) - 1);
+        if (len < 0) {
+            op_fail(op, k, src);
+            return;
+        }
+        target[len] = '\0';
+        if (symlink(target, dst) != 0) {
+            op_fail(op, k, dst);
+            return;
+        }
+        op_copied(op, (long long)st.st_size);
+    } else {
+        // devices, fifos and sockets
+        errno = ENOTSUP;
+        op_fail(op, k, src);
+    }
+}
+
+// Delete `path` with everything under it. Unless `stoppable`, it goes on
+// after the operation is stopped.
+static void remove_tree(FileOp *op, int k, const char *path, int stoppable) {
+    if (stoppable && op_stopped(op)) {
+        errno = ECANCELED;
+        op_fail(op, k, path);
+        return;
+    }
+    struct stat st;
+    if (lstat(path, &st) != 0) {
+        op_fail(op, k, path);
+        return;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        if (unlink(path) != 0) op_fail(op, k, path);
+        return;
+    }
+    int n = 0;
+    char **names = read_names(path, &n);
+    for (int i = 0; i < n; ++i) {
+        char *sub = join_path(path, names[i]);
+        remove_tree(op, k, sub, stoppable);
+        free(sub);
+    }
+    if (names) free_names(names, n);
+    if (rmdir(path) != 0) op_fail(op, k, path);
+}
+
+// The bytes a copy of `path` takes.
+static long long tree_size(FileOp *op, const char *path) {
+    struct stat st;
+    if (lstat(path, &st) != 0) return 0;
+    if (!S_ISDIR(st.st_mode)) return (long long)st.st_size;
+    long long size = du_tree(path, 0, &op->job);
+    return size > 0 ? size : 0;
+}
+
+static void op_count(FileOp *op, const char *path) {
+    long long size = tree_size(op, path);
+    job_lock(&op->job);
+    op->total += size;
+    job_unlock(&op->job);
+}
+
+// The name a copy to dst is made under: hidden, beside dst, so a copy
+// stopped or failed midway never shows up as dst.
+static char *temp_path(const char *dst, int k) {
+    const char *slash = strrchr(dst, '/');
+    int dir_len = slash ? (int)(slash - dst) : 0;
+    const char *base = slash ? slash + 1 : dst;
+    size_t len = dir_len + strlen(base) + 64;
+    char *path = xmalloc(len);
+    snprintf(path, len, "%.*s%s.%s.%ld-%d.part", dir_len, dst, slash ? "/" : "", base,
+             (long)getpid(), k);
+    return path;
+}
+
+// Rename the finished copy tmp to dst, unless dst has come to exist since.
+static int commit_copy(const char *tmp, const char *dst) {
+#ifdef RENAME_NOREPLACE
+    if (renameat2(AT_FDCWD, tmp, AT_FDCWD, dst, RENAME_NOREPLACE) == 0) return 0;
+    // the filesystem cannot do it without replacing
+    if (errno != EINVAL && errno != ENOSYS) return -1;
+#endif
+    struct stat st;
+    if (lstat(dst, &st) == 0) {
+        errno = EEXIST;
+        return -1;
+    }
+    return rename(tmp, dst);
+}
+
+static void fileop_item(FileOp *op, int k) {
+    const char *src = op->srcs[k];
+    const char *dst = op->dsts ? op->dsts[k] : NULL;
+    if (!dst) {
+        remove_tree(op, k, src, 1);
+        return;
+    }
+    struct stat st;
+    size_t len = strlen(src);
+    if (lstat(dst, &st) == 0) {
+        errno = EEXIST;
+        op_fail(op, k, dst);
+        return;
+    }
+    if (strncmp(dst, src, len) == 0 && dst[len] == '/') {
+        // a directory into itself
+        errno = EINVAL;
+        op_fail(op, k, dst);
+        return;
+    }
+    if (op->kind == FILEOP_RENAME) {
+        if (rename(src, dst) == 0) return;
+        if (errno != EXDEV) {
+            op_fail(op, k, src);
+            return;
+        }
+        op_count(op, src);
+    }
+
+    // Copied under another name and renamed to dst once whole. A copy
+    // that was stopped is removed, and so is a move's copy that failed,
+    // leaving its source as it was; a copy that failed keeps what it
+    // could copy, like cp -r. The source of a move is deleted only once
+    // its copy is in place, and then to the end, even if stopped.
+    char *tmp = temp_path(dst, k);
+    copy_tree(op, k, src, tmp);
+    int stopped = op_stopped(op);
+    if (stopped) {
+        errno = ECANCELED;
+        op_fail(op, k, src);
+    }
+    int keep = !stopped && (op->kind == FILEOP_COPY || !op->errs[k]);
+    if (keep && commit_copy(tmp, dst) != 0) {
+        op_fail(op, k, dst);
+        keep = 0;
+    }
+    if (!keep) {
+        remove_tree(op, k, tmp, 0);
+    } else if (op->kind == FILEOP_RENAME) {
+        remove_tree(op, k, src, 0);
+    }
+    // an error in the copy is told of at the name it was going to have
+    size_t tmp_len = strlen(tmp);
+    char *failed = op->failed[k];
+    if (failed && strncmp(failed, tmp, tmp_len) == 0
+        && (failed[tmp_len] == '\0' || failed[tmp_len] == '/')) {
+        const char *rest = failed + tmp_len;
+        op->failed[k] = xmalloc(strlen(dst) + strlen(rest) + 1);
+        sprintf(op->failed[k], "%s%s", dst, rest);
+        free(failed);
+    }
+    free(tmp);
+}
+
+static void fileop_run(void *ctx, int worker, int item) {
+    FileOp *op = ctx;
+    (void)worker;
+    (void)item;
+    if (op->kind == FILEOP_COPY) {
+        for (int k = 0; k < op->n && !op_stopped(op); ++k) op_count(op, op->srcs[k]);
+    }
+    for (int k = 0; k < op->n && !op_stopped(op); ++k) {
+        job_lock(&op->job);
+        op->nstarted = k + 1;
+        job_unlock(&op->job);
+        fileop_item(op, k);
+        job_lock(&op->job);
+        op->nfinished = k + 1;
+        job_unlock(&op->job);
+    }
+}
+
+// `path` with its directory part resolved, or a copy of it if that
+// cannot be.
+static char *resolve_dir_part(const char *path) {
+    const char *slash = strrchr(path, '/');
+    if (!slash || !slash[1]) return xstrdup(path);
+    char *dir = slash == path ? xstrdup("/") : xmalloc(slash - path + 1);
+    if (slash != path) {
+        memcpy(dir, path, slash - path);
+        dir[slash - path] = '\0';
+    }
+    char real[PATH_MAX];
+    char *out = realpath(dir, real) ? join_path(strcmp(real, "/") == 0 ? "" : real, slash + 1)
+                                    : xstrdup(path);
+    free(dir);
+    return out;
+}
+
+char **fileop_targets(char **srcs, int n, const char *to, const char *dir) {
+    char *abs = to[0] == '/' ? xstrdup(to) : join_path(dir, to);
+    struct stat st;
+    char real[PATH_MAX];
+    char **dsts = NULL;
+    if (stat(abs, &st) == 0 && S_ISDIR(st.st_mode) && realpath(abs, real)) {
+        dsts = xmalloc(n * sizeof(char*));
+        for (int k = 0; k < n; ++k) {
+            const char *base = strrchr(srcs[k], '/');
+            dsts[k] = join_path(strcmp(real, "/") == 0 ? "" : real, base ? base + 1 : srcs[k]);
+        }
+    } else if (n == 1) {
+        dsts = xmalloc(sizeof(char*));
+        dsts[0] = resolve_dir_part(abs);
+    } else {
+        errno = ENOTDIR;
+    }
+    free(abs);
+    return dsts;
+}
+
+void fileop_start(FileOp *op, int kind, char **srcs, char **dsts, int n) {
+    op->kind = kind;
+    op->srcs = srcs;
+    op->dsts = dsts;
+    op->n = n;
+    op->total = op->copied = 0;
+    op->nstarted = op->nfinished = op->ntaken = 0;
+    op->stopped = 0;
+    op->errs = xmalloc((n + 1) * sizeof(int));
+    op->failed = xmalloc((n + 1) * sizeof(char*));
+    memset(op->errs, 0, (n + 1) * sizeof(int));
+    memset(op->failed, 0, (n + 1) * sizeof(char*));
+    op->running = 1;
+    job_start(&op->job, 1, 1, fileop_run, op);
+}
+
+void fileop_stop(FileOp *op) {
+    if (!op->running || op->stopped) return;
+    job_stop(&op->job);
+    op->stopped = 1;
+    op->nfinished = op->nstarted;
+}
+
+void fileop_free(FileOp *op) {
+    if (!op->running) return;
+    fileop_stop(op);
+    for (int k = 0; k < op->n; ++k) {
+        free(op->srcs[k]);
+        if (op->dsts) free(op->dsts[k]);
+        free(op->failed[k]);
+    }
+    free(op->srcs);
+    free(op->dsts);
+    free(op->failed);
+    free(op->errs);
+    op->running = 0;
+}
+
+void fileop_progress(FileOp *op, int *nfinished, long long *copied, long long *total) {
+    if (!op->stopped) job_lock(&op->job);
+    *nfinished = op->nfinished;
+    *copied = op->copied;
+    *total = op->total;
+    if (!op->stopped) job_unlock(&op->job);
+}
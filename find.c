@@ -0,0 +1,332 @@
+/*
+ * find.c
+ *
+ * Parallel listing of the entries under a directory, for M-x find-dired.
+ *
+ * Created at:  18. Oct 2026
+ * Author:      Raphaele Salvatore Licciardo
+ *
+ *
+ * Copyright (c) 2025 Raphaele Salvatore Licciardo
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L
+// d_type, to skip the stat of entries that are neither listed nor walked
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "includes/find.h"
+
+// ------------------------------------------------------------------
+// arguments
+
+// The next word of *s, with quotes taken off; NULL at the end.
+static char *next_word(const char **s) {
+    const char *p = *s;
+    while (isspace((unsigned char)*p)) p++;
+    if (!*p) return NULL;
+    char *word = xmalloc(strlen(p) + 1);
+    size_t n = 0;
+    char quote = 0;
+    for (; *p && (quote || !isspace((unsigned char)*p)); ++p) {
+        if (quote && *p == quote) {
+            quote = 0;
+        } else if (!quote && (*p == '\'' || *p == '"')) {
+            quote = *p;
+        } else {
+            word[n++] = *p;
+        }
+    }
+    word[n] = '\0';
+    *s = p;
+    return word;
+}
+
+// "+N", "-N" or "N", and what follows N. Returns -1 if there is no N.
+static int parse_count(const char *w, int *cmp, long long *v, const char **rest) {
+    *cmp = *w == '+' ? 1 : *w == '-' ? -1 : 0;
+    if (*cmp) w++;
+    if (!isdigit((unsigned char)*w)) return -1;
+    char *end;
+    *v = strtoll(w, &end, 10);
+    *rest = end;
+    return 0;
+}
+
+static int parse_filter(FindFilter *f, const char *args, const char **err) {
+    memset(f, 0, sizeof(*f));
+    f->size_cmp = f->mtime_cmp = 2;
+    const char *p = args;
+    char *opt;
+    while ((opt = next_word(&p)) != NULL) {
+        char *val = next_word(&p);
+        const char *rest = "";
+        long long v;
+        *err = NULL;
+        if (!val) {
+            *err = "the last option has no value";
+        } else if (strcmp(opt, "-name") == 0 || strcmp(opt, "-iname") == 0) {
+            free(f->name);
+            f->name = val;
+            val = NULL;
+            f->fold = opt[1] == 'i';
+            for (char *c = f->name; f->fold && *c; ++c) *c = (char)tolower((unsigned char)*c);
+        } else if (strcmp(opt, "-type") == 0) {
+            if (strcmp(val, "f") != 0 && strcmp(val, "d") != 0 && strcmp(val, "l") != 0) {
+                *err = "-type takes f, d or l";
+            } else {
+                f->type = val[0];
+            }
+        } else if (strcmp(opt, "-size") == 0) {
+            if (parse_count(val, &f->size_cmp, &f->size, &rest) < 0 || strlen(rest) > 1
+                || (*rest && !strchr("cbkMG", *rest))) {
+                *err = "-size takes [+-]N with c, b, k, M or G after it";
+            } else {
+                f->size_unit = *rest == 'c' ? 1 : *rest == 'k' ? 1024 : *rest == 'M' ? 1024 * 1024
+                               : *rest == 'G' ? 1024 * 1024 * 1024 : 512;
+            }
+        } else if (strcmp(opt, "-mtime") == 0) {
+            if (parse_count(val, &f->mtime_cmp, &v, &rest) < 0 || *rest) {
+                *err = "-mtime takes [+-]N, in days";
+            } else {
+                f->mtime_days = (long)v;
+            }
+        } else {
+            *err = "use -name, -iname, -type, -size or -mtime";
+        }
+        free(opt);
+        free(val);
+        if (*err) {
+            free(f->name);
+            f->name = NULL;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int name_passes(const FindFilter *f, const char *name) {
+    if (!f->name) return 1;
+    if (!f->fold) return fnmatch(f->name, name, 0) == 0;
+    char low[NAME_MAX + 1];
+    size_t i = 0;
+    for (; name[i] && i < sizeof(low) - 1; ++i) low[i] = (char)tolower((unsigned char)name[i]);
+    low[i] = '\0';
+    return fnmatch(f->name, low, 0) == 0;
+}
+
+static int count_passes(int cmp, long long have, long long want) {
+    if (cmp == 2) return 1;
+    return cmp < 0 ? have < want : cmp > 0 ? have > want : have == want;
+}
+
+static int stat_passes(const FindScan *fs, const struct stat *st) {
+    const FindFilter *f = &fs->filter;
+    if (f->type == 'f' && !S_ISREG(st->st_mode)) return 0;
+    if (f->type == 'd' && !S_ISDIR(st->st_mode)) return 0;
+    if (f->type == 'l' && !S_ISLNK(st->st_mode)) return 0;
+    if (f->size_cmp != 2) {
+        long long units = ((long long)st->st_size + f->size_unit - 1) / f->size_unit;
+        if (!count_passes(f->size_cmp, units, f->size)) return 0;
+    }
+    return count_passes(f->mtime_cmp, (long long)(fs->now - st->st_mtime) / 86400, f->mtime_days);
+}
+
+// ------------------------------------------------------------------
+// the walk
+
+// What a walker found and has not handed over yet.
+typedef struct {
+    DiredFile *found;
+    int nfound, found_cap;
+    char **dirs;
+    int ndirs, dirs_cap;
+} Batch;
+
+// Hand the batch over: the entries to the found list, the directories
+// to the stack. Returns 1 if the walk is to stop.
+static int hand_over(FindScan *fs, Batch *bt) {
+    job_lock(&fs->walk);
+    if (bt->nfound > 0) {
+        if (fs->nfound + bt->nfound > fs->found_cap) {
+            while (fs->nfound + bt->nfound > fs->found_cap)
+                fs->found_cap = fs->found_cap ? fs->found_cap * 2 : FIND_BATCH;
+            fs->found = xrealloc(fs->found, fs->found_cap * sizeof(DiredFile));
+        }
+        memcpy(fs->found + fs->nfound, bt->found, bt->nfound * sizeof(DiredFile));
+        fs->nfound += bt->nfound;
+    }
+    if (bt->ndirs > 0) {
+        if (fs->ndirs + bt->ndirs > fs->dirs_cap) {
+            while (fs->ndirs + bt->ndirs > fs->dirs_cap) fs->dirs_cap *= 2;
+            fs->dirs = xrealloc(fs->dirs, fs->dirs_cap * sizeof(char*));
+        }
+        memcpy(fs->dirs + fs->ndirs, bt->dirs, bt->ndirs * sizeof(char*));
+        fs->ndirs += bt->ndirs;
+        pthread_cond_broadcast(&fs->more);
+    }
+    int quit = fs->quit;
+    job_unlock(&fs->walk);
+    bt->nfound = bt->ndirs = 0;
+    return quit;
+}
+
+static void read_dir(FindScan *fs, const char *rel, Batch *bt) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s%s%s", fs->root, rel[0] ? "/" : "", rel);
+    DIR *dir = opendir(path);
+    if (!dir) {
+        job_lock(&fs->walk);
+        fs->nerrors++;
+        job_unlock(&fs->walk);
+        return;
+    }
+    int dfd = dirfd(dir);
+    size_t rel_len = strlen(rel);
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        const char *name = de->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+        int named = name_passes(&fs->filter, name);
+#ifdef DT_DIR
+        // an entry not listed needs no stat unless it may be a directory
+        if (!named && de->d_type != DT_DIR && de->d_type != DT_UNKNOWN) continue;
+#endif
+        struct stat st;
+        if (fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+        int walk = S_ISDIR(st.st_mode);
+        int list = named && stat_passes(fs, &st);
+        if (!walk && !list) continue;
+
+        char *child = xmalloc(rel_len + 1 + strlen(name) + 1);
+        sprintf(child, "%s%s%s", rel, rel_len ? "/" : "", name);
+        if (walk) {
+            if (bt->ndirs == bt->dirs_cap) {
+                bt->dirs_cap = bt->dirs_cap ? bt->dirs_cap * 2 : 64;
+                bt->dirs = xrealloc(bt->dirs, bt->dirs_cap * sizeof(char*));
+            }
+            bt->dirs[bt->ndirs++] = list ? xstrdup(child) : child;
+        }
+        if (list) {
+            if (bt->nfound == bt->found_cap) {
+                bt->found_cap = bt->found_cap ? bt->found_cap * 2 : 64;
+                bt->found = xrealloc(bt->found, bt->found_cap * sizeof(DiredFile));
+            }
+            DiredFile *f = &bt->found[bt->nfound++];
+            f->name = child;
+            f->link_target = NULL;
+            f->st = st;
+            if (S_ISLNK(st.st_mode)) {
+                char target[PATH_MAX];
+                ssize_t tl = readlinkat(dfd, name, target, sizeof(target) - 1);
+                if (tl >= 0) {
+                    target[tl] = '\0';
+                    f->link_target = xstrdup(target);
+                }
+            }
+        }
+        if (bt->nfound + bt->ndirs >= FIND_BATCH && hand_over(fs, bt)) break;
+    }
+    closedir(dir);
+}
+
+// A walker: read directories off the stack until there are none left
+// and no other walker can push more.
+static void walker(void *ctx, int worker, int item) {
+    FindScan *fs = ctx;
+    (void)worker;
+    (void)item;
+    Batch bt = {0};
+    job_lock(&fs->walk);
+    for (;;) {
+        while (fs->ndirs == 0 && fs->busy > 0 && !fs->quit) {
+            pthread_cond_wait(&fs->more, &fs->walk.lock);
+        }
+        if (fs->ndirs == 0 || fs->quit) break;
+        char *rel = fs->dirs[--fs->ndirs];
+        fs->busy++;
+        job_unlock(&fs->walk);
+        read_dir(fs, rel, &bt);
+        hand_over(fs, &bt);
+        free(rel);
+        job_lock(&fs->walk);
+        fs->busy--;
+    }
+    // the walkers still waiting find the stack empty for good
+    pthread_cond_broadcast(&fs->more);
+    job_unlock(&fs->walk);
+    free(bt.found);
+    free(bt.dirs);
+}
+
+int find_start(FindScan *fs, const char *dir, const char *args, const char **err) {
+    memset(fs, 0, sizeof(*fs));
+    if (parse_filter(&fs->filter, args, err) < 0) return -1;
+    fs->root = xstrdup(dir);
+    size_t len = strlen(fs->root);
+    while (len > 1 && fs->root[len - 1] == '/') fs->root[--len] = '\0';
+    fs->now = time(NULL);
+    pthread_cond_init(&fs->more, NULL);
+    fs->dirs_cap = 64;
+    fs->dirs = xmalloc(fs->dirs_cap * sizeof(char*));
+    fs->dirs[fs->ndirs++] = xstrdup("");
+    fs->running = 1;
+    int nthreads = job_threads();
+    job_start(&fs->walk, nthreads, nthreads, walker, fs);
+    return 0;
+}
+
+void find_stop(FindScan *fs) {
+    if (!fs->running) return;
+    job_lock(&fs->walk);
+    fs->quit = 1;
+    pthread_cond_broadcast(&fs->more);
+    job_unlock(&fs->walk);
+    job_stop(&fs->walk);
+    pthread_cond_destroy(&fs->more);
+    for (int i = 0; i < fs->ndirs; ++i) free(fs->dirs[i]);
+    free(fs->dirs);
+    for (int i = 0; i < fs->nfound; ++i) {
+        free(fs->found[i].name);
+        free(fs->found[i].link_target);
+    }
+    free(fs->found);
+    free(fs->root);
+    free(fs->filter.name);
+    memset(fs, 0, sizeof(*fs));
+}
+
+int find_take(FindScan *fs, Buffer *out) {
+    job_lock(&fs->walk);
+    DiredFile *found = fs->found;
+    int n = fs->nfound;
+    fs->found = NULL;
+    fs->nfound = fs->found_cap = 0;
+    job_unlock(&fs->walk);
+    // the listing takes the names
+    buffer_dired_add(out, found, n);
+    free(found);
+    fs->ntaken += n;
+    return n;
+}
+
+int find_done(FindScan *fs) {
+    if (!job_done(&fs->walk)) return 0;
+    job_lock(&fs->walk);
+    int left = fs->nfound;
+    job_unlock(&fs->walk);
+    return left == 0;
+}
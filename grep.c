@@ -0,0 +1,405 @@
+/*
+ * grep.c
+ *
+ * Parallel search of the files under a directory, for M-x grep.
+ *
+ * Created at:  18. Oct 2026
+ * Author:      Raphaele Salvatore Licciardo
+ *
+ *
+ * Copyright (c) 2025 Raphaele Salvatore Licciardo
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L
+// d_type, to skip the stat of entries that are plainly files or directories
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "includes/grep.h"
+
+// Version control directories are not searched.
+static const char *ignored_dirs[] = { ".git", ".hg", ".svn", "CVS" };
+
+static int name_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int walk_canceled(GrepScan *gs) {
+    job_lock(&gs->walk);
+    int cancel = gs->walk.cancel;
+    job_unlock(&gs->walk);
+    return cancel;
+}
+
+static void add_file(GrepScan *gs, char *rel) {
+    job_lock(&gs->walk);
+    if (gs->nfiles == gs->cap) {
+        gs->cap = gs->cap ? gs->cap * 2 : 256;
+        gs->files = xrealloc(gs->files, gs->cap * sizeof(char*));
+    }
+    gs->files[gs->nfiles++] = rel;
+    job_unlock(&gs->walk);
+}
+
+// A directory on the walk's path down from the root: its entries were
+// read when it was opened, and its subdirectories not yet walked wait in
+// `dirs`, last first.
+typedef struct {
+    int fd;
+    char *rel;
+    char **dirs;
+    int ndirs;
+} WalkDir;
+
+static int ignored_name(const char *name) {
+    for (size_t k = 0; k < sizeof(ignored_dirs) / sizeof(ignored_dirs[0]); ++k) {
+        if (strcmp(name, ignored_dirs[k]) == 0) return 1;
+    }
+    return 0;
+}
+
+// Read the directory open on fd: list its regular files in name order,
+// and return its subdirectories' names for the walk, last first. d_type
+// settles most entries; only the rest are stat'ed, relative to fd.
+static char **read_dir(GrepScan *gs, int fd, const char *rel, int *ndirs) {
+    *ndirs = 0;
+    int dup_fd = dup(fd);
+    DIR *d = dup_fd < 0 ? NULL : fdopendir(dup_fd);
+    if (!d) {
+        if (dup_fd >= 0) close(dup_fd);
+        return NULL;
+    }
+    char **files = NULL, **dirs = NULL;
+    int nfiles = 0, files_cap = 0, dirs_cap = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        const char *name = de->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || ignored_name(name)) continue;
+        int is_dir;
+#ifdef DT_DIR
+        if (de->d_type == DT_REG || de->d_type == DT_DIR) {
+            is_dir = de->d_type == DT_DIR;
+        } else if (de->d_type != DT_UNKNOWN) {
+            continue;
+        } else
+#endif
+        {
+            struct stat st;
+            if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+            if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) continue;
+            is_dir = S_ISDIR(st.st_mode);
+        }
+        if (is_dir) {
+            if (*ndirs == dirs_cap) {
+                dirs_cap = dirs_cap ? dirs_cap * 2 : 16;
+                dirs = xrealloc(dirs, dirs_cap * sizeof(char*));
+            }
+            dirs[(*ndirs)++] = xstrdup(name);
+        } else {
+            if (nfiles == files_cap) {
+                files_cap = files_cap ? files_cap * 2 : 64;
+                files = xrealloc(files, files_cap * sizeof(char*));
+            }
+            files[nfiles++] = xstrdup(name);
+        }
+    }
+    closedir(d);
+
+    size_t rel_len = strlen(rel);
+    qsort(files, nfiles, sizeof(char*), name_cmp);
+    for (int i = 0; i < nfiles; ++i) {
+        char *child = xmalloc(rel_len + 1 + strlen(files[i]) + 1);
+        sprintf(child, "%s%s%s", rel, rel_len ? "/" : "", files[i]);
+        free(files[i]);
+        add_file(gs, child);
+    }
+    free(files);
+    // last first, so they come off the end in name order
+    qsort(dirs, *ndirs, sizeof(char*), name_cmp);
+    for (int i = 0, j = *ndirs - 1; i < j; ++i, --j) {
+        char *t = dirs[i];
+        dirs[i] = dirs[j];
+        dirs[j] = t;
+    }
+    return dirs;
+}
+
+// The walk: depth first, every directory's entries in name order. Only
+// regular files are listed; symlinks are not followed. Each directory is
+// opened relative to its parent's fd, so one fd stays open per level and
+// no path is looked up from the root again.
+static void walk_tree(void *ctx, int worker, int item) {
+    GrepScan *gs = ctx;
+    (void)worker;
+    (void)item;
+    int fd = open(gs->root, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) return;
+    WalkDir *stack = xmalloc(16 * sizeof(WalkDir));
+    int nstack = 1, stack_cap = 16;
+    stack[0].fd = fd;
+    stack[0].rel = xstrdup("");
+    stack[0].dirs = read_dir(gs, fd, "", &stack[0].ndirs);
+    while (nstack > 0) {
+        WalkDir *top = &stack[nstack - 1];
+        if (top->ndirs == 0 || walk_canceled(gs)) {
+            while (top->ndirs > 0) free(top->dirs[--top->ndirs]);
+            free(top->dirs);
+            free(top->rel);
+            close(top->fd);
+            nstack--;
+            continue;
+        }
+        char *name = top->dirs[--top->ndirs];
+        fd = openat(top->fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (fd < 0) {
+            free(name);
+            continue;
+        }
+        size_t rel_len = strlen(top->rel);
+        char *rel = xmalloc(rel_len + 1 + strlen(name) + 1);
+        sprintf(rel, "%s%s%s", top->rel, rel_len ? "/" : "", name);
+        free(name);
+        if (nstack == stack_cap) {
+            stack_cap *= 2;
+            stack = xrealloc(stack, stack_cap * sizeof(WalkDir));
+        }
+        WalkDir *sub = &stack[nstack++];
+        sub->fd = fd;
+        sub->rel = rel;
+        sub->dirs = read_dir(gs, fd, rel, &sub->ndirs);
+    }
+    free(stack);
+}
+
+static size_t count_newlines(const char *s, size_t from, size_t to) {
+    size_t n = 0;
+    const char *p = s + from, *end = s + to;
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+        n++;
+        p++;
+    }
+    return n;
+}
+
+typedef struct {
+    char **lines;
+    int n, cap;
+} Hits;
+
+// Add "rel:lineno:text" for the line s[0..len).
+static void add_hit(Hits *h, const char *rel, size_t lineno, const char *s, size_t len) {
+    if (len > 0 && s[len - 1] == '\r') len--;
+    if (h->n == h->cap) {
+        h->cap = h->cap ? h->cap * 2 : 16;
+        h->lines = xrealloc(h->lines, h->cap * sizeof(char*));
+    }
+    int head = snprintf(NULL, 0, "%s:%zu:", rel, lineno);
+    char *out = xmalloc(head + len + 1);
+    snprintf(out, head + 1, "%s:%zu:", rel, lineno);
+    memcpy(out + head, s, len);
+    out[head + len] = '\0';
+    h->lines[h->n++] = out;
+}
+
+// Find the matching lines of the file text s[0..n). With a prefix the
+// substring kernel jumps over the whole file to the next candidate, and
+// only the line holding it is matched; otherwise every line is.
+static void scan_file(GrepScan *gs, Matcher *m, const char *rel, const char *s, size_t n,
+                      Hits *h) {
+    size_t pos = 0, lineno = 1;
+    while (pos < n) {
+        size_t start = pos;
+        if (gs->prefix.len > 0) {
+            long hit = search_find(&gs->prefix, s + pos, n - pos);
+            if (hit < 0) break;
+            start = pos + (size_t)hit;
+            while (start > pos && s[start - 1] != '\n') start--;
+            lineno += count_newlines(s, pos, start);
+        }
+        const char *nl = memchr(s + start, '\n', n - start);
+        size_t end = nl ? (size_t)(nl - s) : n;
+        if (matcher_find(m, s + start, end - start, 0) >= 0) {
+            add_hit(h, rel, lineno, s + start, end - start);
+        }
+        pos = end + 1;
+        lineno++;
+    }
+}
+
+// Read the whole file into w->buf. Returns the bytes read.
+static size_t read_file(GrepWorker *w, int fd, size_t n) {
+    if (w->cap < n) {
+        w->buf = xrealloc(w->buf, n);
+        w->cap = n;
+    }
+    size_t got = 0;
+    ssize_t r;
+    while (got < n && (r = read(fd, w->buf + got, n - got)) > 0) got += (size_t)r;
+    return got;
+}
+
+static void search_file(void *ctx, int worker, int item) {
+    GrepScan *gs = ctx;
+    GrepWorker *w = &gs->workers[worker];
+    job_lock(&gs->walk);
+    const char *rel = gs->files[gs->batch + item];
+    job_unlock(&gs->walk);
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", gs->root, rel);
+
+    Hits h = {0};
+    int skipped = 0;
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        size_t n = (size_t)st.st_size;
+        const char *s = NULL;
+        void *map = MAP_FAILED;
+        if (st.st_size > GREP_MAX_FILE_BYTES) {
+            skipped = 1;
+        } else if (st.st_size >= GREP_MMAP_MIN_BYTES) {
+            map = mmap(NULL, n, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) s = map;
+        } else {
+            n = read_file(w, fd, n);
+            s = w->buf;
+        }
+        if (s && memchr(s, '\0', n < GREP_BINARY_PROBE ? n : GREP_BINARY_PROBE)) {
+            skipped = 1;
+        } else if (s) {
+            scan_file(gs, &w->m, rel, s, n, &h);
+        }
+        if (map != MAP_FAILED) munmap(map, n);
+    }
+    if (fd >= 0) close(fd);
+
+    job_lock(&gs->search);
+    gs->lines[item] = h.lines;
+    gs->counts[item] = h.n;
+    gs->skipped[item] = (unsigned char)skipped;
+    job_unlock(&gs->search);
+}
+
+int grep_start(GrepScan *gs, const char *dir, const char *q, size_t qlen, int fold,
+               const char **err) {
+    memset(gs, 0, sizeof(*gs));
+    int nthreads = job_threads();
+    gs->workers = xmalloc(nthreads * sizeof(GrepWorker));
+    memset(gs->workers, 0, nthreads * sizeof(GrepWorker));
+    for (int i = 0; i < nthreads; ++i) {
+        if (matcher_init(&gs->workers[i].m, q, qlen, 1, fold, err) < 0) {
+            while (i-- > 0) matcher_free(&gs->workers[i].m);
+            free(gs->workers);
+            return -1;
+        }
+    }
+    gs->nworkers = nthreads;
+    size_t plen;
+    const char *prefix = regex_prefix(gs->workers[0].m.re, &plen);
+    search_compile(&gs->prefix, prefix, plen, fold);
+
+    gs->root = xstrdup(dir);
+    size_t len = strlen(gs->root);
+    while (len > 1 && gs->root[len - 1] == '/') gs->root[--len] = '\0';
+    gs->running = 1;
+    job_start(&gs->walk, 1, 1, walk_tree, gs);
+    return 0;
+}
+
+static void free_batch(GrepScan *gs) {
+    job_stop(&gs->search);
+    for (int i = gs->next; i < gs->nbatch; ++i) {
+        if (gs->counts[i] < 0) continue;
+        for (int j = 0; j < gs->counts[i]; ++j) free(gs->lines[i][j]);
+        free(gs->lines[i]);
+    }
+    free(gs->lines);
+    free(gs->counts);
+    free(gs->skipped);
+    gs->searching = 0;
+}
+
+void grep_stop(GrepScan *gs) {
+    if (!gs->running) return;
+    job_stop(&gs->walk);
+    if (gs->searching) free_batch(gs);
+    for (int i = 0; i < gs->nfiles; ++i) free(gs->files[i]);
+    free(gs->files);
+    free(gs->root);
+    for (int i = 0; i < gs->nworkers; ++i) {
+        matcher_free(&gs->workers[i].m);
+        free(gs->workers[i].buf);
+    }
+    free(gs->workers);
+    search_pattern_free(&gs->prefix);
+    memset(gs, 0, sizeof(*gs));
+}
+
+int grep_take(GrepScan *gs, Buffer *out) {
+    int added = 0;
+    if (gs->searching) {
+        int first = gs->next;
+        job_lock(&gs->search);
+        while (gs->next < gs->nbatch && gs->counts[gs->next] >= 0) gs->next++;
+        job_unlock(&gs->search);
+        // the taken files are no longer touched by the workers
+        for (int i = first; i < gs->next; ++i) {
+            int n = gs->counts[i];
+            if (n > 0) {
+                int y = out->nlines;
+                buffer_ensure_capacity(out, y + n);
+                memcpy(out->lines + y, gs->lines[i], n * sizeof(char*));
+                out->nlines += n;
+                buffer_changed(out, y, n, n);
+                added += n;
+                gs->nmatched_files++;
+            }
+            gs->nskipped += gs->skipped[i];
+            free(gs->lines[i]);
+        }
+        gs->nmatches += added;
+        if (gs->next < gs->nbatch) return added;
+        free_batch(gs);
+        gs->batch += gs->nbatch;
+    }
+
+    // the next batch is every file the walk has found since
+    job_lock(&gs->walk);
+    int nfiles = gs->nfiles;
+    job_unlock(&gs->walk);
+    if (nfiles > gs->batch) {
+        gs->nbatch = nfiles - gs->batch;
+        gs->next = 0;
+        gs->lines = xmalloc(gs->nbatch * sizeof(char**));
+        gs->counts = xmalloc(gs->nbatch * sizeof(int));
+        gs->skipped = xmalloc(gs->nbatch);
+        for (int i = 0; i < gs->nbatch; ++i) gs->counts[i] = -1;
+        gs->searching = 1;
+        job_start(&gs->search, gs->nbatch, gs->nworkers, search_file, gs);
+    }
+    return added;
+}
+
+int grep_done(GrepScan *gs) {
+    if (gs->searching || !job_done(&gs->walk)) return 0;
+    // the walk is over, so the file list no longer changes
+    return gs->batch == gs->nfiles;
+}
+
+int grep_progress(GrepScan *gs, int *nfiles) {
+    job_lock(&gs->walk);
+    *nfiles = gs->nfiles;
+    job_unlock(&gs->walk);
+    return gs->batch + gs->next;
+}
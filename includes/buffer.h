@@ -2,6 +2,7 @@
 #define BUFFER_H
 
 #include <stddef.h>
+#include <sys/stat.h>
 
 typedef struct UndoState {
     char **lines;
@@ -10,16 +11,27 @@ typedef struct UndoState {
     struct UndoState *next;
 } UndoState;
 
+struct TrigramIndex;
+struct Dired;
+
 typedef struct {
     char **lines;    // array of null-terminated C strings
     int nlines;
     int capacity;
     int modified;
+    unsigned long version; // new on every change, see buffer_changed()
+    unsigned long *stamps; // the version each line last changed at
+    int nstamps, stamps_cap;
     int readonly;    // read-only flag
     int is_dired;    // buffer shows a directory listing
+    int is_occur;    // buffer lists M-x occur matches
+    int is_grep;     // buffer lists M-x grep matches
     char *filename;
     UndoState *undo_stack;
     int undo_depth;
+    struct TrigramIndex *index; // NULL unless M-x index-buffer built one
+    struct Dired *dired; // the entries listed, if is_dired
+    int copied;      // a pending M-w copy still reads its text from the lines
 } Buffer;
 
 // File completion structures
@@ -36,8 +48,129 @@ void buffer_ensure_capacity(Buffer *b, int newcap);
 void buffer_insert_line(Buffer *b, int idx, const char *s);
 void buffer_delete_line(Buffer *b, int idx);
 int buffer_load_file(Buffer *b, const char *path);
+// List a directory, ls -al style: a header line, a total line, then one
+// row per entry in name order, after a column for its mark. The rows
+// show only the names at first; the entries are stat'ed in the
+// background and buffer_dired_poll() fills the rows in. A listing the buffer showed before, of a directory
+// that has not changed since, comes back from a cache as it was, with
+// no entry read again; the buffer's own listing goes into the cache.
 int buffer_load_dir(Buffer *b, const char *path);
+// Remember where the cursor is in the listing, for when it is shown
+// again from the cache.
+void buffer_dired_leave(Buffer *b, int cy, int top);
+// The cursor line and top line for a listing just loaded: where they
+// were when it was left, else the first entry.
+int buffer_dired_view(const Buffer *b, int *top);
+// Fill in the rows of the entries stat'ed since the last call, and redo
+// the rows among [top, top + rows) formatted for narrower columns. Once
+// every entry is in, the vanished ones are dropped (moving *cy with its
+// row) and all rows are formatted for the final column widths. Then it
+// applies what an auto-revert watch reports, and shows the directory
+// totals dired-du-mode added up. Returns 1 while the listing is still
+// being read or added up.
+int buffer_dired_poll(Buffer *b, int top, int rows, int *cy);
+// Wait for the listing to be read and finish it.
+void buffer_dired_finish(Buffer *b, int *cy);
+// Whether the listing is still being read, or still being added to.
+int buffer_dired_loading(const Buffer *b);
+// Or, with dired-du-mode, its directories still being added up.
+int buffer_dired_busy(const Buffer *b);
+// Whether line y is not an entry row still waiting for its stats.
+int buffer_dired_ready(Buffer *b, int y);
+// The name of the entry on line y, or NULL if the line shows none.
+const char *buffer_dired_name(Buffer *b, int y);
+// Marks, shown in the first column: '*' marks an entry, 'D' flags it
+// for deletion. Set the mark of the entry on line y (0 clears it).
+// Returns -1 if the line shows no entry, or shows . or .., which cannot
+// be marked.
+int buffer_dired_mark(Buffer *b, int y, int mark);
+// Clear every mark, or only the `mark` ones. Returns how many there were.
+// Of a narrowed listing, only the entries shown count.
+int buffer_dired_unmark_all(Buffer *b, int mark);
+// The names of the entries shown marked `mark`, in the listing's order,
+// or NULL if there are none. The names and the array are the caller's.
+char **buffer_dired_marked(Buffer *b, int mark, int *count);
+
+enum { DIRED_SORT_NAME, DIRED_SORT_TIME, DIRED_SORT_SIZE };
+
+// Show the listing's entries in another order, from the entries kept in
+// memory. Returns the line the entry on line cy moved to. Does nothing
+// while the listing is still being read; a listing read again (or
+// another directory listed in the buffer) keeps the order.
+int buffer_dired_sort(Buffer *b, int sort, int cy);
+int buffer_dired_sorted_by(const Buffer *b);
+// Narrow the listing to the entries whose names hold `filter` or, with
+// `fuzzy`, have its characters in the same order; letters match in
+// either case unless it has a capital. NULL or "" shows every entry
+// again. Only the names in memory are looked at, and the rows still
+// shown keep their text. Returns how many entries are shown, or -1 while
+// a find is still adding to the listing. The filter stays through g,
+// auto-revert and sorting; a listing left is cached whole.
+int buffer_dired_narrow(Buffer *b, const char *filter, int fuzzy, int *cy);
+// The filter it is narrowed with (and whether fuzzy), or NULL; and how
+// many entries it has.
+const char *buffer_dired_filter(const Buffer *b, int *fuzzy);
+int buffer_dired_count(const Buffer *b);
+// Read the listing's directory again and patch the rows that changed:
+// every entry is stat'ed again, new ones are added and vanished ones
+// removed, and a row keeps its text unless its entry changed. *cy stays
+// with its entry. Returns -1 if the directory cannot be read.
+int buffer_dired_refresh(Buffer *b, int *cy);
+// Auto-revert: watch the directory (with inotify) and keep the listing
+// up to date, stat'ing only the entries reported changed, from
+// buffer_dired_poll(). Returns -1 with errno set if no watch can be set.
+int buffer_dired_watch(Buffer *b, int on);
+int buffer_dired_watching(const Buffer *b);
+// Stat the entries `names` (relative to the listing's directory) again
+// and patch their rows, the way auto-revert does: ones that are gone are
+// removed and new ones added. *cy stays with its entry.
+void buffer_dired_update(Buffer *b, const char *const *names, int n, int *cy);
+// dired-du-mode: show each subdirectory's size as the size of the tree
+// under it (see du_tree()), added up in the background and shown row by
+// row as the totals come in. A listing read again (g) adds its trees up
+// again from scratch; one shown again from the cache adds them up from
+// du_tree()'s cache. Kept when the buffer lists another directory.
+int buffer_dired_du(Buffer *b, int on);
+int buffer_dired_du_on(const Buffer *b);
+
+// An entry found under a directory, for buffer_dired_add().
+typedef struct {
+    char *name;          // the path relative to the directory
+    char *link_target;   // NULL unless a symlink
+    struct stat st;      // from lstat()
+} DiredFile;
+
+// M-x find-dired lists entries found anywhere under `dir` in one listing.
+// Start it empty, with "find `what`" in the header.
+int buffer_dired_begin(Buffer *b, const char *dir, const char *what);
+// Add rows for the entries at the end, taking their names and targets.
+// The rows already there are redone for wider columns by
+// buffer_dired_poll(), once on screen.
+void buffer_dired_add(Buffer *b, DiredFile *files, int n);
+// Nothing more is coming: put the entries in path order (each directory's
+// entries after it), or the listing's sort order. *cy stays with its entry.
+void buffer_dired_end(Buffer *b, int *cy);
+// Whether the listing was made by buffer_dired_begin(). It is not read
+// again (g), watched, or cached.
+int buffer_dired_found(const Buffer *b);
 int buffer_save_file(Buffer *b, const char *path);
+// Record a modification: lines [y, y + n) hold new text, after delta
+// lines were inserted at y (or -delta lines removed there). Versions are
+// unique across all buffers, so a cache stamped with a line and a
+// version can't mistake a reused line pointer (or buffer) for the one it
+// saw.
+void buffer_changed(Buffer *b, int y, int n, int delta);
+// The version line y last changed at: a cache keyed on the line pointer
+// and its stamp only goes stale when that line changes.
+unsigned long buffer_line_stamp(const Buffer *b, int y);
+// Called before a buffer's lines are rewritten or freed, by the buffer
+// functions themselves and by editing commands that touch b->lines.
+// Runs the change hook for a buffer marked `copied`: the kill ring reads
+// its pending copies out of the lines while they are still there.
+void buffer_will_change(Buffer *b);
+void buffer_set_change_hook(void (*fn)(void *ctx, Buffer *b), void *ctx);
+// Drop the buffer's index, stopping its build first.
+void buffer_drop_index(Buffer *b);
 void buffer_set_readonly(Buffer *b, int readonly);
 int buffer_is_readonly(Buffer *b);
 
@@ -45,6 +178,9 @@ int buffer_is_readonly(Buffer *b);
 void buffer_push_undo(Buffer *b, int cx, int cy);
 int buffer_undo(Buffer *b, int *cx, int *cy);
 void buffer_clear_undo(Buffer *b);
+// Remove the lines of [y0, y1) whose keep[y - y0] is 0, in one pass and
+// as one undo step. Returns the number of lines removed.
+int buffer_filter_lines(Buffer *b, int y0, int y1, const unsigned char *keep, int cx, int cy);
 
 FileCompletion *file_completion_new(void);
 void file_completion_free(FileCompletion *fc);
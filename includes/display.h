@@ -3,6 +3,12 @@
 
 #include <ncurses.h>
 #include "buffer.h"
+#include "killring.h"
+#include "search.h"
+#include "grep.h"
+#include "find.h"
+#include "fileop.h"
+#include "preview.h"
 
 typedef struct {
     Buffer *buf;
@@ -18,12 +24,38 @@ typedef struct {
     int mark_x, mark_y;
     int mark_active;
 
-    // kill ring (single slot)
-    char *kill_buf;
-    int last_was_kill;   // consecutive C-k kills append
+    // kill ring
+    KillRing kill_ring;
+    int yank_sy, yank_sx;  // start of the last yank, for M-y
+
+    // matches shown during isearch, NULL when not searching
+    Highlight *highlight;
+
+    // the other buffer, swapped with the current one by C-x b: an occur
+    // or grep results buffer or the buffer it came from. NULL if there
+    // is none.
+    Buffer *alt;
+    int alt_cx, alt_cy, alt_row_offset;
+
+    // the M-x occur scan filling the current buffer while it runs
+    OccurScan occur;
+    // the M-x grep search filling its results buffer, current or not
+    GrepScan grep;
+    // the M-x find-dired walk filling its listing, current or not
+    FindScan find;
+    // dired's copy, rename or delete of the marked files
+    FileOp fileop;
+
+    // dired-preview-mode: the lower half of the screen shows the first
+    // lines of the entry on the cursor's line
+    int preview;
+    const Preview *preview_shown; // NULL if the line shows no entry
+    PreviewCache previews;
 } EditorState;
 
 void editor_update_screen_size(EditorState *E);
+// The rows dired-preview-mode takes under the text, 0 when not shown.
+int editor_preview_rows(EditorState *E);
 void editor_clamp_cursor(EditorState *E);
 void editor_scroll_to_cursor(EditorState *E);
 void editor_draw(EditorState *E, const char *message);
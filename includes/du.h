@@ -0,0 +1,24 @@
+#ifndef DU_H
+#define DU_H
+
+#include "jobs.h"
+
+// Directories read are kept at most this many at a time; once that many
+// are kept the cache starts over.
+#define DU_CACHE_DIRS 262144
+
+// The size of the tree at `path`, counted the way du -sb counts it: the
+// apparent size in bytes of the directory and everything under it,
+// symlinks not followed, and a file with several links under it counted
+// once. Returns -1 if `path` is not a directory or `job` was stopped.
+//
+// Each directory read is cached by device and inode with its mtime and
+// ctime: the sizes of its entries that are not directories, and the
+// names of those that are. A directory that has not changed since is not
+// read again, so adding up a tree added up before takes one stat per
+// directory in it. A file changed in place does not change the directory
+// it is in; with `fresh` nothing is taken from the cache.
+// Safe to call from several threads at once.
+long long du_tree(const char *path, int fresh, Job *job);
+
+#endif // DU_H
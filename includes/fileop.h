@@ -0,0 +1,61 @@
+#ifndef FILEOP_H
+#define FILEOP_H
+
+#include "jobs.h"
+
+enum { FILEOP_COPY, FILEOP_RENAME, FILEOP_DELETE };
+
+// Copies, renames or deletes files for dired's C, R, D and x, one after
+// the other on a background thread. A directory is copied or deleted
+// with everything under it; symlinks are copied as symlinks, and keep
+// nothing but their target. A file's data is copied in the kernel: a
+// reflink (FICLONE) where the filesystem can share the blocks, else
+// copy_file_range(), else sendfile(), and read() and write() only if
+// none of those work. Copies keep the permission bits and the times,
+// but, as with cp without -p, not setuid, setgid or sticky; that goes
+// for a rename across filesystems too, which is a copy and a delete. A
+// destination that exists is not overwritten. A copy is made under a
+// hidden name beside its destination and renamed to it once whole, and
+// a rename's source is deleted only after that.
+typedef struct {
+    Job job;             // one item: the whole operation
+    int kind;            // FILEOP_*
+    char **srcs;         // absolute paths
+    char **dsts;         // where each goes; NULL when deleting
+    int n;
+
+    // job's lock
+    long long total;     // bytes to copy, as far as counted
+    long long copied;
+    int nstarted;        // srcs[0..nstarted) were begun,
+    int nfinished;       // and srcs[0..nfinished) are done with
+
+    // per item, once finished: its first error (0 if none) and the path
+    // it is about
+    int *errs;
+    char **failed;
+
+    int ntaken;          // the finished items the editor has taken
+    int running;
+    int stopped;         // by fileop_stop(); the job's lock is gone
+} FileOp;
+
+// Where each of srcs[0..n) goes when copied or renamed to `to`: into it
+// if it is a directory, else (with one source) to `to` itself. `to` is
+// relative to `dir` unless absolute. Returns NULL with errno ENOTDIR if
+// several sources would go to what is not a directory.
+char **fileop_targets(char **srcs, int n, const char *to, const char *dir);
+// Start on srcs[0..n) (and dsts), which are taken over.
+void fileop_start(FileOp *op, int kind, char **srcs, char **dsts, int n);
+// Stop before the next file, or in the middle of a copy, which is
+// removed (the source of a rename stays whole). A rename whose copy is
+// done finishes deleting its source. The item it was on counts as
+// finished.
+void fileop_stop(FileOp *op);
+// Stop, and let go of what fileop_start() took.
+void fileop_free(FileOp *op);
+// How far it got: the items finished, and the bytes copied of those to
+// copy.
+void fileop_progress(FileOp *op, int *nfinished, long long *copied, long long *total);
+
+#endif // FILEOP_H
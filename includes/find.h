@@ -0,0 +1,61 @@
+#ifndef FIND_H
+#define FIND_H
+
+#include <pthread.h>
+#include <time.h>
+#include "buffer.h"
+#include "jobs.h"
+
+// Entries found under a directory and taken at most this many at a time
+// by a walker, to hand them on while a large directory is still read.
+#define FIND_BATCH 256
+
+// What M-x find-dired lists, from find-style arguments: every entry that
+// passes all the tests given.
+typedef struct {
+    char *name;          // -name / -iname: a glob on the entry's name
+    int fold;            // -iname; name is lower case then
+    int type;            // -type: 'f', 'd' or 'l'; 0 for any
+    int size_cmp;        // -size: -1 under, 1 over, 0 exactly; 2 if not given
+    long long size, size_unit; // in size_unit bytes, rounded up like find
+    int mtime_cmp;       // -mtime: the same for days since the last change
+    long mtime_days;
+} FindFilter;
+
+// Lists the entries under a directory for M-x find-dired. Walker threads
+// share a stack of the directories still to read: a walker takes the
+// one pushed last, reads it, stats its entries relative to its fd and
+// pushes the subdirectories as it finds them, so that idle walkers get
+// work from a large directory before it is read through. An idle walker
+// waits for more until every walker is idle. The entries that pass the
+// filter come out in no particular order. Symlinks are not followed.
+typedef struct {
+    Job walk;            // one item per walker
+    pthread_cond_t more; // directories were pushed, or the walk is over
+    char *root;
+    FindFilter filter;
+    time_t now;          // -mtime counts days back from here
+
+    // walk's lock
+    char **dirs;         // to read, relative to root
+    int ndirs, dirs_cap;
+    int busy;            // walkers reading a directory
+    int quit;
+    DiredFile *found;    // not taken yet
+    int nfound, found_cap;
+    int nerrors;         // directories that could not be read
+
+    int ntaken;
+    int running;
+} FindScan;
+
+// Returns -1 with *err set if `args` are not understood.
+int find_start(FindScan *fs, const char *dir, const char *args, const char **err);
+void find_stop(FindScan *fs);
+// Add the entries found since the last call to the listing `out`, made
+// by buffer_dired_begin(). Returns the number added.
+int find_take(FindScan *fs, Buffer *out);
+// Whether the walk is over and every entry has been taken.
+int find_done(FindScan *fs);
+
+#endif // FIND_H
@@ -0,0 +1,65 @@
+#ifndef GREP_H
+#define GREP_H
+
+#include "buffer.h"
+#include "jobs.h"
+#include "search.h"
+
+// Files larger than this are skipped.
+#define GREP_MAX_FILE_BYTES (64L << 20)
+// Files at least this large are mapped into memory; smaller ones are
+// read into a buffer, which costs less than mapping them.
+#define GREP_MMAP_MIN_BYTES (256L << 10)
+// A file with a NUL byte in its first this many bytes counts as binary
+// and is skipped.
+#define GREP_BINARY_PROBE 8192
+
+typedef struct {
+    Matcher m;
+    char *buf;          // holds the file being read
+    size_t cap;
+} GrepWorker;
+
+// Searches the files under a directory for M-x grep. One thread walks
+// the tree and lists the files; the files found so far are searched in
+// batches on the worker threads, each file read or mapped into memory
+// whole and scanned with the search kernels. A file's matching lines
+// come out formatted as "path:NNN:text", the path relative to the
+// directory.
+// Files finish in any order and are taken in the order the walk found
+// them, so the results can be shown while the search runs.
+typedef struct {
+    Job walk;           // one item: the tree walk
+    char *root;
+    char **files;       // paths relative to root, in walk order; walk's lock
+    int nfiles, cap;
+
+    Job search;         // one item per file of the batch
+    int searching;      // the batch job is running
+    int batch, nbatch;  // the batch is files [batch, batch + nbatch)
+    char ***lines;      // formatted matching lines per file of the batch
+    int *counts;        // lines per file, -1 until searched
+    int next;           // first file of the batch not taken yet
+    unsigned char *skipped; // per file of the batch: binary or too large
+
+    GrepWorker *workers; // one per worker thread
+    int nworkers;
+    SearchPattern prefix; // what every match starts with; len 0 if nothing
+    int nmatches, nmatched_files, nskipped;
+    int running;
+} GrepScan;
+
+// Returns -1 with *err set if `q` is not a valid regex.
+int grep_start(GrepScan *gs, const char *dir, const char *q, size_t qlen, int fold,
+               const char **err);
+void grep_stop(GrepScan *gs);
+// Append the lines of the searched files that come next in walk order
+// to `out`, and start searching the files found since the last batch.
+// Returns the number of lines appended.
+int grep_take(GrepScan *gs, Buffer *out);
+// Whether the walk is over and every file has been taken.
+int grep_done(GrepScan *gs);
+// Files listed by the walk so far, and how many of them were taken.
+int grep_progress(GrepScan *gs, int *nfiles);
+
+#endif // GREP_H
@@ -18,11 +18,30 @@ void editor_set_mark(EditorState *E);
 void editor_copy_region(EditorState *E);
 void editor_kill_region(EditorState *E);
 void editor_kill_line(EditorState *E);
-void editor_yank(EditorState *E);
+int editor_yank(EditorState *E);
+int editor_yank_pop(EditorState *E);
 void editor_undo_cmd(EditorState *E);
 
-// incremental search
-void editor_isearch(EditorState *E);
+// incremental search (C-s forward, C-r backward; C-M-s / C-M-r for regex)
+void editor_isearch(EditorState *E, int reverse, int regex);
+
+// query replace (M-%)
+void editor_query_replace(EditorState *E);
+
+// M-x occur, M-x grep (in `dir`, or prompting for it if NULL) and C-x b,
+// which switches between their results and the buffer they came from
+void editor_occur(EditorState *E);
+void editor_grep(EditorState *E, const char *dir);
+void editor_find_dired(EditorState *E);
+void editor_other_buffer(EditorState *E);
+
+// M-x auto-revert-mode: keep the dired listing in sync with its directory
+void editor_auto_revert(EditorState *E);
+// M-x dired-du-mode: show the dired listing's subdirectories' tree sizes
+void editor_dired_du(EditorState *E);
+// M-x dired-preview-mode: show the first lines of the file on the
+// cursor's line under the dired listing
+void editor_dired_preview(EditorState *E);
 
 // Command system
 void editor_command_mode(EditorState *E);
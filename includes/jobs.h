@@ -0,0 +1,44 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <pthread.h>
+
+#define JOB_MAX_THREADS 8
+
+struct Job;
+
+typedef struct {
+    struct Job *job;
+    int index;
+} JobWorker;
+
+// A batch of independent work items run on background threads. Workers
+// take the next item under `lock`, so items complete in any order. An
+// item's results become visible to the UI thread once the item counts
+// as finished: read them between job_lock() and job_unlock().
+typedef struct Job {
+    pthread_mutex_t lock;
+    pthread_t threads[JOB_MAX_THREADS];
+    JobWorker workers[JOB_MAX_THREADS];
+    int nthreads;
+    int nitems, next, finished;
+    int cancel;
+    void (*run)(void *ctx, int worker, int item);
+    void *ctx;
+} Job;
+
+// Worker threads to use on this machine.
+int job_threads(void);
+// Run run(ctx, worker, item) for every item in [0, nitems) on up to
+// `nthreads` threads; `worker` is the thread's index. If no thread can
+// be started the items run here before returning.
+void job_start(Job *job, int nitems, int nthreads, void (*run)(void *, int, int), void *ctx);
+int job_done(Job *job);
+// Skip the items not started yet and wait for the running ones.
+void job_stop(Job *job);
+// Wait for every item to finish.
+void job_wait(Job *job);
+void job_lock(Job *job);
+void job_unlock(Job *job);
+
+#endif // JOBS_H
@@ -0,0 +1,45 @@
+#ifndef KILLRING_H
+#define KILLRING_H
+
+#include <stddef.h>
+#include "buffer.h"
+
+#define KILL_RING_MAX 16
+
+// Arena chunk that stores kill text. Entries point into chunks and are
+// never copied when the ring rotates; a chunk is freed once no entry
+// references it and it is no longer the append target.
+typedef struct KillChunk {
+    char *data;
+    size_t used, cap;
+    int refs;
+    struct KillChunk *next;
+} KillChunk;
+
+typedef struct {
+    KillChunk *chunk;   // NULL while the entry is a pending region reference
+    const char *text;
+    size_t len;
+
+    // pending copy (M-w): the region is only read out of `src` when the
+    // buffer is about to change or the entry is yanked
+    Buffer *src;
+    int sy, sx, ey, ex;
+} KillEntry;
+
+typedef struct {
+    KillEntry ents[KILL_RING_MAX];
+    int count;          // live entries
+    int head;           // slot of the most recent kill
+    int yank;           // offset from head of the entry last yanked (M-y)
+    KillChunk *chunks;  // all chunks, the first one is the append target
+} KillRing;
+
+void kill_ring_push(KillRing *kr, const char *text, size_t n);
+void kill_ring_append(KillRing *kr, const char *text, size_t n);
+void kill_ring_push_region(KillRing *kr, Buffer *b, int sy, int sx, int ey, int ex);
+void kill_ring_detach(KillRing *kr, Buffer *b);
+const char *kill_ring_get(KillRing *kr, int offset, size_t *len);
+void kill_ring_free(KillRing *kr);
+
+#endif // KILLRING_H
@@ -0,0 +1,45 @@
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#include <sys/types.h>
+#include <time.h>
+
+// A file is read a page at a time, and no further than this.
+#define PREVIEW_PAGE 4096
+#define PREVIEW_MAX_BYTES (64 << 10)
+// A line is kept up to this many bytes.
+#define PREVIEW_COLS 512
+// The previews of the files looked at last are kept, this many.
+#define PREVIEW_CACHE 16
+
+// The first lines of a file, for dired's quick preview.
+typedef struct {
+    char *path;
+    unsigned long id;    // a new one for every read
+    dev_t dev;           // the file when it was read
+    ino_t ino;
+    time_t mtime;
+    long long size;
+    char **lines;
+    int nlines;
+    int complete;        // the lines are the whole file, or all there is to show
+    char note[128];      // shown instead of lines: a directory, binary, an error
+} Preview;
+
+// Most recent first.
+typedef struct {
+    Preview *items[PREVIEW_CACHE];
+    int n;
+} PreviewCache;
+
+// The first `rows` lines of the file at `path`, or as many as it has,
+// read with pread() from its start and never further than needed (and
+// PREVIEW_MAX_BYTES). Comes from the cache unless the file's size or
+// mtime changed since, or fewer lines were read than are wanted now.
+// A directory, a file that is not regular or looks binary, or one that
+// cannot be read gets a note instead of lines; only regular files are
+// opened. The preview belongs to the cache.
+const Preview *preview_get(PreviewCache *c, const char *path, int rows);
+void preview_cache_free(PreviewCache *c);
+
+#endif // PREVIEW_H
@@ -0,0 +1,39 @@
+#ifndef REGEX_H
+#define REGEX_H
+
+#include <stddef.h>
+
+// POSIX extended syntax: . [] [^] [:class:] * + ? {m,n} | () ^ $, plus
+// \d \w \s (and \D \W \S), \t and \n. Matching is leftmost-longest
+// within one line; ^ and $ match at the line's start and end.
+//
+// A compiled Regex builds its DFA states while it is used, so one
+// Regex must not be shared between threads.
+typedef struct Regex Regex;
+
+// Returns NULL and points *err at a static message on a syntax error.
+// With `fold`, ASCII letters match in either case.
+Regex *regex_compile(const char *pat, size_t len, int fold, const char **err);
+void regex_free(Regex *re);
+// The literal every match starts with, of length *len (0 if none).
+const char *regex_prefix(const Regex *re, size_t *len);
+
+// Start of the leftmost match in s[0..n) that starts at or after
+// `from`, or -1.
+long regex_find(Regex *re, const char *s, size_t n, size_t from);
+// Start of the rightmost match that starts before `before`, or -1.
+long regex_find_last(Regex *re, const char *s, size_t n, size_t before);
+// Number of matches starting before `before`, each one looked for from
+// the end of the one before, as query-replace replaces them.
+long regex_count(Regex *re, const char *s, size_t n, size_t before);
+// Length of the longest match starting at `at`, or -1 if none does.
+long regex_match_len(Regex *re, const char *s, size_t n, size_t at);
+// The stretches of s[0..n) covered by matches, taking every match at its
+// longest, overlapping ones too: spans[2k] and spans[2k + 1] are where
+// the k-th starts and ends, in order and merged where they meet. Empty
+// matches cover nothing. Returns how many there are; *spans grows as
+// needed, *cap being its size in spans. One backward pass finds where
+// matches start, so a line costs about its length, however many match.
+int regex_cover(Regex *re, const char *s, size_t n, int **spans, int *cap);
+
+#endif // REGEX_H
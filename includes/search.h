@@ -0,0 +1,216 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stddef.h>
+#include "buffer.h"
+#include "regex.h"
+#include "jobs.h"
+#include "trigram.h"
+
+// Needles up to this length use the first/last-byte filter, longer ones
+// the Horspool skip table.
+#define SEARCH_SHORT_MAX 16
+
+// ASCII case folding: the byte with A-Z mapped to a-z, and with a-z
+// mapped to A-Z. Bytes outside ASCII letters map to themselves.
+extern const unsigned char search_fold_lower[256];
+extern const unsigned char search_fold_upper[256];
+
+// A literal needle compiled once per query and reused for every line.
+// A folding pattern keeps the needle in lower case and matches ASCII
+// letters in either case.
+typedef struct {
+    char *needle;
+    size_t len;
+    int fold;
+    // OR'ed into a text byte before comparing it with the needle's first
+    // / last byte: 0x20 when that byte is a folded letter, otherwise 0
+    unsigned char or_first, or_last;
+    size_t skip[256];   // Horspool shift per byte of the window's last char
+    size_t rskip[256];  // same for backward search, keyed on the first char
+} SearchPattern;
+
+void search_compile(SearchPattern *p, const char *needle, size_t len, int fold);
+void search_pattern_free(SearchPattern *p);
+
+// Whether the pattern occurs at s. s must hold p->len bytes or end in
+// its NUL before them.
+int search_equal(const SearchPattern *p, const char *s);
+
+// Offset of the first occurrence of the pattern in hay[0..n), or -1.
+long search_find(const SearchPattern *p, const char *hay, size_t n);
+// Offset of the last occurrence of the pattern in hay[0..n), or -1.
+long search_find_last(const SearchPattern *p, const char *hay, size_t n);
+
+// Search the buffer forward from (*y, *x), wrapping around once. Returns
+// 1 on a match and moves (*y, *x) to its start.
+int search_buffer_forward(Buffer *b, const SearchPattern *p, int *y, int *x, int *wrapped);
+
+// What a search looks for: a literal string or a regular expression.
+// Commands go through this instead of calling either engine directly.
+typedef struct {
+    SearchPattern lit;
+    Regex *re;          // NULL for literal search
+    TrigramQuery tq;    // what a line must contain, for the buffer's index
+} Matcher;
+
+// Returns 0, or -1 with *err set if `q` is not a valid regex. With
+// `fold`, letters match in either case.
+int matcher_init(Matcher *m, const char *q, size_t qlen, int regex, int fold, const char **err);
+void matcher_free(Matcher *m);
+// Start of the first match in line[0..n) at or after `from`, or -1.
+long matcher_find(Matcher *m, const char *line, size_t n, size_t from);
+// Start of the last match that starts before `before`, or -1.
+long matcher_find_last(Matcher *m, const char *line, size_t n, size_t before);
+// Number of matches starting before `before`, each one looked for from
+// the end of the one before: "aa" occurs twice in "aaaa", not three
+// times.
+long matcher_count(Matcher *m, const char *line, size_t n, size_t before);
+// Length of the match starting at `at`.
+size_t matcher_match_len(Matcher *m, const char *line, size_t n, size_t at);
+
+typedef struct {
+    int y, x;
+} SearchPos;
+
+// Matches of one isearch query in search order around the isearch
+// origin. Matches are found lazily from two scan points: one moving
+// forward from the origin, one moving backward from it. pos[] is a gap
+// array: forward finds fill [0, nfwd), backward finds fill the last
+// nback slots, and the unscanned part of the buffer is the gap between.
+// A longer literal query is answered by filtering the shorter query's
+// set instead of rescanning.
+typedef struct {
+    Matcher m;
+    SearchPos *pos;
+    int nfwd, nback, cap;
+    int cur;                // logical index of the current match, -1 if none
+    int oy, ox;             // isearch origin
+    int fy, fx, fwrapped;   // forward scan resumes here
+    int by, bx, bwrapped;   // backward scan continues before this point
+    int complete;           // every match in the buffer is in pos[]
+} MatchSet;
+
+// Takes ownership of `m`.
+void match_set_init(MatchSet *ms, Matcher *m, int oy, int ox);
+void match_set_narrow(MatchSet *ms, const MatchSet *parent, Buffer *b, const char *q, size_t qlen,
+                      int fold);
+SearchPos *match_set_at(MatchSet *ms, int i);
+// Make the nearest match at (or strictly past, with `strict`) `from` in
+// the given direction current, scanning as needed. Sets *wrapped_around
+// when the search came back around past the origin.
+int match_set_seek(MatchSet *ms, Buffer *b, SearchPos from, int reverse, int strict,
+                   int *wrapped_around);
+void match_set_free(MatchSet *ms);
+
+// The matches on the lines in view, for isearch's lazy highlighting. A
+// row is scanned once and kept, stamped with the line pointer and the
+// line's stamp (buffer_line_stamp()) it was scanned at; rows live in a ring indexed by line number,
+// so scrolling only scans the lines that come into view.
+typedef struct {
+    int y;                  // line number, -1 if the slot is unused
+    const char *line;
+    unsigned long stamp;
+    int *spans;             // merged [start, end) column pairs of the matches
+    int nspans, cap;
+} HighlightRow;
+
+typedef struct {
+    Matcher *m;             // not owned; NULL shows no matches
+    HighlightRow *rows;
+    int nrows;
+    int cur_y, cur_x, cur_len; // the current match, shown apart; cur_len 0 if none
+} Highlight;
+
+void highlight_init(Highlight *h);
+void highlight_free(Highlight *h);
+// Show the matches of `m` from now on, dropping the cached rows.
+void highlight_set_matcher(Highlight *h, Matcher *m);
+// The spans of line y. The ring holds at least `rows` lines, so a screen
+// of that many rows never evicts its own lines.
+const int *highlight_line(Highlight *h, Buffer *b, int y, int rows, int *nspans);
+
+// Lines per work item of the match counter.
+#define COUNT_CHUNK_LINES 4096
+
+// Counts the matches of a query in the whole buffer on worker threads,
+// each with its own matcher. The per-chunk totals rank any position
+// without another full scan. The buffer must not change until
+// match_count_stop().
+typedef struct {
+    Job job;
+    Buffer *buf;
+    Matcher *workers;   // one per worker thread
+    int nworkers;
+    long *counts;       // matches per chunk, -1 until counted
+    int nchunks;
+    int running;
+} MatchCount;
+
+// Returns -1 with *err set if `q` is not a valid regex.
+int match_count_start(MatchCount *mc, Buffer *b, const char *q, size_t qlen, int regex,
+                      int fold, const char **err);
+void match_count_stop(MatchCount *mc);
+// Matches counted so far; *complete once the whole buffer is done.
+long match_count_total(MatchCount *mc, int *complete);
+// Matches counted as matcher_count() does that start before (y, x), or
+// -1 while the chunks before y are still being counted. `m` is the caller's matcher for the same query.
+long match_count_before(MatchCount *mc, Matcher *m, int y, int x);
+
+// Lines per work item of the occur scan.
+#define OCCUR_CHUNK_LINES 4096
+
+// Lists the lines matching a query on worker threads, for M-x occur.
+// Each chunk's matching lines come out formatted as "NNN:text", ready to
+// become lines of the results buffer. Chunks finish in any order and are
+// taken in line order, so the results can be shown while the scan runs.
+// The buffer must not change until occur_stop().
+typedef struct {
+    Job job;
+    Buffer *buf;
+    Matcher *workers;   // one per worker thread
+    int nworkers;
+    char ***chunks;     // formatted matching lines per chunk
+    int *counts;        // lines in each chunk's list, -1 until scanned
+    int nchunks;
+    int next;           // first chunk not taken yet
+    int width;          // digits in the largest line number
+    int running;
+} OccurScan;
+
+// Returns -1 with *err set if `q` is not a valid regex.
+int occur_start(OccurScan *oc, Buffer *b, const char *q, size_t qlen, int regex, int fold,
+                const char **err);
+void occur_stop(OccurScan *oc);
+// Append the lines of the scanned chunks that come next in line order
+// to `out`. Returns the number of lines appended.
+int occur_take(OccurScan *oc, Buffer *out);
+// Whether every chunk has been taken.
+int occur_done(OccurScan *oc);
+
+// Lines per work item of the line matcher.
+#define LINE_MATCH_CHUNK_LINES 4096
+
+// Finds which lines of [y0, y1) hold a match on worker threads, for
+// keep-lines and flush-lines. Every chunk's flags are final once it is
+// finished; all of them are once the job is done. The buffer must not
+// change until line_match_stop().
+typedef struct {
+    Job job;
+    Buffer *buf;
+    Matcher *workers;   // one per worker thread
+    int nworkers;
+    int y0, y1;
+    unsigned char *hit; // per line of [y0, y1): 1 if it holds a match
+    int nchunks;
+    int running;
+} LineMatch;
+
+// Returns -1 with *err set if `q` is not a valid regex.
+int line_match_start(LineMatch *lm, Buffer *b, int y0, int y1, const char *q, size_t qlen,
+                     int regex, int fold, const char **err);
+void line_match_stop(LineMatch *lm);
+// Chunks finished so far, out of *nchunks.
+int line_match_progress(LineMatch *lm, int *nchunks);
+
+#endif // SEARCH_H
@@ -0,0 +1,71 @@
+#ifndef TRIGRAM_H
+#define TRIGRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "buffer.h"
+#include "jobs.h"
+
+// Bits in a block's trigram signature.
+#define TRIGRAM_SIG_BITS 65536
+// Text per block; blocks end on a line boundary.
+#define TRIGRAM_BLOCK_BYTES (128 * 1024)
+// Most memory the signatures of one buffer may take. A buffer that
+// would need more gets proportionally larger blocks.
+#define TRIGRAM_MAX_BYTES (64L << 20)
+// Most trigrams of a query that are looked up.
+#define TRIGRAM_QUERY_MAX 32
+// Most edited blocks trigram_index_refresh() re-indexes at a time.
+#define TRIGRAM_REFRESH_MAX 16
+
+// Which trigrams occur in each block of lines of a buffer. Every
+// trigram of a line's case-folded text is hashed to a bit of its
+// block's signature; a block whose signature lacks a bit of the query
+// cannot hold a match, so searches skip it without reading its lines.
+// One index serves case-sensitive and folded queries alike.
+//
+// Blocks are indexed on worker threads. A block counts as a candidate
+// for every query until it is indexed, so the index can be used while it
+// is being built. Editing lines makes the blocks holding them candidates
+// again until they are refreshed; lines inserted or deleted move the
+// following block boundaries along. The lines of the buffer must not
+// change while the build is running.
+typedef struct TrigramIndex {
+    Job job;
+    Buffer *buf;
+    int *start;         // first line of each block; start[nblocks] is nlines
+    int nblocks;
+    uint64_t *sigs;     // TRIGRAM_SIG_BITS per block
+    unsigned char *ready; // the block's signature matches its lines
+} TrigramIndex;
+
+// The trigrams a match must contain; n is 0 if the query is too short to
+// use the index.
+typedef struct {
+    uint16_t h[TRIGRAM_QUERY_MAX];
+    int n;
+} TrigramQuery;
+
+// Start indexing the buffer in the background.
+TrigramIndex *trigram_index_start(Buffer *b);
+void trigram_index_free(TrigramIndex *ix);
+// Blocks the build has indexed so far, out of *nblocks.
+int trigram_index_progress(TrigramIndex *ix, int *nblocks);
+// Bytes taken by the signatures.
+size_t trigram_index_size(const TrigramIndex *ix);
+// Lines [y, y + n) hold new text, after delta lines were inserted at y
+// (or -delta lines removed there).
+void trigram_index_edit(TrigramIndex *ix, int y, int n, int delta);
+// Re-index some of the edited blocks once the build has finished.
+void trigram_index_refresh(TrigramIndex *ix);
+
+// A query matching `s` literally. s may be in any case.
+void trigram_query_init(TrigramQuery *tq, const char *s, size_t len);
+// First line at or after y that may hold a match, or nlines; lines from
+// there up to *end need no further lookup. ix may be NULL.
+int trigram_index_next(TrigramIndex *ix, const TrigramQuery *tq, int y, int *end);
+// Last line at or before y that may hold a match, or -1; lines from
+// *begin up to there need no further lookup. ix may be NULL.
+int trigram_index_prev(TrigramIndex *ix, const TrigramQuery *tq, int y, int *begin);
+
+#endif // TRIGRAM_H
@@ -20,25 +20,19 @@
 
 #include "includes/input.h"
 #include "includes/config.h"
+#include "includes/search.h"
 
 // Track the previous command so consecutive self-inserts are grouped
-// into one undo step and consecutive C-k kills append to the kill buffer.
-typedef enum { CMD_OTHER, CMD_INSERT, CMD_KILL } LastCmd;
+// into one undo step, consecutive C-k kills append to the last kill, and
+// M-y only follows a yank.
+typedef enum { CMD_OTHER, CMD_INSERT, CMD_KILL, CMD_YANK } LastCmd;
 static LastCmd last_cmd = CMD_OTHER;
 
-static void kill_buf_set(EditorState *E, const char *text) {
-    free(E->kill_buf);
-    E->kill_buf = xstrdup(text);
-}
-
-static void kill_buf_append(EditorState *E, const char *text) {
-    if (!E->kill_buf) {
-        kill_buf_set(E, text);
-        return;
-    }
-    size_t a = strlen(E->kill_buf), b = strlen(text);
-    E->kill_buf = xrealloc(E->kill_buf, a + b + 1);
-    memcpy(E->kill_buf + a, text, b + 1);
+// Every edit goes through here before touching the buffer: pending M-w
+// copies are read out of the text first, then the undo snapshot is taken.
+static void editor_push_undo(EditorState *E) {
+    buffer_will_change(E->buf);
+    buffer_push_undo(E->buf, E->cx, E->cy);
 }
 
 void editor_insert_char(EditorState *E, int c) {
@@ -47,7 +41,7 @@ void editor_insert_char(EditorState *E, int c) {
         return;
     }
     editor_clamp_cursor(E);
-    if (last_cmd != CMD_INSERT) buffer_push_undo(E->buf, E->cx, E->cy);
+    if (last_cmd != CMD_INSERT) editor_push_undo(E);
     last_cmd = CMD_INSERT;
 
     Buffer *b = E->buf;
@@ -61,35 +55,67 @@ void editor_insert_char(EditorState *E, int c) {
     b->lines[E->cy] = newl;
     E->cx++;
     E->goal_cx = E->cx;
-    b->modified = 1;
+    buffer_changed(b, E->cy, 1, 0);
 }
 
-// Insert arbitrary text (may contain newlines) at the cursor.
-static void editor_insert_text(EditorState *E, const char *text) {
+// Insert `n` bytes of text (may contain newlines) at the cursor. The
+// text is split once: the cursor line becomes head + first segment,
+// each further segment becomes a new line, and the old tail is glued
+// to the last one. New lines are opened with a single memmove.
+static void editor_insert_text(EditorState *E, const char *text, size_t n) {
     Buffer *b = E->buf;
-    for (const char *p = text; *p; ++p) {
-        if (*p == '\n') {
-            char *line = b->lines[E->cy];
-            char *right = xstrdup(line + E->cx);
-            line[E->cx] = '\0';
-            buffer_insert_line(b, E->cy + 1, right);
-            free(right);
-            E->cy++;
-            E->cx = 0;
-        } else {
-            char *line = b->lines[E->cy];
-            int llen = (int)strlen(line);
-            char *newl = xmalloc(llen + 2);
-            memcpy(newl, line, E->cx);
-            newl[E->cx] = *p;
-            memcpy(newl + E->cx + 1, line + E->cx, llen - E->cx + 1);
-            free(b->lines[E->cy]);
-            b->lines[E->cy] = newl;
-            E->cx++;
-        }
+    int extra = 0;
+    for (const char *p = text; (p = memchr(p, '\n', text + n - p)) != NULL; ++p) extra++;
+
+    char *line = b->lines[E->cy];
+    size_t llen = strlen(line);
+    const char *tail = line + E->cx;
+    size_t tlen = llen - E->cx;
+
+    if (extra == 0) {
+        char *newl = xmalloc(llen + n + 1);
+        memcpy(newl, line, E->cx);
+        memcpy(newl + E->cx, text, n);
+        memcpy(newl + E->cx + n, tail, tlen + 1);
+        free(b->lines[E->cy]);
+        b->lines[E->cy] = newl;
+        E->cx += (int)n;
+        E->goal_cx = E->cx;
+        buffer_changed(b, E->cy, 1, 0);
+        return;
     }
+
+    buffer_ensure_capacity(b, b->nlines + extra);
+    memmove(&b->lines[E->cy + 1 + extra], &b->lines[E->cy + 1],
+            (b->nlines - E->cy - 1) * sizeof(char*));
+
+    const char *seg = text, *end = text + n;
+    const char *nl = memchr(seg, '\n', end - seg);
+    char *first = xmalloc(E->cx + (nl - seg) + 1);
+    memcpy(first, line, E->cx);
+    memcpy(first + E->cx, seg, nl - seg);
+    first[E->cx + (nl - seg)] = '\0';
+
+    int y = E->cy;
+    for (seg = nl + 1; (nl = memchr(seg, '\n', end - seg)) != NULL; seg = nl + 1) {
+        char *mid = xmalloc(nl - seg + 1);
+        memcpy(mid, seg, nl - seg);
+        mid[nl - seg] = '\0';
+        b->lines[++y] = mid;
+    }
+    size_t last = end - seg;
+    char *lastl = xmalloc(last + tlen + 1);
+    memcpy(lastl, seg, last);
+    memcpy(lastl + last, tail, tlen + 1);
+    b->lines[++y] = lastl;
+
+    free(b->lines[E->cy]);
+    b->lines[E->cy] = first;
+    b->nlines += extra;
+    buffer_changed(b, E->cy, extra + 1, extra);
+    E->cy = y;
+    E->cx = (int)last;
     E->goal_cx = E->cx;
-    b->modified = 1;
 }
 
 void editor_backspace(EditorState *E) {
@@ -100,7 +126,7 @@ void editor_backspace(EditorState *E) {
     editor_clamp_cursor(E);
     Buffer *b = E->buf;
     if (E->cx == 0 && E->cy == 0) return;
-    buffer_push_undo(b, E->cx, E->cy);
+    editor_push_undo(E);
     if (E->cx > 0) {
         char *line = b->lines[E->cy];
         int llen = (int)strlen(line);
@@ -122,7 +148,7 @@ void editor_backspace(EditorState *E) {
         E->cx = (int)plen;
     }
     E->goal_cx = E->cx;
-    b->modified = 1;
+    buffer_changed(b, E->cy, 1, 0);
 }
 
 void editor_delete_char(EditorState *E) {
@@ -135,12 +161,12 @@ void editor_delete_char(EditorState *E) {
     char *line = b->lines[E->cy];
     int llen = (int)strlen(line);
     if (E->cx < llen) {
-        buffer_push_undo(b, E->cx, E->cy);
+        editor_push_undo(E);
         memmove(&line[E->cx], &line[E->cx + 1], llen - E->cx);
-        b->modified = 1;
+        buffer_changed(b, E->cy, 1, 0);
     } else if (E->cy + 1 < b->nlines) {
         // join with next line
-        buffer_push_undo(b, E->cx, E->cy);
+        editor_push_undo(E);
         char *next = b->lines[E->cy + 1];
         char *merged = xmalloc(llen + strlen(next) + 1);
         strcpy(merged, line);
@@ -148,7 +174,7 @@ void editor_delete_char(EditorState *E) {
         free(b->lines[E->cy]);
         b->lines[E->cy] = merged;
         buffer_delete_line(b, E->cy + 1);
-        b->modified = 1;
+        buffer_changed(b, E->cy, 1, 0);
     }
 }
 
@@ -158,11 +184,12 @@ void editor_enter(EditorState *E) {
         return;
     }
     editor_clamp_cursor(E);
-    buffer_push_undo(E->buf, E->cx, E->cy);
+    editor_push_undo(E);
     Buffer *b = E->buf;
     char *line = b->lines[E->cy];
     char *right = xstrdup(line + E->cx);
     line[E->cx] = '\0';
+    buffer_changed(b, E->cy, 1, 0);
     buffer_insert_line(b, E->cy + 1, right);
     free(right);
     E->cy++;
@@ -181,30 +208,6 @@ void editor_set_mark(EditorState *E) {
     editor_message(E, "Mark set");
 }
 
-// Build a heap string of the region content ('\n' separated).
-static char *region_to_string(EditorState *E, int sy, int sx, int ey, int ex) {
-    Buffer *b = E->buf;
-    size_t total = 0;
-    for (int y = sy; y <= ey; ++y) {
-        int len = (int)strlen(b->lines[y]);
-        int from = (y == sy) ? sx : 0;
-        int to = (y == ey) ? ex : len;
-        total += (size_t)(to - from) + 1; // +1 for '\n' or NUL
-    }
-    char *out = xmalloc(total + 1);
-    char *p = out;
-    for (int y = sy; y <= ey; ++y) {
-        int len = (int)strlen(b->lines[y]);
-        int from = (y == sy) ? sx : 0;
-        int to = (y == ey) ? ex : len;
-        memcpy(p, b->lines[y] + from, to - from);
-        p += to - from;
-        if (y != ey) *p++ = '\n';
-    }
-    *p = '\0';
-    return out;
-}
-
 static void delete_region(EditorState *E, int sy, int sx, int ey, int ex) {
     Buffer *b = E->buf;
     if (sy == ey) {
@@ -225,7 +228,7 @@ static void delete_region(EditorState *E, int sy, int sx, int ey, int ex) {
     E->cy = sy;
     E->cx = sx;
     E->goal_cx = sx;
-    b->modified = 1;
+    buffer_changed(b, sy, 1, 0);
 }
 
 // Delete-selection behavior: typing or deleting with an active region
@@ -235,7 +238,7 @@ static int delete_active_region(EditorState *E) {
     int has = editor_region_bounds(E, &sy, &sx, &ey, &ex);
     E->mark_active = 0;
     if (!has || buffer_is_readonly(E->buf)) return 0;
-    buffer_push_undo(E->buf, E->cx, E->cy);
+    editor_push_undo(E);
     delete_region(E, sy, sx, ey, ex);
     return 1;
 }
@@ -246,9 +249,8 @@ void editor_copy_region(EditorState *E) {
         editor_message(E, "No region");
         return;
     }
-    char *text = region_to_string(E, sy, sx, ey, ex);
-    kill_buf_set(E, text);
-    free(text);
+    // the text stays in the buffer until it changes (see editor_push_undo)
+    kill_ring_push_region(&E->kill_ring, E->buf, sy, sx, ey, ex);
     E->mark_active = 0;
     editor_message(E, "Region copied");
 }
@@ -263,10 +265,8 @@ void editor_kill_region(EditorState *E) {
         editor_message(E, "Buffer is read-only");
         return;
     }
-    char *text = region_to_string(E, sy, sx, ey, ex);
-    kill_buf_set(E, text);
-    free(text);
-    buffer_push_undo(E->buf, E->cx, E->cy);
+    kill_ring_push_region(&E->kill_ring, E->buf, sy, sx, ey, ex);
+    editor_push_undo(E); // reads the region into the kill ring
     delete_region(E, sy, sx, ey, ex);
     E->mark_active = 0;
     editor_message(E, "Region killed");
@@ -282,17 +282,17 @@ void editor_kill_line(EditorState *E) {
     char *line = b->lines[E->cy];
     int llen = (int)strlen(line);
 
-    buffer_push_undo(b, E->cx, E->cy);
+    editor_push_undo(E);
     if (E->cx < llen) {
         // kill to end of line
-        if (last_cmd == CMD_KILL) kill_buf_append(E, line + E->cx);
-        else kill_buf_set(E, line + E->cx);
+        if (last_cmd == CMD_KILL) kill_ring_append(&E->kill_ring, line + E->cx, llen - E->cx);
+        else kill_ring_push(&E->kill_ring, line + E->cx, llen - E->cx);
         line[E->cx] = '\0';
-        b->modified = 1;
+        buffer_changed(b, E->cy, 1, 0);
     } else if (E->cy + 1 < b->nlines) {
         // at end of line: kill the newline (join with next line)
-        if (last_cmd == CMD_KILL) kill_buf_append(E, "\n");
-        else kill_buf_set(E, "\n");
+        if (last_cmd == CMD_KILL) kill_ring_append(&E->kill_ring, "\n", 1);
+        else kill_ring_push(&E->kill_ring, "\n", 1);
         char *next = b->lines[E->cy + 1];
         char *merged = xmalloc(llen + strlen(next) + 1);
         strcpy(merged, line);
@@ -300,22 +300,49 @@ void editor_kill_line(EditorState *E) {
         free(b->lines[E->cy]);
         b->lines[E->cy] = merged;
         buffer_delete_line(b, E->cy + 1);
-        b->modified = 1;
+        buffer_changed(b, E->cy, 1, 0);
     }
 }
 
-void editor_yank(EditorState *E) {
+int editor_yank(EditorState *E) {
     if (buffer_is_readonly(E->buf)) {
         editor_message(E, "Buffer is read-only");
-        return;
+        return 0;
     }
-    if (!E->kill_buf || !*E->kill_buf) {
-        editor_message(E, "Kill buffer is empty");
-        return;
+    size_t n;
+    const char *text = kill_ring_get(&E->kill_ring, 0, &n);
+    if (!text || n == 0) {
+        editor_message(E, "Kill ring is empty");
+        return 0;
     }
     editor_clamp_cursor(E);
-    buffer_push_undo(E->buf, E->cx, E->cy);
-    editor_insert_text(E, E->kill_buf);
+    editor_push_undo(E);
+    E->kill_ring.yank = 0;
+    E->yank_sy = E->cy;
+    E->yank_sx = E->cx;
+    editor_insert_text(E, text, n);
+    return 1;
+}
+
+// M-y: replace the text just yanked with the next older kill. The ring
+// only rotates an index; entries are never copied.
+int editor_yank_pop(EditorState *E) {
+    if (last_cmd != CMD_YANK) {
+        editor_message(E, "Previous command was not a yank");
+        return 0;
+    }
+    if (buffer_is_readonly(E->buf)) {
+        editor_message(E, "Buffer is read-only");
+        return 0;
+    }
+    KillRing *kr = &E->kill_ring;
+    kr->yank = (kr->yank + 1) % kr->count;
+    size_t n;
+    const char *text = kill_ring_get(kr, kr->yank, &n);
+    editor_push_undo(E);
+    delete_region(E, E->yank_sy, E->yank_sx, E->cy, E->cx);
+    editor_insert_text(E, text, n);
+    return 1;
 }
 
 void editor_undo_cmd(EditorState *E) {
@@ -338,53 +365,101 @@ void editor_undo_cmd(EditorState *E) {
 // ------------------------------------------------------------------
 // incremental search
 
-// Search forward for `q` starting at (*y, *x). Returns 1 on match and
-// updates (*y, *x) to the match start. Wraps around the buffer once.
-static int search_forward(Buffer *b, const char *q, int *y, int *x, int *wrapped) {
-    if (wrapped) *wrapped = 0;
-    int startY = *y, startX = *x;
-    int cy = startY, cx = startX;
-    for (int pass = 0; pass < 2; ++pass) {
-        while (cy < b->nlines) {
-            const char *line = b->lines[cy];
-            int len = (int)strlen(line);
-            if (cx <= len) {
-                const char *hit = strstr(line + cx, q);
-                if (hit) {
-                    int col = (int)(hit - line);
-                    if (pass == 1 && (cy > startY || (cy == startY && col >= startX))) {
-                        // completed the wrap without a new match
-                        if (cy == startY && col == startX) { *y = cy; *x = col; return 1; }
-                    }
-                    *y = cy;
-                    *x = col;
-                    return 1;
-                }
-            }
-            cy++;
-            cx = 0;
+// Smart case: a query without capitals matches either case. In a regex
+// a capital after a backslash (\W, \S, \D) is syntax, not text.
+static int smart_fold(const char *q, size_t qlen, int regex) {
+    for (size_t i = 0; i < qlen; ++i) {
+        if (regex && q[i] == '\\') {
+            ++i;
+            continue;
         }
-        // wrap
-        cy = 0;
-        cx = 0;
-        if (wrapped) *wrapped = 1;
+        if (isupper((unsigned char)q[i])) return 0;
     }
-    return 0;
+    return 1;
+}
+
+// Restart the background match count for a changed query.
+static void isearch_recount(EditorState *E, MatchCount *count, const char *query, int qlen,
+                            int regex, int valid) {
+    match_count_stop(count);
+    if (qlen > 0 && valid)
+        match_count_start(count, E->buf, query, qlen, regex, smart_fold(query, qlen, regex), NULL);
 }
 
-void editor_isearch(EditorState *E) {
+// Incremental search in either direction; C-s and C-r move to the next
+// or previous match and switch direction. The cursor sits after the
+// match when searching forward and on its start when searching backward.
+// With `regex` the query is a regular expression (C-M-s, C-M-r).
+void editor_isearch(EditorState *E, int reverse, int regex) {
     char query[256] = "";
+    const char *errs[sizeof(query)] = { 0 };  // why a regex query is incomplete
     int qlen = 0;
     int orig_cx = E->cx, orig_cy = E->cy, orig_ro = E->row_offset;
-    int failing = 0, wrapped = 0;
+    SearchPos origin = { orig_cy, orig_cx };
+    int overwrapped = 0;
+    // levels[n] is the match set of the first n query characters, so
+    // Backspace returns to the shorter query's matches without searching
+    MatchSet *levels = xmalloc(sizeof(MatchSet) * sizeof(query));
+    // total and rank of the current match, counted in the background
+    // and restarted whenever the query changes
+    MatchCount count;
+    memset(&count, 0, sizeof(count));
+    // every match in view is shown, the current one emphasized
+    Highlight hl;
+    highlight_init(&hl);
+    E->highlight = &hl;
+    trigram_index_refresh(E->buf->index);
 
     while (1) {
-        char prompt[320];
-        snprintf(prompt, sizeof(prompt), "%s%sI-search: %s",
-                 failing ? "Failing " : "", wrapped ? "Wrapped " : "", query);
+        MatchSet *ms = qlen > 0 ? &levels[qlen] : NULL;
+        int failing = ms && ms->cur < 0 && !errs[qlen];
+        int wrapped = 0;
+        hl.cur_len = 0;
+        if (ms && ms->cur >= 0) {
+            SearchPos *p = match_set_at(ms, ms->cur);
+            const char *line = E->buf->lines[p->y];
+            hl.cur_y = p->y;
+            hl.cur_x = p->x;
+            hl.cur_len = (int)matcher_match_len(&ms->m, line, strlen(line), p->x);
+            E->cy = p->y;
+            E->cx = reverse ? p->x : p->x + hl.cur_len;
+            E->goal_cx = E->cx;
+            int before = p->y < orig_cy || (p->y == orig_cy && p->x < orig_cx);
+            wrapped = reverse ? !before : before;
+        }
+
+        char note[96] = "";
+        int counting = 0;
+        if (ms && errs[qlen]) {
+            snprintf(note, sizeof(note), " [%s]", errs[qlen]);
+        } else if (ms && ms->cur >= 0 && count.running) {
+            int complete;
+            long total = match_count_total(&count, &complete);
+            SearchPos *p = match_set_at(ms, ms->cur);
+            // isearch also stops inside a match the count steps over; it
+            // is shown as that match
+            long nth = match_count_before(&count, &ms->m, p->y, p->x + 1);
+            counting = !complete;
+            // a partial total is only a lower bound, so it is never below N
+            if (nth >= 0 && total < nth) total = nth;
+            if (nth >= 0) {
+                snprintf(note, sizeof(note), "  (match %ld of %ld%s)", nth, total,
+                         complete ? "" : "+");
+            } else {
+                snprintf(note, sizeof(note), "  (match ? of %ld+)", total);
+            }
+        }
+
+        char prompt[400];
+        snprintf(prompt, sizeof(prompt), "%s%s%sI-search%s: %s%s",
+                 failing ? "Failing " : "",
+                 overwrapped ? "Overwrapped " : wrapped ? "Wrapped " : "",
+                 regex ? "Regexp " : "", reverse ? " backward" : "", query, note);
         snprintf(E->minibuf, sizeof(E->minibuf), "%s", prompt);
         editor_draw(E, NULL);
 
+        // poll while the count shown is still coming in
+        timeout(counting ? 50 : -1);
         int ch = getch();
         if (ch == ERR || ch == KEY_RESIZE) continue;
 
@@ -395,43 +470,294 @@ void editor_isearch(EditorState *E) {
             E->row_offset = orig_ro;
             E->goal_cx = orig_cx;
             editor_message(E, "Quit");
-            return;
+            break;
         } else if (ch == '\n' || ch == '\r' || ch == 27) {
             E->minibuf[0] = '\0';
-            return;
+            break;
         } else if (ch == KEY_BACKSPACE || ch == 127 || ch == 8) {
-            if (qlen > 0) query[--qlen] = '\0';
-            failing = 0;
-            wrapped = 0;
             if (qlen > 0) {
-                int y = orig_cy, x = orig_cx;
-                if (search_forward(E->buf, query, &y, &x, &wrapped)) {
-                    E->cy = y; E->cx = x + qlen; E->goal_cx = E->cx;
-                } else failing = 1;
-            } else {
+                match_set_free(&levels[qlen]);
+                errs[qlen] = NULL;
+                query[--qlen] = '\0';
+            }
+            overwrapped = 0;
+            if (qlen == 0 || (levels[qlen].cur < 0 && !errs[qlen])) {
                 E->cx = orig_cx; E->cy = orig_cy; E->goal_cx = orig_cx;
             }
-        } else if (ch == CTRL('s')) {
-            // next match: search starting just past the current match
+            isearch_recount(E, &count, query, qlen, regex, !errs[qlen]);
+            highlight_set_matcher(&hl, qlen > 0 && !errs[qlen] ? &levels[qlen].m : NULL);
+        } else if (ch == CTRL('s') || ch == CTRL('r')) {
+            // next / previous match, relative to the current one
+            reverse = ch == CTRL('r');
             if (qlen == 0) continue;
-            int y = E->cy, x = E->cx - qlen + 1;
-            if (x < 0) x = 0;
-            if (search_forward(E->buf, query, &y, &x, &wrapped)) {
-                E->cy = y; E->cx = x + qlen; E->goal_cx = E->cx;
-                failing = 0;
-            } else failing = 1;
+            SearchPos from = ms->cur >= 0 ? *match_set_at(ms, ms->cur) : origin;
+            match_set_seek(ms, E->buf, from, reverse, 1, &overwrapped);
         } else if (isprint(ch) && ch < 256 && qlen + 1 < (int)sizeof(query)) {
             query[qlen++] = (char)ch;
             query[qlen] = '\0';
-            int y = E->cy, x = E->cx - (qlen - 1);
-            if (x < 0) { x = 0; }
-            wrapped = 0;
-            if (search_forward(E->buf, query, &y, &x, &wrapped)) {
-                E->cy = y; E->cx = x + qlen; E->goal_cx = E->cx;
-                failing = 0;
-            } else failing = 1;
+            overwrapped = 0;
+            ms = &levels[qlen];
+            // the current match survives if the longer query still
+            // matches there, otherwise the search moves on from it
+            SearchPos from = origin;
+            int strict = reverse;
+            for (int i = qlen - 1; i > 0; --i) {
+                if (levels[i].cur >= 0) {
+                    from = *match_set_at(&levels[i], levels[i].cur);
+                    strict = 0;
+                    break;
+                }
+            }
+            if (regex) {
+                // a longer regex is not a filter of the shorter one, so
+                // every keystroke compiles and searches afresh
+                Matcher m;
+                if (matcher_init(&m, query, qlen, 1, smart_fold(query, qlen, 1), &errs[qlen]) < 0) {
+                    memset(ms, 0, sizeof(*ms));
+                    ms->cur = -1;
+                    ms->complete = 1;
+                } else {
+                    match_set_init(ms, &m, orig_cy, orig_cx);
+                }
+            } else if (qlen == 1) {
+                Matcher m;
+                matcher_init(&m, query, qlen, 0, smart_fold(query, qlen, 0), NULL);
+                match_set_init(ms, &m, orig_cy, orig_cx);
+            } else {
+                match_set_narrow(ms, &levels[qlen - 1], E->buf, query, qlen,
+                                 smart_fold(query, qlen, 0));
+            }
+            if (!errs[qlen]) match_set_seek(ms, E->buf, from, reverse, strict, &overwrapped);
+            isearch_recount(E, &count, query, qlen, regex, !errs[qlen]);
+            highlight_set_matcher(&hl, qlen > 0 && !errs[qlen] ? &levels[qlen].m : NULL);
+        }
+    }
+
+    timeout(-1);
+    match_count_stop(&count);
+    E->highlight = NULL;
+    highlight_free(&hl);
+    for (int i = 1; i <= qlen; ++i) match_set_free(&levels[i]);
+    free(levels);
+}
+
+// ------------------------------------------------------------------
+// query replace
+
+// Put `to` in place of the len bytes at (y, x).
+static void replace_at(Buffer *b, int y, int x, size_t len, const char *to, size_t tolen) {
+    const char *line = b->lines[y];
+    size_t llen = strlen(line);
+    char *newl = xmalloc(llen - len + tolen + 1);
+    memcpy(newl, line, x);
+    memcpy(newl + x, to, tolen);
+    memcpy(newl + x + tolen, line + x + len, llen - x - len + 1);
+    free(b->lines[y]);
+    b->lines[y] = newl;
+    buffer_changed(b, y, 1, 0);
+}
+
+// Replace every match from (y, x) to the end of the buffer, leaving
+// (*ly, *lx) after the last replacement. A line with matches is rebuilt
+// once, copying the text between them and the replacements into a new
+// string, so the cost is one pass over the line however many matches it
+// holds. Blocks the buffer's index rules out are skipped unread. The
+// matches must not be empty. Returns the number replaced.
+static long replace_rest(Buffer *b, Matcher *m, int y, int x, const char *to, size_t tolen,
+                         int *ly, int *lx) {
+    long n = 0;
+    for (int end = y; y < b->nlines; ++y, x = 0) {
+        if (y >= end) {
+            int next = trigram_index_next(b->index, &m->tq, y, &end);
+            if (next != y) x = 0;
+            if ((y = next) >= b->nlines) break;
+        }
+        const char *line = b->lines[y];
+        size_t len = strlen(line);
+        long p = matcher_find(m, line, len, x);
+        if (p < 0) continue;
+        size_t cap = len + tolen + 1, o = 0, done = 0;
+        char *out = xmalloc(cap);
+        while (p >= 0) {
+            size_t ml = matcher_match_len(m, line, len, p);
+            if (o + (p - done) + tolen + 2 > cap) {
+                while (o + (p - done) + tolen + 2 > cap) cap *= 2;
+                out = xrealloc(out, cap);
+            }
+            memcpy(out + o, line + done, p - done);
+            o += p - done;
+            memcpy(out + o, to, tolen);
+            o += tolen;
+            done = p + ml;
+            n++;
+            *ly = y;
+            *lx = (int)o;
+            p = matcher_find(m, line, len, done);
         }
+        if (o + (len - done) + 1 > cap) out = xrealloc(out, o + (len - done) + 1);
+        memcpy(out + o, line + done, len - done + 1);
+        free(b->lines[y]);
+        b->lines[y] = out;
+        buffer_changed(b, y, 1, 0);
+    }
+    return n;
+}
+
+// Query replace from point to the end of the buffer: at each match,
+// y or Space replaces, n or Backspace skips, ! replaces all the rest,
+// . replaces and stops, q or Enter stops. The whole run is one undo step.
+void editor_query_replace(EditorState *E) {
+    if (buffer_is_readonly(E->buf)) {
+        editor_message(E, "Buffer is read-only");
+        return;
+    }
+    char from[256] = "", to[256] = "", prompt[320];
+    if (editor_minibuffer_getline(E, "Query replace: ", from, sizeof(from)) != 0 || !from[0]) {
+        editor_message(E, "Canceled");
+        return;
+    }
+    snprintf(prompt, sizeof(prompt), "Query replace %s with: ", from);
+    if (editor_minibuffer_getline(E, prompt, to, sizeof(to)) != 0) {
+        editor_message(E, "Canceled");
+        return;
+    }
+    size_t flen = strlen(from), tolen = strlen(to);
+    Matcher m;
+    matcher_init(&m, from, flen, 0, 0, NULL);
+    Highlight hl;
+    highlight_init(&hl);
+    highlight_set_matcher(&hl, &m);
+    E->highlight = &hl;
+
+    editor_clamp_cursor(E);
+    Buffer *b = E->buf;
+    trigram_index_refresh(b->index);
+    int y = E->cy, x = E->cx, undo_pushed = 0;
+    long replaced = 0;
+    while (1) {
+        // the next match at or after (y, x)
+        long p = -1;
+        for (int end = y; y < b->nlines; ++y, x = 0) {
+            if (y >= end) {
+                int next = trigram_index_next(b->index, &m.tq, y, &end);
+                if (next != y) x = 0;
+                if ((y = next) >= b->nlines) break;
+            }
+            p = matcher_find(&m, b->lines[y], strlen(b->lines[y]), x);
+            if (p >= 0) break;
+        }
+        if (p < 0) break;
+        x = (int)p;
+        hl.cur_y = y;
+        hl.cur_x = x;
+        hl.cur_len = (int)flen;
+        E->cy = y;
+        E->cx = x + (int)flen;
+        E->goal_cx = E->cx;
+        snprintf(E->minibuf, sizeof(E->minibuf),
+                 "Query replacing %s with %s: (y, n, !, ., q)", from, to);
+        editor_draw(E, NULL);
+
+        int ch = getch();
+        if (ch == ERR || ch == KEY_RESIZE) continue;
+        if (ch == 'n' || ch == KEY_BACKSPACE || ch == 127 || ch == 8) {
+            x += (int)flen;
+            continue;
+        }
+        if (ch != 'y' && ch != ' ' && ch != '!' && ch != '.') break;
+
+        if (!undo_pushed) {
+            editor_push_undo(E);
+            undo_pushed = 1;
+        }
+        if (ch == '!') {
+            replaced += replace_rest(b, &m, y, x, to, tolen, &E->cy, &E->cx);
+            E->goal_cx = E->cx;
+            break;
+        }
+        replace_at(b, y, x, flen, to, tolen);
+        replaced++;
+        x += (int)tolen;
+        E->cx = x;
+        E->goal_cx = x;
+        if (ch == '.') break;
+    }
+
+    E->highlight = NULL;
+    highlight_free(&hl);
+    matcher_free(&m);
+    editor_message(E, "Replaced %ld occurrence%s", replaced, replaced == 1 ? "" : "s");
+}
+
+// ------------------------------------------------------------------
+// keep-lines / flush-lines
+
+// M-x keep-lines / flush-lines: delete the lines of the region (or of
+// the whole buffer) that don't match / that match a regexp. The lines
+// are matched on the worker threads, then the survivors are compacted
+// in one pass; the whole deletion is one undo step.
+static void editor_filter_lines(EditorState *E, int flush) {
+    Buffer *b = E->buf;
+    if (buffer_is_readonly(b)) {
+        editor_message(E, "Buffer is read-only");
+        return;
+    }
+    char re[256] = "";
+    const char *prompt = flush ? "Flush lines containing match for regexp: "
+                               : "Keep lines containing match for regexp: ";
+    if (editor_minibuffer_getline(E, prompt, re, sizeof(re)) != 0 || !re[0]) {
+        editor_message(E, "Canceled");
+        return;
+    }
+    // the region covers the lines it touches, except one it ends at the
+    // start of
+    editor_clamp_cursor(E);
+    int sy, sx, ey, ex, y0 = 0, y1 = b->nlines;
+    if (editor_region_bounds(E, &sy, &sx, &ey, &ex)) {
+        y0 = sy;
+        y1 = ex > 0 || ey == sy ? ey + 1 : ey;
+    }
+    E->mark_active = 0;
+
+    LineMatch lm;
+    const char *err;
+    trigram_index_refresh(b->index);
+    if (line_match_start(&lm, b, y0, y1, re, strlen(re), 1, smart_fold(re, strlen(re), 1),
+                         &err) < 0) {
+        editor_message(E, "Invalid regexp: %s", err);
+        return;
+    }
+    int done, nchunks;
+    timeout(50);
+    while ((done = line_match_progress(&lm, &nchunks)) < nchunks) {
+        editor_message(E, "Matching... %d%% (C-g to stop)", (int)(100L * done / nchunks));
+        editor_draw(E, NULL);
+        if (getch() == CTRL('g')) break;
+    }
+    timeout(-1);
+    if (done < nchunks) {
+        line_match_stop(&lm);
+        editor_message(E, "Quit");
+        return;
     }
+
+    // hit[] becomes the keep flags
+    unsigned char *keep = lm.hit;
+    int n = y1 - y0, kept_before = 0;
+    for (int i = 0; i < n; ++i) keep[i] ^= flush;
+    for (int y = y0; y < E->cy && y < y1; ++y) kept_before += keep[y - y0];
+    int removed = buffer_filter_lines(b, y0, y1, keep, E->cx, E->cy);
+    // the cursor stays on its line, or goes to the next one kept
+    if (E->cy >= y1) {
+        E->cy -= removed;
+    } else if (E->cy >= y0) {
+        if (!keep[E->cy - y0]) E->cx = 0;
+        E->cy = y0 + kept_before;
+    }
+    line_match_stop(&lm);
+    editor_clamp_cursor(E);
+    E->goal_cx = E->cx;
+    editor_message(E, "Deleted %d line%s", removed, removed == 1 ? "" : "s");
 }
 
 // ------------------------------------------------------------------
@@ -624,9 +950,105 @@ void editor_command_mode(EditorState *E) {
     }
 }
 
+// M-x count-matches: count the regexp's matches in the whole buffer on
+// the worker threads, showing progress until done or C-g.
+static void editor_count_matches(EditorState *E) {
+    char re[256] = "";
+    if (editor_minibuffer_getline(E, "Count matches (regexp): ", re, sizeof(re)) != 0 || !re[0]) {
+        editor_message(E, "Canceled");
+        return;
+    }
+    MatchCount count;
+    const char *err;
+    int fold = smart_fold(re, strlen(re), 1);
+    trigram_index_refresh(E->buf->index);
+    if (match_count_start(&count, E->buf, re, strlen(re), 1, fold, &err) < 0) {
+        editor_message(E, "Invalid regexp: %s", err);
+        return;
+    }
+    int complete;
+    long total;
+    timeout(50);
+    for (;;) {
+        total = match_count_total(&count, &complete);
+        if (complete) break;
+        editor_message(E, "Counting... %ld so far (C-g to stop)", total);
+        editor_draw(E, NULL);
+        if (getch() == CTRL('g')) break;
+    }
+    timeout(-1);
+    if (complete) {
+        Matcher m;
+        matcher_init(&m, re, strlen(re), 1, fold, NULL);
+        editor_clamp_cursor(E);
+        long after = total - match_count_before(&count, &m, E->cy, E->cx);
+        matcher_free(&m);
+        editor_message(E, "%ld match%s, %ld after point", total, total == 1 ? "" : "es", after);
+    } else {
+        editor_message(E, "Quit: %ld matches counted so far", total);
+    }
+    match_count_stop(&count);
+}
+
+// M-x index-buffer: build a trigram index so that searches of three or
+// more characters skip the blocks that can't match. A read-only buffer
+// is indexed in the background and searches use the index as it grows;
+// a writable one is indexed before editing resumes, since edits must
+// wait for the build.
+static void editor_index_buffer(EditorState *E) {
+    Buffer *b = E->buf;
+    // the build reads the lines, which a running search still appends to
+    if ((b->is_occur && E->occur.running) || (b->is_grep && E->grep.running)
+        || (buffer_dired_found(b) && buffer_dired_loading(b))) {
+        editor_message(E, "The list is still being filled; try again when it is done");
+        return;
+    }
+    buffer_dired_finish(b, &E->cy);
+    buffer_drop_index(b);
+    b->index = trigram_index_start(b);
+    if (buffer_is_readonly(b)) {
+        editor_message(E, "Indexing in the background");
+        return;
+    }
+    int done, nblocks;
+    timeout(50);
+    while ((done = trigram_index_progress(b->index, &nblocks)) < nblocks) {
+        editor_message(E, "Indexing... %d%% (C-g to stop)", (int)(100L * done / nblocks));
+        editor_draw(E, NULL);
+        if (getch() == CTRL('g')) break;
+    }
+    timeout(-1);
+    if (done < nblocks) {
+        buffer_drop_index(b);
+        editor_message(E, "Quit");
+        return;
+    }
+    editor_message(E, "Indexed %d blocks (%zu KB)", nblocks, trigram_index_size(b->index) >> 10);
+}
+
 void editor_execute_command(EditorState *E, const char *command) {
     if (strcmp(command, "help") == 0) {
         editor_show_help(E);
+    } else if (strcmp(command, "count-matches") == 0) {
+        editor_count_matches(E);
+    } else if (strcmp(command, "index-buffer") == 0) {
+        editor_index_buffer(E);
+    } else if (strcmp(command, "occur") == 0) {
+        editor_occur(E);
+    } else if (strcmp(command, "grep") == 0) {
+        editor_grep(E, NULL);
+    } else if (strcmp(command, "find-dired") == 0) {
+        editor_find_dired(E);
+    } else if (strcmp(command, "auto-revert-mode") == 0) {
+        editor_auto_revert(E);
+    } else if (strcmp(command, "dired-du-mode") == 0) {
+        editor_dired_du(E);
+    } else if (strcmp(command, "dired-preview-mode") == 0) {
+        editor_dired_preview(E);
+    } else if (strcmp(command, "keep-lines") == 0) {
+        editor_filter_lines(E, 0);
+    } else if (strcmp(command, "flush-lines") == 0) {
+        editor_filter_lines(E, 1);
     } else if (command[0] == '\0') {
         E->minibuf[0] = '\0';
     } else {
@@ -694,12 +1116,14 @@ static void editor_reset_view(EditorState *E) {
 void editor_visit_path(EditorState *E, const char *path) {
     char fname[512];
     expand_tilde(path, fname, sizeof(fname));
+    // a listing left is cached; coming back puts the cursor where it was
+    if (E->buf->is_dired) buffer_dired_leave(E->buf, E->cy, E->row_offset);
 
     struct stat st;
     if (stat(fname, &st) == 0 && S_ISDIR(st.st_mode)) {
         if (buffer_load_dir(E->buf, fname) == 0) {
             editor_reset_view(E);
-            E->cy = 2; // first entry
+            E->cy = buffer_dired_view(E->buf, &E->row_offset);
             editor_message(E, "Dired: RET opens, ^ parent, g refresh");
         } else {
             editor_message(E, "Cannot list '%s': %s", fname, strerror(errno));
@@ -726,21 +1150,28 @@ void editor_visit_path(EditorState *E, const char *path) {
     }
 }
 
-// C-x C-d / C-x d: prompt for a directory and open it in dired.
-// The prompt is prefilled with the current file's directory.
-static void editor_dired_prompt(EditorState *E) {
-    char input[256] = "";
+// The directory of the current buffer with a trailing '/': the listed
+// one in dired, else the file's. Empty if the file name has none.
+static void default_directory(EditorState *E, char *out, size_t outcap) {
+    out[0] = '\0';
     if (E->buf->is_dired && E->buf->filename) {
-        snprintf(input, sizeof(input), "%s/", E->buf->filename);
+        snprintf(out, outcap, "%s/", E->buf->filename);
     } else if (E->buf->filename && E->buf->filename[0]) {
         const char *slash = strrchr(E->buf->filename, '/');
         if (slash) {
             int n = (int)(slash - E->buf->filename) + 1;
-            if (n > (int)sizeof(input) - 1) n = (int)sizeof(input) - 1;
-            memcpy(input, E->buf->filename, n);
-            input[n] = '\0';
+            if (n > (int)outcap - 1) n = (int)outcap - 1;
+            memcpy(out, E->buf->filename, n);
+            out[n] = '\0';
         }
     }
+}
+
+// C-x C-d / C-x d: prompt for a directory and open it in dired.
+// The prompt is prefilled with the current file's directory.
+static void editor_dired_prompt(EditorState *E) {
+    char input[256];
+    default_directory(E, input, sizeof(input));
     if (editor_minibuffer_getline_with_completion(E, "Dired (directory): ", input, sizeof(input)) != 0) {
         editor_message(E, "Dired canceled");
         return;
@@ -786,40 +1217,307 @@ static void editor_find_file(EditorState *E) {
     editor_visit_path(E, input);
 }
 
+// ------------------------------------------------------------------
+// dired file operations
+//
+// C copies, R renames and D deletes the marked entries (or the one on
+// the cursor's line), and x deletes the ones flagged for deletion. The
+// operation runs on a background thread, one at a time, and the
+// listings showing what it changes are patched as each entry is done.
+
+static const char *fileop_doing[] = { "Copying", "Renaming", "Deleting" };
+static const char *fileop_done[] = { "Copied", "Renamed", "Deleted" };
+
+// n bytes, for people: "812 B", "3.4 MB".
+static void human_size(long long n, char *out, size_t outcap) {
+    static const char *units[] = { "B", "KB", "MB", "GB", "TB" };
+    double v = (double)n;
+    int u = 0;
+    while (v >= 1024 && u < 4) {
+        v /= 1024;
+        u++;
+    }
+    if (u == 0) snprintf(out, outcap, "%lld B", n);
+    else snprintf(out, outcap, "%.1f %s", v, units[u]);
+}
+
+// The absolute path of the listing's entry `name`.
+static char *dired_entry_path(Buffer *b, const char *name) {
+    const char *dir = strcmp(b->filename, "/") == 0 ? "" : b->filename;
+    size_t len = strlen(dir) + strlen(name) + 2;
+    char *path = xmalloc(len);
+    snprintf(path, len, "%s/%s", dir, name);
+    return path;
+}
+
+static void free_paths(char **paths, int n) {
+    for (int i = 0; i < n; ++i) free(paths[i]);
+    free(paths);
+}
+
+// Patch the entries of the listing b that `paths` changed: the entry of
+// a path or, in a directory's listing, of the subdirectory it is under.
+static void editor_dired_touch(Buffer *b, int *cy, char **paths, int n) {
+    if (!b->is_dired || !b->filename) return;
+    size_t len = strcmp(b->filename, "/") == 0 ? 0 : strlen(b->filename);
+    int found = buffer_dired_found(b);
+    char **names = xmalloc((n + 1) * sizeof(char*));
+    int m = 0;
+    for (int i = 0; i < n; ++i) {
+        if (strncmp(paths[i], b->filename, len) != 0 || paths[i][len] != '/') continue;
+        const char *rel = paths[i] + len + 1;
+        size_t rlen = found ? strlen(rel) : strcspn(rel, "/");
+        if (rlen == 0) continue;
+        names[m] = xmalloc(rlen + 1);
+        memcpy(names[m], rel, rlen);
+        names[m][rlen] = '\0';
+        m++;
+    }
+    buffer_dired_update(b, (const char *const *)names, m, cy);
+    free_paths(names, m);
+}
+
+// Patch the listings for the entries done since the last call, and say
+// how far the operation got, or how it ended.
+static void editor_fileop_poll(EditorState *E) {
+    FileOp *op = &E->fileop;
+    if (!op->running) return;
+    int nfinished;
+    long long copied, total;
+    fileop_progress(op, &nfinished, &copied, &total);
+    if (nfinished > op->ntaken) {
+        char **paths = xmalloc(2 * (nfinished - op->ntaken) * sizeof(char*));
+        int m = 0;
+        for (int k = op->ntaken; k < nfinished; ++k) {
+            if (op->kind != FILEOP_COPY) paths[m++] = op->srcs[k];
+            if (op->dsts) paths[m++] = op->dsts[k];
+        }
+        editor_dired_touch(E->buf, &E->cy, paths, m);
+        // a running occur scan reads the other buffer's lines
+        if (E->alt && !E->occur.running) editor_dired_touch(E->alt, &E->alt_cy, paths, m);
+        free(paths);
+        op->ntaken = nfinished;
+    }
+    if (nfinished < op->n && !op->stopped) {
+        if (op->kind == FILEOP_COPY && total > 0) {
+            char done[32], all[32];
+            human_size(copied, done, sizeof(done));
+            human_size(total, all, sizeof(all));
+            int pct = copied >= total ? 100 : (int)(copied * 100 / total);
+            editor_message(E, "Copying %d of %d: %s of %s (%d%%)", nfinished + 1, op->n, done, all, pct);
+        } else {
+            editor_message(E, "%s %d of %d", fileop_doing[op->kind], nfinished + 1, op->n);
+        }
+        return;
+    }
+    int failed = 0, first = -1;
+    for (int k = 0; k < nfinished; ++k) {
+        if (!op->errs[k]) continue;
+        failed++;
+        // the one stopped in the middle is told of as stopped
+        if (first < 0 && op->errs[k] != ECANCELED) first = k;
+    }
+    int ok = nfinished - failed;
+    char what[128];
+    if (ok == op->n) {
+        snprintf(what, sizeof(what), "%s %d file%s", fileop_done[op->kind], ok, ok == 1 ? "" : "s");
+    } else {
+        snprintf(what, sizeof(what), "%s %d of %d files", fileop_done[op->kind], ok, op->n);
+    }
+    if (first >= 0) {
+        editor_message(E, "%s; %s: %s", what, op->failed[first], strerror(op->errs[first]));
+    } else if (ok < op->n) {
+        editor_message(E, "%s; stopped", what);
+    } else {
+        editor_message(E, "%s", what);
+    }
+    fileop_free(op);
+}
+
+static void editor_fileop_stop(EditorState *E) {
+    fileop_stop(&E->fileop);
+    editor_fileop_poll(E);
+}
+
+// Whether a file operation can start on the current listing.
+static int editor_fileop_ready(EditorState *E) {
+    if (E->fileop.running) {
+        editor_message(E, "%s is still going; C-g in dired stops it",
+                       fileop_doing[E->fileop.kind]);
+        return 0;
+    }
+    if (buffer_dired_found(E->buf) && buffer_dired_loading(E->buf)) {
+        editor_message(E, "The list is still being filled");
+        return 0;
+    }
+    return 1;
+}
+
+// The paths of the entries marked `mark`; if there are none, with '*',
+// of the one on the cursor's line. NULL if there are none.
+static char **editor_dired_targets(EditorState *E, int mark, int *n) {
+    char **names = buffer_dired_marked(E->buf, mark, n);
+    if (!names && mark == '*') {
+        const char *name = buffer_dired_name(E->buf, E->cy);
+        if (!name || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return NULL;
+        names = xmalloc(sizeof(char*));
+        names[0] = xstrdup(name);
+        *n = 1;
+    }
+    if (!names) return NULL;
+    for (int k = 0; k < *n; ++k) {
+        char *path = dired_entry_path(E->buf, names[k]);
+        free(names[k]);
+        names[k] = path;
+    }
+    return names;
+}
+
+// C and R: copy or rename the marked entries into a directory, or one
+// entry to a new name. Like Emacs's dired-dwim-target, the prompt offers
+// the other buffer's directory if it is a listing.
+static void editor_dired_copy(EditorState *E, int kind) {
+    if (!editor_fileop_ready(E)) return;
+    int n;
+    char **srcs = editor_dired_targets(E, '*', &n);
+    if (!srcs) {
+        editor_message(E, "No file on this line");
+        return;
+    }
+    const char *verb = kind == FILEOP_COPY ? "Copy" : "Rename";
+    char prompt[512];
+    if (n == 1) snprintf(prompt, sizeof(prompt), "%s %s to: ", verb, strrchr(srcs[0], '/') + 1);
+    else snprintf(prompt, sizeof(prompt), "%s %d files to: ", verb, n);
+    Buffer *other = E->alt && E->alt->is_dired && !buffer_dired_found(E->alt) ? E->alt : E->buf;
+    char input[1024];
+    snprintf(input, sizeof(input), "%s/", strcmp(other->filename, "/") == 0 ? "" : other->filename);
+    if (editor_minibuffer_getline_with_completion(E, prompt, input, sizeof(input)) != 0 || !input[0]) {
+        free_paths(srcs, n);
+        editor_message(E, "Canceled");
+        return;
+    }
+    char to[1024];
+    expand_tilde(input, to, sizeof(to));
+    char **dsts = fileop_targets(srcs, n, to, E->buf->filename);
+    if (!dsts) {
+        free_paths(srcs, n);
+        editor_message(E, "Not a directory: %s", to);
+        return;
+    }
+    buffer_dired_unmark_all(E->buf, '*');
+    fileop_start(&E->fileop, kind, srcs, dsts, n);
+    editor_fileop_poll(E);
+}
+
+// D and x: delete the marked entries (or the one on the cursor's line),
+// or with mark 'D' the flagged ones, once the user says so.
+static void editor_dired_delete(EditorState *E, int mark) {
+    if (!editor_fileop_ready(E)) return;
+    int n;
+    char **srcs = editor_dired_targets(E, mark, &n);
+    if (!srcs) {
+        editor_message(E, mark == 'D' ? "No files flagged for deletion" : "No file on this line");
+        return;
+    }
+    char prompt[512];
+    if (n == 1) snprintf(prompt, sizeof(prompt), "Delete %s? (y/N) ", strrchr(srcs[0], '/') + 1);
+    else snprintf(prompt, sizeof(prompt), "Delete %d files? (y/N) ", n);
+    char ans[10] = "";
+    if (editor_minibuffer_getline(E, prompt, ans, sizeof(ans)) != 0
+        || (ans[0] != 'y' && ans[0] != 'Y')) {
+        free_paths(srcs, n);
+        editor_message(E, "Canceled");
+        return;
+    }
+    buffer_dired_unmark_all(E->buf, mark);
+    fileop_start(&E->fileop, FILEOP_DELETE, srcs, NULL, n);
+    editor_fileop_poll(E);
+}
+
 // ------------------------------------------------------------------
 // dired
 
-// Entry name on the cursor line of a dired buffer, or NULL.
-// Lines look like: "-rw-r--r-- 1 user staff 1234 Jul 29 15:12 name"
-// so the name is everything after the first 8 fields. For symlinks
-// the " -> target" suffix is stripped.
-static const char *dired_entry_at_cursor(EditorState *E) {
-    static char name[512];
-    if (E->cy < 2 || E->cy >= E->buf->nlines) return NULL;
-    const char *line = E->buf->lines[E->cy];
-    if (!*line) return NULL;
+static const char *dired_sort_names[] = { "name", "time", "size" };
 
-    const char *p = line;
-    for (int field = 0; field < 8; ++field) {
-        while (*p == ' ') p++;
-        if (!*p) return NULL;
-        while (*p && *p != ' ') p++;
+// dired-preview-mode: show the first lines of the entry on the cursor's
+// line. They come from the cache, or only as much of the file as fills
+// the preview area is read.
+static void editor_preview_follow(EditorState *E) {
+    int rows = editor_preview_rows(E) - 1; // under the title
+    const char *name = rows > 0 ? buffer_dired_name(E->buf, E->cy) : NULL;
+    if (!name || !buffer_dired_ready(E->buf, E->cy)) {
+        E->preview_shown = NULL;
+        return;
+    }
+    char *path = dired_entry_path(E->buf, name);
+    E->preview_shown = preview_get(&E->previews, path, rows);
+    free(path);
+}
+
+// '/': narrow the listing to the entries matching what is typed, as it
+// is typed. Enter keeps the filter, C-g puts the one before back, and C-t
+// switches between substring and fuzzy matching.
+static void editor_dired_narrow(EditorState *E) {
+    int orig_fuzzy;
+    const char *was = buffer_dired_filter(E->buf, &orig_fuzzy);
+    char *orig = was ? xstrdup(was) : NULL;
+    int orig_cy = E->cy, orig_ro = E->row_offset;
+    char query[256];
+    snprintf(query, sizeof(query), "%s", orig ? orig : "");
+    int qlen = (int)strlen(query);
+    int fuzzy = orig ? orig_fuzzy : 0;
+    int shown = buffer_dired_narrow(E->buf, query, fuzzy, &E->cy);
+    if (shown < 0) {
+        free(orig);
+        editor_message(E, "The list is still being filled");
+        return;
     }
-    while (*p == ' ') p++;
-    if (!*p) return NULL;
+    int total = buffer_dired_count(E->buf);
 
-    snprintf(name, sizeof(name), "%s", p);
-    if (line[0] == 'l') {
-        char *arrow = strstr(name, " -> ");
-        if (arrow) *arrow = '\0';
+    while (1) {
+        snprintf(E->minibuf, sizeof(E->minibuf), "Narrow%s: %s  (%d of %d)",
+                 fuzzy ? " (fuzzy)" : "", query, shown, total);
+        editor_preview_follow(E);
+        editor_draw(E, NULL);
+        int ch = getch();
+        if (ch == ERR || ch == KEY_RESIZE) continue;
+
+        if (ch == CTRL('g')) {
+            buffer_dired_narrow(E->buf, orig, orig_fuzzy, &E->cy);
+            E->cy = orig_cy;
+            E->row_offset = orig_ro;
+            editor_message(E, "Quit");
+            break;
+        } else if (ch == '\n' || ch == '\r' || ch == 27) {
+            if (qlen > 0) editor_message(E, "Narrowed to %d of %d entries (/ C-u RET shows all)", shown, total);
+            else E->minibuf[0] = '\0';
+            break;
+        } else if (ch == KEY_BACKSPACE || ch == 127 || ch == 8) {
+            if (qlen == 0) continue;
+            query[--qlen] = '\0';
+        } else if (ch == CTRL('u')) {
+            query[qlen = 0] = '\0';
+        } else if (ch == CTRL('t')) {
+            fuzzy = !fuzzy;
+        } else if (isprint(ch) && ch < 256 && qlen + 1 < (int)sizeof(query)) {
+            query[qlen++] = (char)ch;
+            query[qlen] = '\0';
+        } else {
+            continue;
+        }
+        shown = buffer_dired_narrow(E->buf, query, fuzzy, &E->cy);
     }
-    return name;
+    free(orig);
 }
 
 // Handle a key in a dired buffer. Returns 1 if the key was consumed.
 static int editor_dired_key(EditorState *E, int c) {
     if (c == '\n' || c == '\r' || c == 'f' || c == 'e') {
-        const char *entry = dired_entry_at_cursor(E);
+        if (!buffer_dired_ready(E->buf, E->cy)) {
+            editor_message(E, "This entry is still being read");
+            return 1;
+        }
+        const char *entry = buffer_dired_name(E->buf, E->cy);
         if (!entry) {
             editor_message(E, "No file on this line");
             return 1;
@@ -834,14 +1532,10 @@ static int editor_dired_key(EditorState *E, int c) {
         editor_visit_path(E, path);
         return 1;
     } else if (c == 'g') {
-        char dir[1024];
-        snprintf(dir, sizeof(dir), "%s", E->buf->filename);
-        int cy = E->cy;
-        if (buffer_load_dir(E->buf, dir) == 0) {
-            editor_reset_view(E);
-            E->cy = cy < E->buf->nlines ? cy : E->buf->nlines - 1;
-            if (E->cy < 2) E->cy = 2;
+        if (buffer_dired_refresh(E->buf, &E->cy) == 0) {
             editor_message(E, "Refreshed");
+        } else {
+            editor_message(E, "Cannot list '%s': %s", E->buf->filename, strerror(errno));
         }
         return 1;
     } else if (c == 'n') {
@@ -850,31 +1544,638 @@ static int editor_dired_key(EditorState *E, int c) {
     } else if (c == 'p') {
         editor_move_cursor_up(E);
         return 1;
+    } else if (c == 's') {
+        // name, then newest first, then largest first
+        buffer_dired_finish(E->buf, &E->cy);
+        int sort = (buffer_dired_sorted_by(E->buf) + 1) % 3;
+        E->cy = buffer_dired_sort(E->buf, sort, E->cy);
+        editor_message(E, "Sorted by %s", dired_sort_names[sort]);
+        return 1;
+    } else if (c == 'G') {
+        char dir[1024];
+        snprintf(dir, sizeof(dir), "%s", E->buf->filename);
+        editor_grep(E, dir);
+        return 1;
+    } else if (c == 'm' || c == 'd' || c == 'u') {
+        // mark, flag for deletion or unmark, and go on to the next line
+        if (buffer_dired_mark(E->buf, E->cy, c == 'm' ? '*' : c == 'd' ? 'D' : 0) < 0
+            && buffer_dired_name(E->buf, E->cy)) {
+            editor_message(E, "Cannot mark . or ..");
+        }
+        editor_move_cursor_down(E);
+        return 1;
+    } else if (c == 'U') {
+        int n = buffer_dired_unmark_all(E->buf, 0);
+        editor_message(E, "Unmarked %d file%s", n, n == 1 ? "" : "s");
+        return 1;
+    } else if (c == 'C' || c == 'R') {
+        editor_dired_copy(E, c == 'C' ? FILEOP_COPY : FILEOP_RENAME);
+        return 1;
+    } else if (c == 'D' || c == 'x') {
+        editor_dired_delete(E, c == 'D' ? '*' : 'D');
+        return 1;
+    } else if (c == CTRL('g') && E->fileop.running) {
+        editor_fileop_stop(E);
+        return 1;
+    } else if (c == '/') {
+        editor_dired_narrow(E);
+        return 1;
+    } else if (c == 'P') {
+        editor_dired_preview(E);
+        return 1;
     } else if (c == 'q') {
-        editor_message(E, "Dired: RET opens, ^ parent, g refresh, C-x C-c quits");
+        editor_message(E, "Dired: RET opens, ^ parent, / narrow, P preview, m/u/d mark, "
+                          "C/R/D copy/rename/delete, s sort, G grep, g refresh");
         return 1;
     }
     return 0;
 }
 
-static void editor_quit(EditorState *E) {
-    if (E->buf->modified) {
-        char ans[10] = "";
-        if (editor_minibuffer_getline(E, "Modified; save before exit? (y/N) ", ans, sizeof(ans)) == 0) {
-            if (ans[0] == 'y' || ans[0] == 'Y') {
-                editor_save(E);
-            }
-        } else {
-            editor_message(E, "Quit canceled");
-            return; // C-g during the prompt cancels quitting
+// Fill in the rows of the listings still being read, current or other,
+// and bring the watched ones up to date.
+static void editor_dired_poll(EditorState *E) {
+    int watching = buffer_dired_watching(E->buf);
+    buffer_dired_poll(E->buf, E->row_offset, E->screen_rows, &E->cy);
+    if (watching && !buffer_dired_watching(E->buf)) {
+        editor_message(E, "The directory is gone; auto-revert is off");
+    }
+    // a running occur scan reads the other buffer's lines
+    if (E->alt && !E->occur.running) {
+        buffer_dired_poll(E->alt, E->alt_row_offset, E->screen_rows, &E->alt_cy);
+    }
+}
+
+void editor_auto_revert(EditorState *E) {
+    if (!E->buf->is_dired) {
+        editor_message(E, "Auto-revert works on dired listings");
+        return;
+    }
+    int on = !buffer_dired_watching(E->buf);
+    if (buffer_dired_watch(E->buf, on) < 0) {
+        editor_message(E, "Cannot watch '%s': %s", E->buf->filename, strerror(errno));
+    } else {
+        editor_message(E, on ? "Auto-revert on" : "Auto-revert off");
+    }
+}
+
+void editor_dired_du(EditorState *E) {
+    if (!E->buf->is_dired) {
+        editor_message(E, "Dired-du works on dired listings");
+        return;
+    }
+    int on = !buffer_dired_du_on(E->buf);
+    if (buffer_dired_du(E->buf, on) < 0) {
+        editor_message(E, "Cannot add up '%s': %s", E->buf->filename, strerror(errno));
+    } else {
+        editor_message(E, on ? "Dired-du on" : "Dired-du off");
+    }
+}
+
+void editor_dired_preview(EditorState *E) {
+    if (!E->buf->is_dired) {
+        editor_message(E, "Dired-preview works on dired listings");
+        return;
+    }
+    E->preview = !E->preview;
+    if (!E->preview) {
+        E->preview_shown = NULL;
+        preview_cache_free(&E->previews);
+    }
+    editor_message(E, E->preview ? "Dired-preview on" : "Dired-preview off");
+}
+
+// Offer to save the current buffer before exiting. Returns -1 if the
+// user canceled.
+static int editor_quit_save(EditorState *E) {
+    if (!E->buf->modified) return 0;
+    char ans[10] = "";
+    if (editor_minibuffer_getline(E, "Modified; save before exit? (y/N) ", ans, sizeof(ans)) == 0) {
+        if (ans[0] == 'y' || ans[0] == 'Y') {
+            editor_save(E);
         }
+    } else {
+        editor_message(E, "Quit canceled");
+        return -1; // C-g during the prompt cancels quitting
+    }
+    return 0;
+}
+
+static void editor_quit(EditorState *E) {
+    if (editor_quit_save(E) < 0) return;
+    if (E->alt && E->alt->modified) {
+        editor_other_buffer(E);
+        if (editor_quit_save(E) < 0) return;
     }
     endwin();
+    occur_stop(&E->occur);
+    grep_stop(&E->grep);
+    find_stop(&E->find);
+    fileop_free(&E->fileop);
+    preview_cache_free(&E->previews);
     buffer_free(E->buf);
-    free(E->kill_buf);
+    buffer_free(E->alt);
+    kill_ring_free(&E->kill_ring);
     exit(0);
 }
 
+// ------------------------------------------------------------------
+// results buffers
+//
+// M-x occur and M-x grep list their matches in a read-only results
+// buffer. It takes the place of the other buffer (C-x b), and the buffer
+// it was started from becomes the other one.
+
+// The scan only runs while its results buffer is current: once the
+// listed buffer is, it may change under the workers.
+static void editor_occur_stop(EditorState *E) {
+    if (!E->occur.running) return;
+    occur_stop(&E->occur);
+    editor_message(E, "Occur stopped; the list is incomplete");
+}
+
+// Grep reads files, not buffers, so it keeps filling its results buffer
+// while another one is current.
+static void editor_grep_stop(EditorState *E) {
+    if (!E->grep.running) return;
+    grep_stop(&E->grep);
+    editor_message(E, "Grep stopped; the list is incomplete");
+}
+
+// The listing M-x find-dired is filling, current or other; NULL if it
+// was replaced.
+static Buffer *find_listing(EditorState *E) {
+    if (buffer_dired_found(E->buf) && buffer_dired_loading(E->buf)) return E->buf;
+    if (E->alt && buffer_dired_found(E->alt) && buffer_dired_loading(E->alt)) return E->alt;
+    return NULL;
+}
+
+// The same goes for find-dired; what it found so far is put in order.
+static void editor_find_stop(EditorState *E) {
+    if (!E->find.running) return;
+    find_stop(&E->find);
+    Buffer *b = find_listing(E);
+    if (b) {
+        int *cy = b == E->buf ? &E->cy : &E->alt_cy;
+        buffer_dired_end(b, *cy > 2 ? cy : NULL);
+    }
+    editor_message(E, "Find stopped; the list is incomplete");
+}
+
+void editor_other_buffer(EditorState *E) {
+    if (!E->alt) {
+        editor_message(E, "No other buffer");
+        return;
+    }
+    editor_occur_stop(E);
+    Buffer *b = E->buf;
+    int cx = E->cx, cy = E->cy, row_offset = E->row_offset;
+    E->buf = E->alt;
+    E->cx = E->goal_cx = E->alt_cx;
+    E->cy = E->alt_cy;
+    E->row_offset = E->alt_row_offset;
+    E->col_offset = 0;
+    E->mark_active = 0;
+    E->alt = b;
+    E->alt_cx = cx;
+    E->alt_cy = cy;
+    E->alt_row_offset = row_offset;
+}
+
+// Whether the other buffer may be replaced: asks if it is modified.
+static int editor_discard_alt_ok(EditorState *E) {
+    if (!E->alt || !E->alt->modified) return 1;
+    char ans[10] = "";
+    return editor_minibuffer_getline(E, "Other buffer modified; discard changes? (y/N) ", ans,
+                                     sizeof(ans)) == 0 && (ans[0] == 'y' || ans[0] == 'Y');
+}
+
+// Show a new results buffer. The current buffer becomes the other one,
+// and the previous other buffer is dropped.
+static void editor_show_results(EditorState *E, Buffer *results) {
+    buffer_free(E->alt);
+    E->alt = E->buf;
+    E->alt_cx = E->cx;
+    E->alt_cy = E->cy;
+    E->alt_row_offset = E->row_offset;
+    E->buf = results;
+    editor_reset_view(E);
+}
+
+// ------------------------------------------------------------------
+// occur
+
+// The query of the last M-x occur, to place the cursor on the match when
+// a result is visited.
+static char occur_query[256];
+static int occur_fold;
+
+static void occur_set_header(Buffer *b, const char *source, int n) {
+    buffer_will_change(b);
+    char header[512];
+    if (n < 0) snprintf(header, sizeof(header), "Lines matching \"%s\" in %s:", occur_query, source);
+    else snprintf(header, sizeof(header), "%d line%s matching \"%s\" in %s:", n, n == 1 ? "" : "s",
+                  occur_query, source);
+    free(b->lines[0]);
+    b->lines[0] = xstrdup(header);
+    buffer_changed(b, 0, 1, 0);
+    b->modified = 0;
+}
+
+void editor_occur(EditorState *E) {
+    char re[256] = "";
+    if (editor_minibuffer_getline(E, "List lines matching (regexp): ", re, sizeof(re)) != 0 || !re[0]) {
+        editor_message(E, "Canceled");
+        return;
+    }
+    // from a results buffer, list the lines of the buffer it came from
+    if (E->buf->is_occur && E->alt) editor_other_buffer(E);
+    if (!editor_discard_alt_ok(E)) {
+        editor_message(E, "Canceled");
+        return;
+    }
+    // the lines of a grep results buffer must stop changing first
+    if (E->buf->is_grep) editor_grep_stop(E);
+    if (buffer_dired_found(E->buf)) editor_find_stop(E);
+    buffer_dired_finish(E->buf, &E->cy);
+    const char *err;
+    int fold = smart_fold(re, strlen(re), 1);
+    trigram_index_refresh(E->buf->index);
+    if (occur_start(&E->occur, E->buf, re, strlen(re), 1, fold, &err) < 0) {
+        editor_message(E, "Invalid regexp: %s", err);
+        return;
+    }
+    snprintf(occur_query, sizeof(occur_query), "%s", re);
+    occur_fold = fold;
+
+    Buffer *results = buffer_new();
+    results->filename = xstrdup("*Occur*");
+    results->readonly = 1;
+    results->is_occur = 1;
+    occur_set_header(results, E->buf->filename ? E->buf->filename : "[NoName]", -1);
+    editor_show_results(E, results);
+    editor_message(E, "Searching... RET visits a line, q goes back, C-g stops");
+}
+
+// Move the lines the scan has found so far into the results buffer.
+static void editor_occur_poll(EditorState *E) {
+    OccurScan *oc = &E->occur;
+    if (!oc->running) return;
+    Buffer *b = E->buf;
+    if (!b->is_occur) {
+        // the results buffer was reused for something else
+        occur_stop(oc);
+        return;
+    }
+    int had = b->nlines;
+    occur_take(oc, b);
+    b->modified = 0;
+    // the cursor moves from the header to the first result when it comes
+    if (had == 1 && b->nlines > 1 && E->cy == 0) E->cy = 1;
+    if (!occur_done(oc)) return;
+    occur_stop(oc);
+    int n = b->nlines - 1;
+    occur_set_header(b, E->alt && E->alt->filename ? E->alt->filename : "[NoName]", n);
+    editor_message(E, "%d matching line%s", n, n == 1 ? "" : "s");
+}
+
+// Go to the line of the result under the cursor, on its first match.
+static void editor_occur_goto(EditorState *E) {
+    editor_clamp_cursor(E);
+    char *end;
+    long n = strtol(E->buf->lines[E->cy], &end, 10);
+    if (*end != ':' || n <= 0 || !E->alt) {
+        editor_message(E, "No match on this line");
+        return;
+    }
+    editor_other_buffer(E);
+    E->cy = n <= E->buf->nlines ? (int)n - 1 : E->buf->nlines - 1;
+    Matcher m;
+    E->cx = 0;
+    if (matcher_init(&m, occur_query, strlen(occur_query), 1, occur_fold, NULL) == 0) {
+        const char *line = E->buf->lines[E->cy];
+        long x = matcher_find(&m, line, strlen(line), 0);
+        if (x > 0) E->cx = (int)x;
+        matcher_free(&m);
+    }
+    E->goal_cx = E->cx;
+    editor_recenter(E);
+}
+
+// ------------------------------------------------------------------
+// grep
+
+// The query and directory of the last M-x grep, to find a result's file
+// and its match when it is visited.
+static char grep_query[256];
+static char grep_dir[512];
+static int grep_fold;
+
+static void grep_set_header(Buffer *b, const GrepScan *gs) {
+    buffer_will_change(b);
+    char header[1024];
+    if (gs) snprintf(header, sizeof(header), "%d match%s in %d file%s for \"%s\" in %s:",
+                     gs->nmatches, gs->nmatches == 1 ? "" : "es", gs->nmatched_files,
+                     gs->nmatched_files == 1 ? "" : "s", grep_query, grep_dir);
+    else snprintf(header, sizeof(header), "Grep for \"%s\" in %s:", grep_query, grep_dir);
+    free(b->lines[0]);
+    b->lines[0] = xstrdup(header);
+    buffer_changed(b, 0, 1, 0);
+    b->modified = 0;
+}
+
+// M-x grep: search the files under a directory for a regexp. `dir` is
+// the directory, or NULL to prompt for one. The search runs in the
+// background, and its results buffer stays usable while it fills.
+void editor_grep(EditorState *E, const char *dir) {
+    char re[256] = "", input[256];
+    if (editor_minibuffer_getline(E, "Grep (regexp): ", re, sizeof(re)) != 0 || !re[0]) {
+        editor_message(E, "Canceled");
+        return;
+    }
+    // from a results buffer, search from the buffer it came from
+    if ((E->buf->is_occur || E->buf->is_grep) && E->alt) editor_other_buffer(E);
+    if (!dir) {
+        default_directory(E, input, sizeof(input));
+        if (editor_minibuffer_getline_with_completion(E, "Grep in directory: ", input,
+                                                      sizeof(input)) != 0) {
+            editor_message(E, "Canceled");
+            return;
+        }
+        dir = input[0] ? input : ".";
+    }
+    char path[512];
+    expand_tilde(dir, path, sizeof(path));
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        editor_message(E, "Not a directory: %s", path);
+        return;
+    }
+    if (!editor_discard_alt_ok(E)) {
+        editor_message(E, "Canceled");
+        return;
+    }
+    grep_stop(&E->grep);
+    const char *err;
+    int fold = smart_fold(re, strlen(re), 1);
+    if (grep_start(&E->grep, path, re, strlen(re), fold, &err) < 0) {
+        editor_message(E, "Invalid regexp: %s", err);
+        return;
+    }
+    snprintf(grep_query, sizeof(grep_query), "%s", re);
+    snprintf(grep_dir, sizeof(grep_dir), "%s", E->grep.root);
+    grep_fold = fold;
+
+    Buffer *results = buffer_new();
+    results->filename = xstrdup("*Grep*");
+    results->readonly = 1;
+    results->is_grep = 1;
+    grep_set_header(results, NULL);
+    editor_show_results(E, results);
+    editor_message(E, "Searching... RET visits a match, q goes back, C-g stops");
+}
+
+// Move the lines found so far into the results buffer, wherever it is,
+// and hand the files the walk has found since to the workers.
+static void editor_grep_poll(EditorState *E) {
+    GrepScan *gs = &E->grep;
+    if (!gs->running) return;
+    Buffer *b = E->buf->is_grep ? E->buf : E->alt && E->alt->is_grep ? E->alt : NULL;
+    if (!b) {
+        // the results buffer was dropped
+        grep_stop(gs);
+        return;
+    }
+    int had = b->nlines;
+    grep_take(gs, b);
+    b->modified = 0;
+    // the cursor moves from the header to the first result when it comes
+    if (b == E->buf && had == 1 && b->nlines > 1 && E->cy == 0) E->cy = 1;
+    if (!grep_done(gs)) return;
+    grep_set_header(b, gs);
+    if (gs->nskipped > 0) {
+        editor_message(E, "Grep finished: %d match%s, %d binary or large file%s skipped",
+                       gs->nmatches, gs->nmatches == 1 ? "" : "es", gs->nskipped,
+                       gs->nskipped == 1 ? "" : "s");
+    } else {
+        editor_message(E, "Grep finished: %d match%s", gs->nmatches, gs->nmatches == 1 ? "" : "es");
+    }
+    grep_stop(gs);
+}
+
+// Visit the file and line of the result under the cursor, on its first
+// match. The file is opened in the other buffer.
+static void editor_grep_goto(EditorState *E) {
+    editor_clamp_cursor(E);
+    // "path:NNN:text"; the path may itself hold colons
+    const char *line = E->buf->lines[E->cy], *p = line;
+    char *end = NULL;
+    long n = 0;
+    while (E->cy > 0 && (p = strchr(p, ':')) != NULL) {
+        n = strtol(p + 1, &end, 10);
+        if (end > p + 1 && *end == ':' && n > 0) break;
+        p++;
+    }
+    if (!p || E->cy == 0 || !E->alt) {
+        editor_message(E, "No match on this line");
+        return;
+    }
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%.*s", grep_dir, (int)(p - line), line);
+    int same = E->alt->filename && strcmp(E->alt->filename, path) == 0 && !E->alt->is_dired;
+    if (!same && !editor_discard_alt_ok(E)) {
+        editor_message(E, "Canceled");
+        return;
+    }
+    editor_other_buffer(E);
+    if (!same) {
+        editor_visit_path(E, path);
+        // a failed visit leaves the buffer as it was, and says why
+        if (!E->buf->filename || strcmp(E->buf->filename, path) != 0 || E->buf->is_dired) return;
+    }
+    E->cy = n <= E->buf->nlines ? (int)n - 1 : E->buf->nlines - 1;
+    E->cx = 0;
+    Matcher m;
+    if (matcher_init(&m, grep_query, strlen(grep_query), 1, grep_fold, NULL) == 0) {
+        const char *text = E->buf->lines[E->cy];
+        long x = matcher_find(&m, text, strlen(text), 0);
+        if (x > 0) E->cx = (int)x;
+        matcher_free(&m);
+    }
+    E->goal_cx = E->cx;
+    editor_recenter(E);
+}
+
+// ------------------------------------------------------------------
+// find-dired
+
+// The directory and arguments of the last M-x find-dired, offered again
+// at the next one.
+static char find_dir[512];
+static char find_args[256];
+
+// Run the find for find_dir and find_args, listing what it finds in
+// `out`.
+static int editor_find_start(EditorState *E, Buffer *out) {
+    editor_find_stop(E);
+    const char *err;
+    if (find_start(&E->find, find_dir, find_args, &err) < 0) {
+        editor_message(E, "Find: %s", err);
+        return -1;
+    }
+    if (buffer_dired_begin(out, find_dir, find_args) < 0) {
+        editor_message(E, "Cannot list '%s': %s", find_dir, strerror(errno));
+        find_stop(&E->find);
+        return -1;
+    }
+    editor_message(E, "Finding... RET visits an entry, q goes back, C-g stops");
+    return 0;
+}
+
+// M-x find-dired: list the entries anywhere under a directory that pass
+// find-style tests (-name, -iname, -type, -size, -mtime) in one dired
+// listing. The walk runs in the background and the listing fills in as
+// it goes.
+void editor_find_dired(EditorState *E) {
+    char input[256], args[256];
+    default_directory(E, input, sizeof(input));
+    if (editor_minibuffer_getline_with_completion(E, "Run find in directory: ", input,
+                                                  sizeof(input)) != 0) {
+        editor_message(E, "Canceled");
+        return;
+    }
+    snprintf(args, sizeof(args), "%s", find_args);
+    if (editor_minibuffer_getline(E, "Run find (with args): ", args, sizeof(args)) != 0) {
+        editor_message(E, "Canceled");
+        return;
+    }
+    // from a results buffer, start from the buffer it came from
+    if ((E->buf->is_occur || E->buf->is_grep || buffer_dired_found(E->buf)) && E->alt) {
+        editor_other_buffer(E);
+    }
+    char path[512];
+    expand_tilde(input[0] ? input : ".", path, sizeof(path));
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        editor_message(E, "Not a directory: %s", path);
+        return;
+    }
+    if (!editor_discard_alt_ok(E)) {
+        editor_message(E, "Canceled");
+        return;
+    }
+    snprintf(find_dir, sizeof(find_dir), "%s", path);
+    snprintf(find_args, sizeof(find_args), "%s", args);
+    Buffer *results = buffer_new();
+    if (editor_find_start(E, results) < 0) {
+        buffer_free(results);
+        return;
+    }
+    editor_show_results(E, results);
+}
+
+// Add the entries found so far to the listing, wherever it is, and put
+// it in order once the walk is over.
+static void editor_find_poll(EditorState *E) {
+    FindScan *fs = &E->find;
+    if (!fs->running) return;
+    Buffer *b = find_listing(E);
+    if (!b) {
+        // the listing was replaced
+        find_stop(fs);
+        return;
+    }
+    int had = b->nlines;
+    find_take(fs, b);
+    // the cursor moves from the header to the first entry when it comes
+    if (b == E->buf && had == 2 && b->nlines > 2 && E->cy == 0) E->cy = 2;
+    if (!find_done(fs)) return;
+    // a cursor moved off the first entry stays with its entry as the
+    // listing is put in order (so in editor_find_stop())
+    int *cy = b == E->buf ? &E->cy : &E->alt_cy;
+    buffer_dired_end(b, *cy > 2 ? cy : NULL);
+    int n = fs->ntaken;
+    if (fs->nerrors > 0) {
+        editor_message(E, "Find finished: %d entr%s, %d director%s could not be read", n,
+                       n == 1 ? "y" : "ies", fs->nerrors, fs->nerrors == 1 ? "y" : "ies");
+    } else {
+        editor_message(E, "Find finished: %d entr%s", n, n == 1 ? "y" : "ies");
+    }
+    find_stop(fs);
+}
+
+// Visit the entry under the cursor in the other buffer, so that the
+// listing stays at hand (C-x b).
+static void editor_find_goto(EditorState *E) {
+    const char *entry = buffer_dired_name(E->buf, E->cy);
+    if (!entry) {
+        editor_message(E, "No file on this line");
+        return;
+    }
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", E->buf->filename, entry);
+    if (E->alt) {
+        if (!editor_discard_alt_ok(E)) {
+            editor_message(E, "Canceled");
+            return;
+        }
+        editor_other_buffer(E);
+    }
+    editor_visit_path(E, path);
+}
+
+// Handle a key that works differently in a find-dired listing than in
+// a directory's. Returns 1 if the key was consumed.
+static int editor_find_key(EditorState *E, int c) {
+    if (c == '\n' || c == '\r' || c == 'f' || c == 'e') {
+        editor_find_goto(E);
+        return 1;
+    } else if (c == 'g') {
+        // run the find again, for the same directory
+        snprintf(find_dir, sizeof(find_dir), "%s", E->buf->filename);
+        if (editor_find_start(E, E->buf) == 0) editor_reset_view(E);
+        return 1;
+    } else if (c == 'q' && E->alt) {
+        editor_other_buffer(E);
+        return 1;
+    } else if (c == CTRL('g') && E->find.running) {
+        editor_find_stop(E);
+        return 1;
+    } else if (c == 's' && buffer_dired_loading(E->buf)) {
+        editor_message(E, "The list is still being filled");
+        return 1;
+    }
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// results buffer keys
+
+// Handle a key in an occur or grep results buffer. Returns 1 if the key
+// was consumed.
+static int editor_results_key(EditorState *E, int c) {
+    if (c == '\n' || c == '\r' || c == 'o') {
+        if (E->buf->is_occur) editor_occur_goto(E);
+        else editor_grep_goto(E);
+        return 1;
+    } else if (c == 'n') {
+        editor_move_cursor_down(E);
+        return 1;
+    } else if (c == 'p') {
+        editor_move_cursor_up(E);
+        return 1;
+    } else if (c == 'q') {
+        editor_other_buffer(E);
+        return 1;
+    } else if (c == CTRL('g') && E->buf->is_occur && E->occur.running) {
+        editor_occur_stop(E);
+        return 1;
+    } else if (c == CTRL('g') && E->buf->is_grep && E->grep.running) {
+        editor_grep_stop(E);
+        return 1;
+    }
+    return 0;
+}
+
 // ------------------------------------------------------------------
 // main key dispatch
 
@@ -887,8 +2188,9 @@ static int getch_after_esc(void) {
     return c;
 }
 
-static void editor_handle_meta(EditorState *E, int c) {
+static LastCmd editor_handle_meta(EditorState *E, int c) {
     switch (c) {
+        case 'y': return editor_yank_pop(E) ? CMD_YANK : CMD_OTHER;
         case 'f': editor_move_cursor_forward_word(E); break;
         case 'b': editor_move_cursor_backward_word(E); break;
         case 'v': editor_scroll_page_up(E); break;
@@ -896,10 +2198,14 @@ static void editor_handle_meta(EditorState *E, int c) {
         case '<': editor_move_to_buffer_start(E); break;
         case '>': editor_move_to_buffer_end(E); break;
         case 'x': editor_command_mode(E); break;
+        case '%': editor_query_replace(E); break;
+        case CTRL('s'): editor_isearch(E, 0, 1); break;
+        case CTRL('r'): editor_isearch(E, 1, 1); break;
         default:
             editor_message(E, "M-%c is undefined", isprint(c) ? c : '?');
             break;
     }
+    return CMD_OTHER;
 }
 
 static void editor_handle_cx_prefix(EditorState *E) {
@@ -913,6 +2219,8 @@ static void editor_handle_cx_prefix(EditorState *E) {
         editor_find_file(E);
     } else if (c2 == CTRL('d') || c2 == 'd') {
         editor_dired_prompt(E);
+    } else if (c2 == 'b') {
+        editor_other_buffer(E);
     } else if (c2 == CTRL('c')) {
         editor_quit(E);
     } else if (c2 == CTRL('x')) {
@@ -932,14 +2240,19 @@ static void editor_handle_cx_prefix(EditorState *E) {
     }
 }
 
-void editor_process_key(EditorState *E) {
-    int c = getch();
-    if (c == ERR) return;
-
+static void editor_handle_key(EditorState *E, int c) {
+    if (buffer_dired_found(E->buf) && editor_find_key(E, c)) {
+        last_cmd = CMD_OTHER;
+        return;
+    }
     if (E->buf->is_dired && editor_dired_key(E, c)) {
         last_cmd = CMD_OTHER;
         return;
     }
+    if ((E->buf->is_occur || E->buf->is_grep) && editor_results_key(E, c)) {
+        last_cmd = CMD_OTHER;
+        return;
+    }
 
     LastCmd this_cmd = CMD_OTHER;
 
@@ -959,7 +2272,7 @@ void editor_process_key(EditorState *E) {
                 E->mark_active = 0;
                 E->minibuf[0] = '\0';
             } else {
-                editor_handle_meta(E, c2);
+                this_cmd = editor_handle_meta(E, c2);
             }
             break;
         }
@@ -991,11 +2304,12 @@ void editor_process_key(EditorState *E) {
             break;
 
         case CTRL('l'): editor_recenter(E); break;
-        case CTRL('s'): editor_isearch(E); break;
+        case CTRL('s'): editor_isearch(E, 0, 0); break;
+        case CTRL('r'): editor_isearch(E, 1, 0); break;
         case CTRL('w'): editor_kill_region(E); break;
         case CTRL('y'):
             if (E->mark_active) delete_active_region(E);
-            editor_yank(E);
+            if (editor_yank(E)) this_cmd = CMD_YANK;
             break;
         case CTRL('k'):
             editor_kill_line(E);
@@ -1044,3 +2358,25 @@ void editor_process_key(EditorState *E) {
 
     last_cmd = this_cmd;
 }
+
+void editor_process_key(EditorState *E) {
+    // while occur or grep fills a results buffer, or a listing is being
+    // read or added up, wake up to show new lines, and once more after
+    // the last poll to show how it ended
+    int busy = E->occur.running || E->grep.running || E->find.running || E->fileop.running
+               || buffer_dired_busy(E->buf)
+               || (E->alt && buffer_dired_busy(E->alt));
+    // a watched listing is brought up to date a few times a second
+    int watching = buffer_dired_watching(E->buf) || (E->alt && buffer_dired_watching(E->alt));
+    editor_occur_poll(E);
+    editor_grep_poll(E);
+    editor_find_poll(E);
+    editor_fileop_poll(E);
+    editor_dired_poll(E);
+    timeout(busy ? 50 : watching ? 250 : -1);
+    int c = getch();
+    timeout(-1);
+    if (c != ERR) editor_handle_key(E, c);
+    // the preview follows the cursor, and the listing as it is filled in
+    editor_preview_follow(E);
+}
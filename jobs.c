@@ -0,0 +1,92 @@
+/*
+ * jobs.c
+ *
+ * Background worker threads for long-running scans.
+ *
+ * Created at:  18. Oct 2026
+ * Author:      Raphaele Salvatore Licciardo
+ *
+ *
+ * Copyright (c) 2025 Raphaele Salvatore Licciardo
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <unistd.h>
+
+#include "includes/jobs.h"
+
+int job_threads(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) return 1;
+    return n > JOB_MAX_THREADS ? JOB_MAX_THREADS : (int)n;
+}
+
+static void *job_worker(void *arg) {
+    JobWorker *w = arg;
+    Job *job = w->job;
+    pthread_mutex_lock(&job->lock);
+    while (!job->cancel && job->next < job->nitems) {
+        int item = job->next++;
+        pthread_mutex_unlock(&job->lock);
+        job->run(job->ctx, w->index, item);
+        pthread_mutex_lock(&job->lock);
+        job->finished++;
+    }
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+void job_start(Job *job, int nitems, int nthreads, void (*run)(void *, int, int), void *ctx) {
+    pthread_mutex_init(&job->lock, NULL);
+    job->nitems = nitems;
+    job->next = job->finished = 0;
+    job->cancel = 0;
+    job->run = run;
+    job->ctx = ctx;
+    if (nthreads > JOB_MAX_THREADS) nthreads = JOB_MAX_THREADS;
+    if (nthreads > nitems) nthreads = nitems;
+    job->nthreads = 0;
+    for (int i = 0; i < nthreads; ++i) {
+        job->workers[i].job = job;
+        job->workers[i].index = i;
+        if (pthread_create(&job->threads[i], NULL, job_worker, &job->workers[i]) != 0) break;
+        job->nthreads++;
+    }
+    if (job->nthreads == 0 && nitems > 0) {
+        job->workers[0].job = job;
+        job->workers[0].index = 0;
+        job_worker(&job->workers[0]);
+    }
+}
+
+int job_done(Job *job) {
+    pthread_mutex_lock(&job->lock);
+    int done = job->finished == job->nitems;
+    pthread_mutex_unlock(&job->lock);
+    return done;
+}
+
+void job_stop(Job *job) {
+    pthread_mutex_lock(&job->lock);
+    job->cancel = 1;
+    pthread_mutex_unlock(&job->lock);
+    for (int i = 0; i < job->nthreads; ++i) pthread_join(job->threads[i], NULL);
+    job->nthreads = 0;
+    pthread_mutex_destroy(&job->lock);
+}
+
+void job_wait(Job *job) {
+    for (int i = 0; i < job->nthreads; ++i) pthread_join(job->threads[i], NULL);
+    job->nthreads = 0;
+    pthread_mutex_destroy(&job->lock);
+}
+
+void job_lock(Job *job) {
+    pthread_mutex_lock(&job->lock);
+}
+
+void job_unlock(Job *job) {
+    pthread_mutex_unlock(&job->lock);
+}
@@ -0,0 +1,192 @@
+/*
+ * killring.c
+ *
+ * Emacs-style kill ring whose text lives in a chunked arena.
+ *
+ * Created at:  18. Oct 2026
+ * Author:      Raphaele Salvatore Licciardo
+ *
+ *
+ * Copyright (c) 2025 Raphaele Salvatore Licciardo
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "includes/killring.h"
+
+#define KILL_CHUNK_SIZE (64 * 1024)
+
+static KillChunk *chunk_new(KillRing *kr, size_t need) {
+    KillChunk *c = xmalloc(sizeof(KillChunk));
+    c->cap = need > KILL_CHUNK_SIZE ? need : KILL_CHUNK_SIZE;
+    c->data = xmalloc(c->cap);
+    c->used = 0;
+    c->refs = 0;
+    c->next = kr->chunks;
+    kr->chunks = c;
+    return c;
+}
+
+// Free a chunk nothing points into, unless it is still the append target.
+static void chunk_retire(KillRing *kr, KillChunk *c) {
+    if (!c || c->refs > 0 || c == kr->chunks) return;
+    for (KillChunk **pp = &kr->chunks; *pp; pp = &(*pp)->next) {
+        if (*pp == c) {
+            *pp = c->next;
+            break;
+        }
+    }
+    free(c->data);
+    free(c);
+}
+
+static void chunk_release(KillRing *kr, KillChunk *c) {
+    if (c && --c->refs == 0) chunk_retire(kr, c);
+}
+
+// Reserve `n` bytes in the append chunk, opening a new chunk if needed.
+static char *arena_alloc(KillRing *kr, size_t n, KillChunk **out) {
+    KillChunk *c = kr->chunks;
+    if (!c || c->cap - c->used < n) {
+        KillChunk *old = c;
+        c = chunk_new(kr, n);
+        chunk_retire(kr, old);
+    }
+    char *p = c->data + c->used;
+    c->used += n;
+    c->refs++;
+    *out = c;
+    return p;
+}
+
+static void entry_clear(KillRing *kr, KillEntry *e) {
+    chunk_release(kr, e->chunk);
+    memset(e, 0, sizeof(*e));
+}
+
+static KillEntry *ring_new_entry(KillRing *kr) {
+    if (kr->count > 0) kr->head = (kr->head + 1) % KILL_RING_MAX;
+    if (kr->count < KILL_RING_MAX) kr->count++;
+    KillEntry *e = &kr->ents[kr->head];
+    entry_clear(kr, e); // evicts the oldest entry once the ring is full
+    kr->yank = 0;
+    return e;
+}
+
+void kill_ring_push(KillRing *kr, const char *text, size_t n) {
+    KillEntry *e = ring_new_entry(kr);
+    char *p = arena_alloc(kr, n, &e->chunk);
+    memcpy(p, text, n);
+    e->text = p;
+    e->len = n;
+}
+
+// Copy a pending region out of its buffer into the arena. A listing's
+// rows not filled in yet (NULL) are copied as empty lines.
+static void entry_materialize(KillRing *kr, KillEntry *e) {
+    Buffer *b = e->src;
+    size_t n = 0;
+    for (int y = e->sy; y <= e->ey; ++y) {
+        const char *ln = b->lines[y] ? b->lines[y] : "";
+        int len = (int)strlen(ln);
+        int from = (y == e->sy) ? e->sx : 0;
+        int to = (y == e->ey) ? e->ex : len;
+        if (to > len) to = len;
+        if (from > to) from = to;
+        n += (size_t)(to - from) + (y != e->ey);
+    }
+    char *p = arena_alloc(kr, n, &e->chunk);
+    e->text = p;
+    e->len = n;
+    for (int y = e->sy; y <= e->ey; ++y) {
+        const char *ln = b->lines[y] ? b->lines[y] : "";
+        int len = (int)strlen(ln);
+        int from = (y == e->sy) ? e->sx : 0;
+        int to = (y == e->ey) ? e->ex : len;
+        if (to > len) to = len;
+        if (from > to) from = to;
+        memcpy(p, ln + from, to - from);
+        p += to - from;
+        if (y != e->ey) *p++ = '\n';
+    }
+    e->src = NULL;
+}
+
+// Grow the most recent kill (consecutive C-k). The entry is extended in
+// place when it ends the append chunk; otherwise it moves to a chunk at
+// least twice its size, so growth stays amortized O(1).
+void kill_ring_append(KillRing *kr, const char *text, size_t n) {
+    if (kr->count == 0) {
+        kill_ring_push(kr, text, n);
+        return;
+    }
+    KillEntry *e = &kr->ents[kr->head];
+    if (e->src) entry_materialize(kr, e);
+    KillChunk *c = kr->chunks;
+    if (e->chunk == c && e->text + e->len == c->data + c->used && c->cap - c->used >= n) {
+        memcpy(c->data + c->used, text, n);
+        c->used += n;
+        e->len += n;
+        return;
+    }
+    size_t need = e->len + n;
+    KillChunk *old = e->chunk;
+    KillChunk *nc = chunk_new(kr, need * 2);
+    memcpy(nc->data, e->text, e->len);
+    memcpy(nc->data + e->len, text, n);
+    nc->used = need;
+    nc->refs = 1;
+    e->chunk = nc;
+    e->text = nc->data;
+    e->len = need;
+    chunk_release(kr, old);
+    if (c != old) chunk_retire(kr, c);
+}
+
+static void detach_hook(void *ctx, Buffer *b) {
+    kill_ring_detach(ctx, b);
+}
+
+// M-w: remember the region instead of copying it. The buffer is marked
+// copied, so buffer_will_change() has the text read out before anything
+// rewrites or frees its lines; otherwise it is read when yanked.
+void kill_ring_push_region(KillRing *kr, Buffer *b, int sy, int sx, int ey, int ex) {
+    KillEntry *e = ring_new_entry(kr);
+    e->src = b;
+    e->sy = sy; e->sx = sx;
+    e->ey = ey; e->ex = ex;
+    b->copied = 1;
+    buffer_set_change_hook(detach_hook, kr);
+}
+
+void kill_ring_detach(KillRing *kr, Buffer *b) {
+    for (int i = 0; i < kr->count; ++i) {
+        KillEntry *e = &kr->ents[i];
+        if (e->src && e->src == b) entry_materialize(kr, e);
+    }
+    b->copied = 0;
+}
+
+// Entry `offset` kills back from the most recent one, or NULL if empty.
+const char *kill_ring_get(KillRing *kr, int offset, size_t *len) {
+    if (kr->count == 0) return NULL;
+    // slots 0..count-1 are in use until the ring is full
+    int slot = ((kr->head - offset) % kr->count + kr->count) % kr->count;
+    KillEntry *e = &kr->ents[slot];
+    if (e->src) entry_materialize(kr, e);
+    *len = e->len;
+    return e->text;
+}
+
+void kill_ring_free(KillRing *kr) {
+    KillChunk *c = kr->chunks;
+    while (c) {
+        KillChunk *next = c->next;
+        free(c->data);
+        free(c);
+        c = next;
+    }
+    memset(kr, 0, sizeof(*kr));
+}
@@ -0,0 +1,165 @@
+/*
+ * preview.c
+ *
+ * The first lines of a file, read with pread(), for dired's preview.
+ *
+ * Created at:  18. Oct 2026
+ * Author:      Raphaele Salvatore Licciardo
+ *
+ *
+ * Copyright (c) 2025 Raphaele Salvatore Licciardo
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "includes/preview.h"
+#include "includes/buffer.h"
+
+static unsigned long last_id;
+
+static void preview_free(Preview *p) {
+    for (int i = 0; i < p->nlines; ++i) free(p->lines[i]);
+    free(p->lines);
+    free(p->path);
+    free(p);
+}
+
+static void preview_add_line(Preview *p, const char *s, size_t len, int *cap) {
+    if (len > 0 && s[len - 1] == '\r') len--;
+    if (len > PREVIEW_COLS) len = PREVIEW_COLS;
+    if (p->nlines == *cap) {
+        *cap = *cap ? *cap * 2 : 32;
+        p->lines = xrealloc(p->lines, *cap * sizeof(char*));
+    }
+    char *line = xmalloc(len + 1);
+    memcpy(line, s, len);
+    line[len] = '\0';
+    p->lines[p->nlines++] = line;
+}
+
+// Read the first `rows` lines of the regular file fd, a page at a time.
+static void preview_read(Preview *p, int fd, int rows) {
+    char *buf = xmalloc(PREVIEW_MAX_BYTES);
+    size_t have = 0, start = 0; // start: where the line being read begins
+    int cap = 0;
+    while (p->nlines < rows && have < PREVIEW_MAX_BYTES) {
+        size_t want = PREVIEW_MAX_BYTES - have < PREVIEW_PAGE ? PREVIEW_MAX_BYTES - have : PREVIEW_PAGE;
+        ssize_t r = pread(fd, buf + have, want, (off_t)have);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) {
+            snprintf(p->note, sizeof(p->note), "Cannot read: %s", strerror(errno));
+            break;
+        }
+        if (r == 0) {
+            if (start < have) preview_add_line(p, buf + start, have - start, &cap);
+            p->complete = 1;
+            break;
+        }
+        if (memchr(buf + have, '\0', (size_t)r)) {
+            snprintf(p->note, sizeof(p->note), "Binary file, %lld bytes", p->size);
+            break;
+        }
+        size_t end = have + (size_t)r;
+        for (size_t i = have; i < end && p->nlines < rows; ++i) {
+            if (buf[i] != '\n') continue;
+            preview_add_line(p, buf + start, i - start, &cap);
+            start = i + 1;
+        }
+        have = end;
+    }
+    if (!p->complete && !p->note[0] && p->nlines < rows) {
+        // a line longer than what is read: its start is all there is
+        if (start < have) preview_add_line(p, buf + start, have - start, &cap);
+        p->complete = 1;
+    }
+    if (p->note[0]) {
+        for (int i = 0; i < p->nlines; ++i) free(p->lines[i]);
+        p->nlines = 0;
+    }
+    free(buf);
+}
+
+// The preview of `path`, which stat() found to be st, or failed to stat
+// with errno err (st NULL). Only a regular file is opened, and only the
+// one stat() saw: its symlinks are resolved first, so that O_NOFOLLOW
+// refuses just a link put in its place since, and the file opened must
+// have the same device and inode.
+static Preview *preview_new(const char *path, int rows, const struct stat *st, int err) {
+    Preview *p = xmalloc(sizeof(Preview));
+    memset(p, 0, sizeof(*p));
+    p->path = xstrdup(path);
+    p->id = ++last_id;
+    if (!st) {
+        snprintf(p->note, sizeof(p->note), "Cannot open: %s", strerror(err));
+        return p;
+    }
+    p->dev = st->st_dev;
+    p->ino = st->st_ino;
+    p->mtime = st->st_mtime;
+    p->size = (long long)st->st_size;
+    if (S_ISDIR(st->st_mode)) {
+        snprintf(p->note, sizeof(p->note), "Directory");
+        return p;
+    }
+    if (!S_ISREG(st->st_mode)) {
+        snprintf(p->note, sizeof(p->note), "Not a regular file");
+        return p;
+    }
+    char real[PATH_MAX];
+    // nor is a fifo put in its place waited on
+    int fd = open(realpath(path, real) ? real : path, O_RDONLY | O_NONBLOCK | O_NOCTTY | O_NOFOLLOW);
+    struct stat fst;
+    if (fd < 0 || fstat(fd, &fst) != 0) {
+        snprintf(p->note, sizeof(p->note), "Cannot open: %s", strerror(errno));
+    } else if (fst.st_dev != st->st_dev || fst.st_ino != st->st_ino) {
+        snprintf(p->note, sizeof(p->note), "Changed while being opened");
+        // not kept: the next look stats and opens it again
+        p->ino = 0;
+    } else {
+        preview_read(p, fd, rows);
+    }
+    if (fd >= 0) close(fd);
+    return p;
+}
+
+const Preview *preview_get(PreviewCache *c, const char *path, int rows) {
+    struct stat st;
+    int ok = stat(path, &st) == 0;
+    int err = ok ? 0 : errno;
+    for (int i = 0; i < c->n; ++i) {
+        Preview *p = c->items[i];
+        if (strcmp(p->path, path) != 0) continue;
+        memmove(c->items + i, c->items + i + 1, (c->n - i - 1) * sizeof(Preview*));
+        c->n--;
+        int same = ok && p->dev == st.st_dev && p->ino == st.st_ino && p->mtime == st.st_mtime
+                   && p->size == (long long)st.st_size;
+        if (same && (p->complete || p->note[0] || p->nlines >= rows)) {
+            memmove(c->items + 1, c->items, c->n * sizeof(Preview*));
+            c->items[0] = p;
+            c->n++;
+            return p;
+        }
+        preview_free(p);
+        break;
+    }
+    if (c->n == PREVIEW_CACHE) preview_free(c->items[--c->n]);
+    memmove(c->items + 1, c->items, c->n * sizeof(Preview*));
+    c->items[0] = preview_new(path, rows, ok ? &st : NULL, err);
+    c->n++;
+    return c->items[0];
+}
+
+void preview_cache_free(PreviewCache *c) {
+    for (int i = 0; i < c->n; ++i) preview_free(c->items[i]);
+    c->n = 0;
+}
@@ -0,0 +1,1153 @@
+/*
+ * regex.c
+ *
+ * Regular expressions compiled to a lazily built DFA.
+ *
+ * Created at:  18. Oct 2026
+ * Author:      Raphaele Salvatore Licciardo
+ *
+ *
+ * Copyright (c) 2025 Raphaele Salvatore Licciardo
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "includes/regex.h"
+#include "includes/search.h"
+
+#define RE_DUP_MAX 255          // largest count allowed in {m,n}
+#define RE_MAX_INST 30000       // program size limit after {m,n} expansion
+#define RE_DFA_MAX_STATES 4096  // the state cache is flushed beyond this
+#define RE_PREFIX_MAX 64
+
+// ------------------------------------------------------------------
+// byte sets
+
+typedef struct {
+    unsigned char bits[32];
+} ByteSet;
+
+static int set_has(const ByteSet *s, unsigned char c) {
+    return s->bits[c >> 3] >> (c & 7) & 1;
+}
+
+static void set_add(ByteSet *s, unsigned char c) {
+    s->bits[c >> 3] |= (unsigned char)(1 << (c & 7));
+}
+
+// Add the other case of every letter in the set.
+static void set_fold(ByteSet *s) {
+    for (int c = 'a'; c <= 'z'; ++c) {
+        unsigned char u = search_fold_upper[c];
+        if (set_has(s, (unsigned char)c) || set_has(s, u)) {
+            set_add(s, (unsigned char)c);
+            set_add(s, u);
+        }
+    }
+}
+
+// The only byte in the set, or -1. With `fold` every set holds both
+// cases of its letters, and such a pair counts as its lower case.
+static int set_single(const ByteSet *s, int fold) {
+    int found = -1;
+    for (int c = 0; c < 256; ++c) {
+        if (!set_has(s, (unsigned char)c)) continue;
+        if (fold && search_fold_lower[c] != c) continue;  // seen as its lower case
+        if (found >= 0) return -1;
+        found = c;
+    }
+    return found;
+}
+
+// ------------------------------------------------------------------
+// parser: pattern -> syntax tree
+
+typedef enum {
+    N_EMPTY, N_SET, N_CAT, N_ALT, N_STAR, N_PLUS, N_QUEST, N_REPEAT, N_BOL, N_EOL
+} NodeKind;
+
+typedef struct {
+    NodeKind kind;
+    int set;        // N_SET: index into the set table
+    int min, max;   // N_REPEAT, max -1 when unbounded
+    int a, b;       // children (node indices)
+} Node;
+
+typedef struct {
+    const char *p, *end;
+    Node *nodes;
+    int nnodes, nodecap;
+    ByteSet *sets;
+    int nsets, setcap;
+    int fold;       // letters match in either case
+    const char *err;
+} Parser;
+
+static int new_node(Parser *ps, NodeKind kind, int a, int b) {
+    if (ps->nnodes == ps->nodecap) {
+        ps->nodecap = ps->nodecap ? ps->nodecap * 2 : 32;
+        ps->nodes = xrealloc(ps->nodes, ps->nodecap * sizeof(Node));
+    }
+    Node *n = &ps->nodes[ps->nnodes];
+    memset(n, 0, sizeof(*n));
+    n->kind = kind;
+    n->a = a;
+    n->b = b;
+    return ps->nnodes++;
+}
+
+static int add_set(Parser *ps, const ByteSet *s) {
+    for (int i = 0; i < ps->nsets; ++i) {
+        if (memcmp(&ps->sets[i], s, sizeof(*s)) == 0) return i;
+    }
+    if (ps->nsets == ps->setcap) {
+        ps->setcap = ps->setcap ? ps->setcap * 2 : 16;
+        ps->sets = xrealloc(ps->sets, ps->setcap * sizeof(ByteSet));
+    }
+    ps->sets[ps->nsets] = *s;
+    return ps->nsets++;
+}
+
+static int set_node(Parser *ps, const ByteSet *s) {
+    ByteSet folded = *s;
+    if (ps->fold) set_fold(&folded);
+    int n = new_node(ps, N_SET, -1, -1);
+    ps->nodes[n].set = add_set(ps, &folded);
+    return n;
+}
+
+static void set_add_class(ByteSet *s, int (*pred)(int), int negate) {
+    for (int c = 0; c < 256; ++c) {
+        if ((pred(c) != 0) != negate) set_add(s, (unsigned char)c);
+    }
+}
+
+static int is_word(int c) {
+    return isalnum(c) || c == '_';
+}
+
+static const struct {
+    const char *name;
+    int (*pred)(int);
+} posix_classes[] = {
+    { "alpha", isalpha }, { "digit", isdigit }, { "alnum", isalnum },
+    { "upper", isupper }, { "lower", islower }, { "space", isspace },
+    { "blank", isblank }, { "punct", ispunct }, { "print", isprint },
+    { "graph", isgraph }, { "cntrl", iscntrl }, { "xdigit", isxdigit },
+};
+
+// Bracket expression; ps->p is just past the '['.
+static int parse_bracket(Parser *ps) {
+    ByteSet s;
+    memset(&s, 0, sizeof(s));
+    int negate = 0;
+    if (ps->p < ps->end && *ps->p == '^') {
+        negate = 1;
+        ps->p++;
+    }
+    int first = 1;
+    for (;;) {
+        if (ps->p >= ps->end) {
+            ps->err = "Unmatched [ or [^";
+            return -1;
+        }
+        unsigned char c = (unsigned char)*ps->p;
+        if (c == ']' && !first) {
+            ps->p++;
+            break;
+        }
+        first = 0;
+        if (c == '[' && ps->p + 1 < ps->end && ps->p[1] == ':') {
+            const char *name = ps->p + 2;
+            const char *close = name;
+            while (close + 1 < ps->end && !(close[0] == ':' && close[1] == ']')) close++;
+            if (close + 1 >= ps->end) {
+                ps->err = "Unmatched [ or [^";
+                return -1;
+            }
+            size_t len = (size_t)(close - name);
+            int found = 0;
+            for (size_t i = 0; i < sizeof(posix_classes) / sizeof(posix_classes[0]); ++i) {
+                if (strlen(posix_classes[i].name) == len && memcmp(posix_classes[i].name, name, len) == 0) {
+                    set_add_class(&s, posix_classes[i].pred, 0);
+                    found = 1;
+                }
+            }
+            if (!found) {
+                ps->err = "Invalid character class name";
+                return -1;
+            }
+            ps->p = close + 2;
+            continue;
+        }
+        ps->p++;
+        if (ps->p + 1 < ps->end && ps->p[0] == '-' && ps->p[1] != ']') {
+            unsigned char hi = (unsigned char)ps->p[1];
+            if (hi < c) {
+                ps->err = "Invalid range end";
+                return -1;
+            }
+            for (int x = c; x <= hi; ++x) set_add(&s, (unsigned char)x);
+            ps->p += 2;
+        } else {
+            set_add(&s, c);
+        }
+    }
+    // fold before negating: [^a] must not match 'A'
+    if (ps->fold) set_fold(&s);
+    if (negate) {
+        for (int i = 0; i < 32; ++i) s.bits[i] = (unsigned char)~s.bits[i];
+    }
+    return set_node(ps, &s);
+}
+
+static int parse_alt(Parser *ps);
+
+static int parse_atom(Parser *ps) {
+    ByteSet s;
+    memset(&s, 0, sizeof(s));
+    unsigned char c = (unsigned char)*ps->p++;
+    switch (c) {
+        case '(': {
+            int n = parse_alt(ps);
+            if (n < 0) return -1;
+            if (ps->p >= ps->end || *ps->p != ')') {
+                ps->err = "Unmatched ( or \\(";
+                return -1;
+            }
+            ps->p++;
+            return n;
+        }
+        case '*': case '+': case '?':
+            ps->err = "Invalid preceding regular expression";
+            return -1;
+        case '[':
+            return parse_bracket(ps);
+        case '.':
+            memset(&s, 0xff, sizeof(s));
+            return set_node(ps, &s);
+        case '^':
+            return new_node(ps, N_BOL, -1, -1);
+        case '$':
+            return new_node(ps, N_EOL, -1, -1);
+        case '\\':
+            if (ps->p >= ps->end) {
+                ps->err = "Trailing backslash";
+                return -1;
+            }
+            c = (unsigned char)*ps->p++;
+            switch (c) {
+                case 'd': case 'D': set_add_class(&s, isdigit, c == 'D'); break;
+                case 'w': case 'W': set_add_class(&s, is_word, c == 'W'); break;
+                case 's': case 'S': set_add_class(&s, isspace, c == 'S'); break;
+                case 't': set_add(&s, '\t'); break;
+                case 'n': set_add(&s, '\n'); break;
+                case 'b': case 'B': case '<': case '>':
+                    ps->err = "Word boundaries are not supported";
+                    return -1;
+                default: set_add(&s, c); break;
+            }
+            return set_node(ps, &s);
+        default:
+            set_add(&s, c);
+            return set_node(ps, &s);
+    }
+}
+
+// "{m}", "{m,}" or "{m,n}" at ps->p. Returns 0 when the text is not an
+// interval at all (the '{' is then an ordinary character), -1 on error.
+static int parse_interval(Parser *ps, int *min, int *max) {
+    const char *q = ps->p + 1;
+    int lo = 0, hi, digits = 0;
+    while (q < ps->end && isdigit((unsigned char)*q)) {
+        lo = lo * 10 + (*q++ - '0');
+        if (lo > RE_DUP_MAX) lo = RE_DUP_MAX + 1;
+        digits++;
+    }
+    if (!digits) return 0;
+    hi = lo;
+    if (q < ps->end && *q == ',') {
+        q++;
+        if (q < ps->end && isdigit((unsigned char)*q)) {
+            hi = 0;
+            while (q < ps->end && isdigit((unsigned char)*q)) {
+                hi = hi * 10 + (*q++ - '0');
+                if (hi > RE_DUP_MAX) hi = RE_DUP_MAX + 1;
+            }
+        } else {
+            hi = -1;
+        }
+    }
+    if (q >= ps->end || *q != '}') return 0;
+    if (lo > RE_DUP_MAX || hi > RE_DUP_MAX) {
+        ps->err = "Regular expression too big";
+        return -1;
+    }
+    if (hi >= 0 && hi < lo) {
+        ps->err = "Invalid content of \\{\\}";
+        return -1;
+    }
+    ps->p = q + 1;
+    *min = lo;
+    *max = hi;
+    return 1;
+}
+
+static int parse_repeat(Parser *ps) {
+    int n;
+    if (*ps->p == '{') {
+        // a brace that does not open an interval is literal
+        ByteSet s;
+        memset(&s, 0, sizeof(s));
+        set_add(&s, '{');
+        ps->p++;
+        n = set_node(ps, &s);
+    } else {
+        n = parse_atom(ps);
+    }
+    while (n >= 0 && ps->p < ps->end) {
+        char c = *ps->p;
+        if (c == '*' || c == '+' || c == '?') {
+            ps->p++;
+            n = new_node(ps, c == '*' ? N_STAR : c == '+' ? N_PLUS : N_QUEST, n, -1);
+        } else if (c == '{') {
+            int min, max;
+            int r = parse_interval(ps, &min, &max);
+            if (r < 0) return -1;
+            if (r == 0) break;
+            n = new_node(ps, N_REPEAT, n, -1);
+            ps->nodes[n].min = min;
+            ps->nodes[n].max = max;
+        } else {
+            break;
+        }
+    }
+    return n;
+}
+
+static int parse_cat(Parser *ps) {
+    int n = -1;
+    while (ps->p < ps->end && *ps->p != '|' && *ps->p != ')') {
+        int r = parse_repeat(ps);
+        if (r < 0) return -1;
+        n = n < 0 ? r : new_node(ps, N_CAT, n, r);
+    }
+    return n < 0 ? new_node(ps, N_EMPTY, -1, -1) : n;
+}
+
+static int parse_alt(Parser *ps) {
+    int n = parse_cat(ps);
+    while (n >= 0 && ps->p < ps->end && *ps->p == '|') {
+        ps->p++;
+        int r = parse_cat(ps);
+        if (r < 0) return -1;
+        n = new_node(ps, N_ALT, n, r);
+    }
+    return n;
+}
+
+// Append the literal text every match of node `n` starts with. Returns
+// 1 if the node matches exactly that text and nothing else.
+static int literal_prefix(const Parser *ps, int n, char *buf, size_t *len) {
+    const Node *nd = &ps->nodes[n];
+    switch (nd->kind) {
+        case N_EMPTY:
+            return 1;
+        case N_SET: {
+            int c = set_single(&ps->sets[nd->set], ps->fold);
+            if (c < 0 || *len >= RE_PREFIX_MAX) return 0;
+            buf[(*len)++] = (char)c;
+            return 1;
+        }
+        case N_CAT:
+            return literal_prefix(ps, nd->a, buf, len) && literal_prefix(ps, nd->b, buf, len);
+        case N_PLUS:
+            literal_prefix(ps, nd->a, buf, len);
+            return 0;
+        case N_REPEAT:
+            if (nd->min > 0) literal_prefix(ps, nd->a, buf, len);
+            return 0;
+        default:
+            return 0;
+    }
+}
+
+// Leftmost node of a chain of concatenations.
+static int first_node(const Parser *ps, int n) {
+    while (ps->nodes[n].kind == N_CAT) n = ps->nodes[n].a;
+    return n;
+}
+
+// ------------------------------------------------------------------
+// programs: syntax tree -> Thompson NFA
+
+enum { RI_SET, RI_SPLIT, RI_BOL, RI_EOL, RI_MATCH };
+
+typedef struct {
+    unsigned char op;
+    int arg;    // RI_SET: set index
+    int x, y;   // successors; RI_SPLIT uses both
+} ReInst;
+
+typedef struct {
+    ReInst *inst;
+    int n, cap;
+    int start;   // anchored entry
+    int ustart;  // entry with a leading .* loop for unanchored search
+    int overflow;
+} ReProg;
+
+static int prog_add(ReProg *pg, int op, int arg, int x, int y) {
+    if (pg->n >= RE_MAX_INST) {
+        pg->overflow = 1;
+        return 0;
+    }
+    if (pg->n == pg->cap) {
+        pg->cap = pg->cap ? pg->cap * 2 : 64;
+        pg->inst = xrealloc(pg->inst, pg->cap * sizeof(ReInst));
+    }
+    ReInst *ip = &pg->inst[pg->n];
+    ip->op = (unsigned char)op;
+    ip->arg = arg;
+    ip->x = x;
+    ip->y = y;
+    return pg->n++;
+}
+
+
+// Emit node `n` so that it continues at `next` once matched, and return
+// its entry. Code is built back to front; the reversed program, used to
+// scan a line from right to left, swaps the halves of every
+// concatenation and the two anchors.
+static int emit(ReProg *pg, const Parser *ps, int n, int next, int reverse) {
+    const Node *nd = &ps->nodes[n];
+    if (pg->overflow) return 0;
+    switch (nd->kind) {
+        case N_EMPTY:
+            return next;
+        case N_SET:
+            return prog_add(pg, RI_SET, nd->set, next, -1);
+        case N_BOL: case N_EOL:
+            return prog_add(pg, (nd->kind == N_BOL) != reverse ? RI_BOL : RI_EOL, 0, next, -1);
+        case N_CAT:
+            if (reverse) return emit(pg, ps, nd->b, emit(pg, ps, nd->a, next, reverse), reverse);
+            return emit(pg, ps, nd->a, emit(pg, ps, nd->b, next, reverse), reverse);
+        case N_ALT: {
+            int x = emit(pg, ps, nd->a, next, reverse);
+            int y = emit(pg, ps, nd->b, next, reverse);
+            return prog_add(pg, RI_SPLIT, 0, x, y);
+        }
+        case N_QUEST:
+            return prog_add(pg, RI_SPLIT, 0, emit(pg, ps, nd->a, next, reverse), next);
+        case N_STAR: case N_PLUS: {
+            int loop = prog_add(pg, RI_SPLIT, 0, -1, next);
+            int body = emit(pg, ps, nd->a, loop, reverse);
+            if (pg->overflow) return 0;
+            pg->inst[loop].x = body;
+            return nd->kind == N_STAR ? loop : body;
+        }
+        case N_REPEAT: {
+            // a{2,4} is a a (a (a)?)?, a{2,} is a a a*
+            int tail = next;
+            if (nd->max < 0) {
+                int loop = prog_add(pg, RI_SPLIT, 0, -1, next);
+                int body = emit(pg, ps, nd->a, loop, reverse);
+                if (pg->overflow) return 0;
+                pg->inst[loop].x = body;
+                tail = loop;
+            } else {
+                for (int i = nd->min; i < nd->max; ++i)
+                    tail = prog_add(pg, RI_SPLIT, 0, emit(pg, ps, nd->a, tail, reverse), next);
+            }
+            for (int i = 0; i < nd->min; ++i) tail = emit(pg, ps, nd->a, tail, reverse);
+            return tail;
+        }
+    }
+    return next;
+}
+
+static int prog_build(ReProg *pg, const Parser *ps, int root, int any, int reverse) {
+    memset(pg, 0, sizeof(*pg));
+    int match = prog_add(pg, RI_MATCH, 0, -1, -1);
+    pg->start = emit(pg, ps, root, match, reverse);
+    // ustart: SPLIT(start, any) where `any` consumes a byte and loops back
+    pg->ustart = prog_add(pg, RI_SPLIT, 0, pg->start, -1);
+    int loop = prog_add(pg, RI_SET, any, pg->ustart, -1);
+    if (pg->overflow) return -1;
+    pg->inst[pg->ustart].y = loop;
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// lazy DFA
+//
+// A DFA state is the set of NFA instructions the scan can be at, after
+// following every empty transition: byte sets, pending $ assertions and
+// MATCH. States are created the first time a transition reaches them
+// and cached in a per-program table indexed by byte class (bytes that
+// no set in the pattern tells apart share a column). When the cache
+// grows past RE_DFA_MAX_STATES it is thrown away and rebuilt on demand,
+// so memory stays bounded while matching stays linear in the input.
+
+#define F_DEAD       1   // empty set: no match can follow
+#define F_ACCEPT     2   // a match ends here
+#define F_ACCEPT_EOL 4   // a match ends here if this is the end of the line
+#define F_BOL        8   // start state built at the start of the line
+
+typedef struct {
+    const ReProg *prog;
+    const ByteSet *sets;
+    const unsigned char *bytemap;
+    int ncls;
+
+    int *trans;            // nstates * ncls successors, see dfa_encode()
+    unsigned char *flags;
+    int *set_off, *set_len;
+    unsigned *hash;
+    int nstates, cap;
+    int *pool;             // instruction lists of all states
+    size_t npool, poolcap;
+    int *htab;             // open addressing over state ids, -1 empty
+    int hcap;
+    int starts[2][2];      // [unanchored][bol] row offsets, -1 until built
+    int flushes;
+
+    // scratch for building states
+    int *stack, *seeds, *list;
+    unsigned *mark;
+    unsigned gen;
+} ReDfa;
+
+struct Regex {
+    Parser ps;
+    unsigned char bytemap[256];
+    int ncls;
+    ReProg fprog, rprog;
+    ReDfa fwd, rev;
+    SearchPattern prefix;  // literal every match starts with (len 0: none)
+    int literal;           // the pattern is just `prefix`
+    int bol;               // every match starts at the beginning of a line
+    unsigned char *starts; // marks of where matches start, see mark_starts()
+    size_t starts_cap;
+    int *seen;             // regex_cover()'s forward state at each position
+    size_t seen_cap;
+};
+
+static void dfa_reset(ReDfa *d) {
+    // state 0 is the dead state and survives flushes
+    d->nstates = 1;
+    d->npool = 0;
+    for (int i = 0; i < d->hcap; ++i) d->htab[i] = -1;
+    memset(d->starts, -1, sizeof(d->starts));
+    d->flushes++;
+}
+
+static void dfa_init(ReDfa *d, const ReProg *pg, const ByteSet *sets,
+                     const unsigned char *bytemap, int ncls) {
+    memset(d, 0, sizeof(*d));
+    d->prog = pg;
+    d->sets = sets;
+    d->bytemap = bytemap;
+    d->ncls = ncls;
+    d->cap = 16;
+    d->trans = xmalloc((size_t)d->cap * ncls * sizeof(int));
+    d->flags = xmalloc(d->cap);
+    d->set_off = xmalloc(d->cap * sizeof(int));
+    d->set_len = xmalloc(d->cap * sizeof(int));
+    d->hash = xmalloc(d->cap * sizeof(unsigned));
+    d->hcap = 64;
+    d->htab = xmalloc(d->hcap * sizeof(int));
+    d->stack = xmalloc((3 * (size_t)pg->n + 2) * sizeof(int));
+    d->seeds = xmalloc(((size_t)pg->n + 1) * sizeof(int));
+    d->list = xmalloc(((size_t)pg->n + 1) * sizeof(int));
+    d->mark = xmalloc(pg->n * sizeof(unsigned));
+    memset(d->mark, 0, pg->n * sizeof(unsigned));
+    for (int c = 0; c < ncls; ++c) d->trans[c] = -2;  // dead stays dead
+    d->flags[0] = F_DEAD;
+    d->set_off[0] = d->set_len[0] = 0;
+    d->hash[0] = 0;
+    dfa_reset(d);
+    d->flushes = 0;
+}
+
+static void dfa_free(ReDfa *d) {
+    free(d->trans);
+    free(d->flags);
+    free(d->set_off);
+    free(d->set_len);
+    free(d->hash);
+    free(d->pool);
+    free(d->htab);
+    free(d->stack);
+    free(d->seeds);
+    free(d->list);
+    free(d->mark);
+}
+
+static void dfa_next_gen(ReDfa *d) {
+    if (++d->gen == 0) {
+        memset(d->mark, 0, d->prog->n * sizeof(unsigned));
+        d->gen = 1;
+    }
+}
+
+static int int_cmp(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Follow empty transitions from the seeds and collect the instructions
+// that make up a state into d->list, sorted. ^ holds only with `bol`.
+static int dfa_closure(ReDfa *d, const int *seeds, int nseeds, int bol) {
+    const ReInst *in = d->prog->inst;
+    int sp = 0, n = 0;
+    dfa_next_gen(d);
+    for (int i = nseeds; i-- > 0;) d->stack[sp++] = seeds[i];
+    while (sp > 0) {
+        int i = d->stack[--sp];
+        if (d->mark[i] == d->gen) continue;
+        d->mark[i] = d->gen;
+        switch (in[i].op) {
+            case RI_SPLIT:
+                d->stack[sp++] = in[i].y;
+                d->stack[sp++] = in[i].x;
+                break;
+            case RI_BOL:
+                if (bol) d->stack[sp++] = in[i].x;
+                break;
+            default:
+                d->list[n++] = i;
+                break;
+        }
+    }
+    qsort(d->list, n, sizeof(int), int_cmp);
+    return n;
+}
+
+// Whether MATCH is reachable from the state's pending $ assertions,
+// i.e. whether the state accepts at the end of the line.
+static int dfa_accepts_at_eol(ReDfa *d, const int *list, int n, int bol) {
+    const ReInst *in = d->prog->inst;
+    int sp = 0;
+    dfa_next_gen(d);
+    for (int k = 0; k < n; ++k) {
+        if (in[list[k]].op == RI_EOL) d->stack[sp++] = in[list[k]].x;
+    }
+    while (sp > 0) {
+        int i = d->stack[--sp];
+        if (d->mark[i] == d->gen) continue;
+        d->mark[i] = d->gen;
+        switch (in[i].op) {
+            case RI_MATCH: return 1;
+            case RI_SPLIT:
+                d->stack[sp++] = in[i].y;
+                d->stack[sp++] = in[i].x;
+                break;
+            case RI_BOL:
+                if (bol) d->stack[sp++] = in[i].x;
+                break;
+            case RI_EOL:
+                d->stack[sp++] = in[i].x;
+                break;
+            default:
+                break;
+        }
+    }
+    return 0;
+}
+
+static unsigned list_hash(const int *list, int n, int bol) {
+    unsigned h = 2166136261u ^ (unsigned)bol;
+    for (int i = 0; i < n; ++i) h = (h ^ (unsigned)list[i]) * 16777619u;
+    return h;
+}
+
+static void dfa_rehash(ReDfa *d) {
+    d->hcap *= 2;
+    d->htab = xrealloc(d->htab, d->hcap * sizeof(int));
+    for (int i = 0; i < d->hcap; ++i) d->htab[i] = -1;
+    for (int s = 1; s < d->nstates; ++s) {
+        unsigned h = d->hash[s] & (d->hcap - 1);
+        while (d->htab[h] >= 0) h = (h + 1) & (d->hcap - 1);
+        d->htab[h] = s;
+    }
+}
+
+// The state for an instruction list, created if it is not cached yet.
+static int dfa_intern(ReDfa *d, const int *list, int n, int bol) {
+    if (n == 0) return 0;
+    unsigned hv = list_hash(list, n, bol);
+    unsigned h = hv & (d->hcap - 1);
+    for (int s; (s = d->htab[h]) >= 0; h = (h + 1) & (d->hcap - 1)) {
+        if (d->hash[s] == hv && d->set_len[s] == n && !(d->flags[s] & F_BOL) == !bol
+            && memcmp(d->pool + d->set_off[s], list, n * sizeof(int)) == 0)
+            return s;
+    }
+    if (d->nstates >= RE_DFA_MAX_STATES) {
+        dfa_reset(d);
+        h = hv & (d->hcap - 1);
+    }
+    if (d->nstates == d->cap) {
+        d->cap *= 2;
+        d->trans = xrealloc(d->trans, (size_t)d->cap * d->ncls * sizeof(int));
+        d->flags = xrealloc(d->flags, d->cap);
+        d->set_off = xrealloc(d->set_off, d->cap * sizeof(int));
+        d->set_len = xrealloc(d->set_len, d->cap * sizeof(int));
+        d->hash = xrealloc(d->hash, d->cap * sizeof(unsigned));
+    }
+    if (d->npool + n > d->poolcap) {
+        d->poolcap = (d->npool + n) * 2;
+        d->pool = xrealloc(d->pool, d->poolcap * sizeof(int));
+    }
+    int s = d->nstates++;
+    memcpy(d->pool + d->npool, list, n * sizeof(int));
+    d->set_off[s] = (int)d->npool;
+    d->set_len[s] = n;
+    d->npool += n;
+    d->hash[s] = hv;
+
+    unsigned char f = bol ? F_BOL : 0;
+    for (int k = 0; k < n; ++k) {
+        if (d->prog->inst[list[k]].op == RI_MATCH) f |= F_ACCEPT;
+    }
+    if (dfa_accepts_at_eol(d, list, n, bol)) f |= F_ACCEPT_EOL;
+    d->flags[s] = f;
+    int *row = d->trans + (size_t)s * d->ncls;
+    for (int c = 0; c < d->ncls; ++c) row[c] = -1;
+
+    d->htab[h] = s;
+    if (d->nstates * 2 > d->hcap) dfa_rehash(d);
+    return s;
+}
+
+// States are referred to by their row offset in the transition table
+// (id * ncls). A table entry is -1 while not computed yet, the target's
+// row offset, or -2 - offset when the target accepts or is dead; the scan
+// loops then test a single value per byte and only look at the flags
+// when it is negative.
+static int dfa_encode(const ReDfa *d, int id) {
+    int off = id * d->ncls;
+    return (d->flags[id] & (F_ACCEPT | F_DEAD)) ? -2 - off : off;
+}
+
+static int dfa_decode(int t) {
+    return t < 0 ? -2 - t : t;
+}
+
+static int dfa_start(ReDfa *d, int unanchored, int bol) {
+    int *st = &d->starts[unanchored][bol];
+    if (*st >= 0) return *st;
+    int seed = unanchored ? d->prog->ustart : d->prog->start;
+    int n = dfa_closure(d, &seed, 1, bol);
+    int off = dfa_intern(d, d->list, n, bol) * d->ncls;
+    d->starts[unanchored][bol] = off;
+    return off;
+}
+
+// Compute and cache the transition of the state at row `s` on byte `c`;
+// returns the encoded table entry.
+static int dfa_step(ReDfa *d, int s, unsigned char c) {
+    const ReInst *in = d->prog->inst;
+    int id = s / d->ncls;
+    const int *set = d->pool + d->set_off[id];
+    int nseeds = 0;
+    for (int k = 0; k < d->set_len[id]; ++k) {
+        const ReInst *ip = &in[set[k]];
+        if (ip->op == RI_SET && set_has(&d->sets[ip->arg], c)) d->seeds[nseeds++] = ip->x;
+    }
+    int n = dfa_closure(d, d->seeds, nseeds, 0);
+    int flushes = d->flushes;
+    int t = dfa_encode(d, dfa_intern(d, d->list, n, 0));
+    // after a flush `s` no longer exists
+    if (d->flushes == flushes) d->trans[s + d->bytemap[c]] = t;
+    return t;
+}
+
+// Forward scan from `i`: end of the earliest match (starting at `i`
+// when anchored, anywhere from `i` on otherwise), or -1. *stop is where
+// the scan ended.
+static long dfa_first_end(ReDfa *d, int unanchored, const unsigned char *h, size_t i, size_t n,
+                          size_t *stop) {
+    const unsigned char *map = d->bytemap;
+    int s = dfa_start(d, unanchored, i == 0);
+    for (;;) {
+        int f = d->flags[s / d->ncls];
+        if (f & (F_ACCEPT | F_DEAD) || i == n) {
+            *stop = i;
+            if (f & F_ACCEPT) return (long)i;
+            if (i == n && (f & F_ACCEPT_EOL)) return (long)n;
+            return -1;
+        }
+        const int *trans = d->trans;
+        int t;
+        while ((t = trans[s + map[h[i]]]) >= 0) {
+            s = t;
+            if (++i == n) break;
+        }
+        if (t < 0) {
+            if (t == -1) t = dfa_step(d, s, h[i]);
+            s = dfa_decode(t);
+            i++;
+        }
+    }
+}
+
+// End of the longest match starting at `i`, or -1.
+static long dfa_longest_end(ReDfa *d, const unsigned char *h, size_t i, size_t n) {
+    const unsigned char *map = d->bytemap;
+    int s = dfa_start(d, 0, i == 0);
+    long last = -1;
+    for (;;) {
+        int f = d->flags[s / d->ncls];
+        if (f & F_DEAD) return last;
+        if (f & F_ACCEPT) last = (long)i;
+        if (i == n) return (f & F_ACCEPT_EOL) ? (long)n : last;
+        const int *trans = d->trans;
+        int t;
+        while ((t = trans[s + map[h[i]]]) >= 0) {
+            s = t;
+            if (++i == n) break;
+        }
+        if (t < 0) {
+            if (t == -1) t = dfa_step(d, s, h[i]);
+            s = dfa_decode(t);
+            i++;
+        }
+    }
+}
+
+// End of the longest match starting at `i`, as dfa_longest_end() finds
+// it, but for regex_cover(): seen[k] holds the state a scan from an
+// earlier start had at k, and where this scan comes to the same state
+// the two go on alike, so the rest of this match lies within the earlier
+// one's. It stops there with the last end found before, and leaves its
+// own states in seen. *flushes is the cache flush count seen was filled
+// under; a flush renumbers the states, and seen starts over.
+static long dfa_cover_end(ReDfa *d, const unsigned char *h, size_t i, size_t n, int *seen,
+                          int *flushes) {
+    int s = dfa_start(d, 0, i == 0);
+    long last = -1;
+    for (;;) {
+        if (d->flushes != *flushes) {
+            for (size_t k = 0; k <= n; ++k) seen[k] = -1;
+            *flushes = d->flushes;
+        }
+        if (seen[i] == s) return last;
+        seen[i] = s;
+        int f = d->flags[s / d->ncls];
+        if (f & F_DEAD) return last;
+        if (f & F_ACCEPT) last = (long)i;
+        if (i == n) return (f & F_ACCEPT_EOL) ? (long)n : last;
+        int t = d->trans[s + d->bytemap[h[i]]];
+        if (t < 0) {
+            if (t == -1) t = dfa_step(d, s, h[i]);
+            t = dfa_decode(t);
+        }
+        s = t;
+        i++;
+    }
+}
+
+enum { REV_LEFTMOST, REV_LAST, REV_STARTS };
+
+// Backward scan with the reversed program from the end of the line: a
+// state accepts at p when some match starts at p. Returns the smallest
+// such p >= lo (REV_LEFTMOST) or the largest p < lo (REV_LAST), or sets
+// starts[p] for every such p < lo (REV_STARTS).
+static long dfa_rev_scan(ReDfa *d, const unsigned char *h, size_t n, size_t lo, int mode,
+                         unsigned char *starts) {
+    const unsigned char *map = d->bytemap;
+    int s = dfa_start(d, 1, 1);
+    size_t p = n, stop = mode == REV_LEFTMOST ? lo : 0;
+    long best = -1;
+    for (;;) {
+        int f = d->flags[s / d->ncls];
+        if ((f & F_ACCEPT) || (p == 0 && (f & F_ACCEPT_EOL))) {
+            if (mode == REV_LEFTMOST) best = (long)p;
+            else if (p < lo && mode == REV_LAST) return (long)p;
+            else if (p < lo) starts[p] = 1;
+        }
+        if (p == stop) return best;
+        const int *trans = d->trans;
+        int t;
+        while ((t = trans[s + map[h[p - 1]]]) >= 0) {
+            s = t;
+            if (--p == stop) break;
+        }
+        if (t < 0) {
+            if (t == -1) t = dfa_step(d, s, h[p - 1]);
+            s = dfa_decode(t);
+            p--;
+        }
+    }
+}
+
+// ------------------------------------------------------------------
+// public interface
+
+Regex *regex_compile(const char *pat, size_t len, int fold, const char **err) {
+    Regex *re = xmalloc(sizeof(Regex));
+    memset(re, 0, sizeof(*re));
+    Parser *ps = &re->ps;
+    ps->fold = fold;
+    ps->p = pat;
+    ps->end = pat + len;
+    int root = parse_alt(ps);
+    if (root >= 0 && ps->p < ps->end) {
+        ps->err = "Unmatched ) or \\)";
+        root = -1;
+    }
+    ByteSet all;
+    memset(&all, 0xff, sizeof(all));
+    int any = add_set(ps, &all);
+    if (root >= 0 && (prog_build(&re->fprog, ps, root, any, 0) < 0
+                      || prog_build(&re->rprog, ps, root, any, 1) < 0)) {
+        ps->err = "Regular expression too big";
+        root = -1;
+    }
+    if (root < 0) {
+        if (err) *err = ps->err;
+        free(re->fprog.inst);
+        free(re->rprog.inst);
+        free(ps->nodes);
+        free(ps->sets);
+        free(re);
+        return NULL;
+    }
+
+    // byte classes: split the byte range by every set in the pattern
+    int ncls = 1;
+    for (int k = 0; k < ps->nsets; ++k) {
+        int remap[2][256];
+        memset(remap, -1, sizeof(remap));
+        int next = 0;
+        for (int c = 0; c < 256; ++c) {
+            int *slot = &remap[set_has(&ps->sets[k], (unsigned char)c)][re->bytemap[c]];
+            if (*slot < 0) *slot = next++;
+            re->bytemap[c] = (unsigned char)*slot;
+        }
+        ncls = next;
+    }
+    re->ncls = ncls;
+    dfa_init(&re->fwd, &re->fprog, ps->sets, re->bytemap, ncls);
+    dfa_init(&re->rev, &re->rprog, ps->sets, re->bytemap, ncls);
+
+    char buf[RE_PREFIX_MAX];
+    size_t plen = 0;
+    int first = first_node(ps, root);
+    re->bol = ps->nodes[first].kind == N_BOL;
+    re->literal = literal_prefix(ps, root, buf, &plen) && plen > 0;
+    search_compile(&re->prefix, buf, plen, fold);
+    // the DFAs only need the byte sets from here on
+    free(ps->nodes);
+    ps->nodes = NULL;
+    return re;
+}
+
+void regex_free(Regex *re) {
+    if (!re) return;
+    dfa_free(&re->fwd);
+    dfa_free(&re->rev);
+    free(re->fprog.inst);
+    free(re->rprog.inst);
+    free(re->ps.sets);
+    search_pattern_free(&re->prefix);
+    free(re->starts);
+    free(re->seen);
+    free(re);
+}
+
+const char *regex_prefix(const Regex *re, size_t *len) {
+    *len = re->prefix.len;
+    return re->prefix.needle;
+}
+
+long regex_match_len(Regex *re, const char *s, size_t n, size_t at) {
+    if (at > n) return -1;
+    if (re->literal) {
+        size_t m = re->prefix.len;
+        return m <= n - at && search_equal(&re->prefix, s + at) ? (long)m : -1;
+    }
+    long end = dfa_longest_end(&re->fwd, (const unsigned char *)s, at, n);
+    return end < 0 ? -1 : end - (long)at;
+}
+
+// Whether a match starts at `p`. *work grows by the bytes scanned.
+static int match_at(Regex *re, const unsigned char *h, size_t p, size_t n, size_t *work) {
+    size_t stop;
+    long end = dfa_first_end(&re->fwd, 0, h, p, n, &stop);
+    *work += stop - p;
+    return end >= 0;
+}
+
+long regex_find(Regex *re, const char *s, size_t n, size_t from) {
+    const unsigned char *h = (const unsigned char *)s;
+    if (from > n) return -1;
+    if (re->bol) {
+        size_t work = 0;
+        return from == 0 && match_at(re, h, 0, n, &work) ? 0 : -1;
+    }
+    if (re->prefix.len > 0) {
+        // Every match starts with the prefix: let the substring kernel
+        // find candidates and check each with an anchored scan. Should
+        // the checks keep rescanning the same text, fall back to the
+        // linear scan below from the current candidate.
+        size_t work = 0;
+        for (;;) {
+            long hit = search_find(&re->prefix, s + from, n - from);
+            if (hit < 0) return -1;
+            from += (size_t)hit;
+            if (re->literal || match_at(re, h, from, n, &work)) return (long)from;
+            if (work > n) break;
+            from++;
+        }
+    }
+    // The forward scan stops at the end of the earliest match; a backward
+    // scan from the end of the line then finds where the leftmost match
+    // starts.
+    size_t stop;
+    if (dfa_first_end(&re->fwd, 1, h, from, n, &stop) < 0) return -1;
+    return dfa_rev_scan(&re->rev, h, n, from, REV_LEFTMOST, NULL);
+}
+
+long regex_find_last(Regex *re, const char *s, size_t n, size_t before) {
+    const unsigned char *h = (const unsigned char *)s;
+    if (before > n + 1) before = n + 1;
+    if (before == 0) return -1;
+    if (re->bol) {
+        size_t work = 0;
+        return match_at(re, h, 0, n, &work) ? 0 : -1;
+    }
+    if (re->prefix.len > 0) {
+        size_t m = re->prefix.len, work = 0;
+        for (;;) {
+            // candidates start before `before`
+            size_t lim = before - 1 + m < n ? before - 1 + m : n;
+            long hit = search_find_last(&re->prefix, s, lim);
+            if (hit < 0) return -1;
+            if (re->literal || match_at(re, h, (size_t)hit, n, &work)) return hit;
+            before = (size_t)hit;
+            if (before == 0) return -1;
+            if (work > n) break;
+        }
+    }
+    return dfa_rev_scan(&re->rev, h, n, before, REV_LAST, NULL);
+}
+
+// Mark in re->starts every p < before where a match starts, with one
+// backward pass over the line.
+static const unsigned char *mark_starts(Regex *re, const unsigned char *h, size_t n,
+                                        size_t before) {
+    if (re->starts_cap < before) {
+        re->starts_cap = before * 2;
+        re->starts = xrealloc(re->starts, re->starts_cap);
+    }
+    memset(re->starts, 0, before);
+    dfa_rev_scan(&re->rev, h, n, before, REV_STARTS, re->starts);
+    return re->starts;
+}
+
+long regex_count(Regex *re, const char *s, size_t n, size_t before) {
+    const unsigned char *h = (const unsigned char *)s;
+    if (before > n + 1) before = n + 1;
+    if (before == 0) return 0;
+    size_t work = 0;
+    if (re->bol) return match_at(re, h, 0, n, &work);
+    size_t from = 0;
+    if (re->prefix.len > 0) {
+        long hit = search_find(&re->prefix, s, n);
+        if (hit < 0 || (size_t)hit >= before) return 0;
+        if (re->literal) {
+            long count = 0;
+            while (hit >= 0 && (size_t)hit < before) {
+                count++;
+                from = (size_t)hit + re->prefix.len;
+                hit = search_find(&re->prefix, s + from, n - from);
+                if (hit >= 0) hit += (long)from;
+            }
+            return count;
+        }
+        from = (size_t)hit;
+    }
+    // most lines have no match at all, which the forward scan settles
+    // without the full backward pass
+    size_t stop;
+    if (dfa_first_end(&re->fwd, 1, h, from, n, &stop) < 0) return 0;
+    // the count takes the first mark, goes on from the end of its longest
+    // match, and so on
+    const unsigned char *starts = mark_starts(re, h, n, before);
+    long count = 0;
+    for (size_t p = from; p < before;) {
+        const unsigned char *mark = memchr(starts + p, 1, before - p);
+        if (!mark) break;
+        p = (size_t)(mark - starts);
+        count++;
+        // an empty match moves on by one byte
+        long end = dfa_longest_end(&re->fwd, h, p, n);
+        p = end > (long)p ? (size_t)end : p + 1;
+    }
+    return count;
+}
+
+// Add [start, end) to the spans, which come by start.
+static void cover_add(int **spans, int *cap, int *nspans, long start, long end) {
+    int k = *nspans;
+    if (k > 0 && start <= (*spans)[2 * k - 1]) {
+        if (end > (*spans)[2 * k - 1]) (*spans)[2 * k - 1] = (int)end;
+        return;
+    }
+    if (k == *cap) {
+        *cap = *cap ? *cap * 2 : 8;
+        *spans = xrealloc(*spans, *cap * 2 * sizeof(int));
+    }
+    (*spans)[2 * k] = (int)start;
+    (*spans)[2 * k + 1] = (int)end;
+    (*nspans)++;
+}
+
+int regex_cover(Regex *re, const char *s, size_t n, int **spans, int *cap) {
+    const unsigned char *h = (const unsigned char *)s;
+    int nspans = 0;
+    if (re->literal) {
+        size_t m = re->prefix.len;
+        for (size_t from = 0; from <= n;) {
+            long hit = search_find(&re->prefix, s + from, n - from);
+            if (hit < 0) break;
+            size_t p = from + (size_t)hit;
+            cover_add(spans, cap, &nspans, (long)p, (long)(p + m));
+            from = p + 1;
+        }
+        return nspans;
+    }
+    if (re->bol) {
+        long end = dfa_longest_end(&re->fwd, h, 0, n);
+        if (end > 0) cover_add(spans, cap, &nspans, 0, end);
+        return nspans;
+    }
+    size_t from = 0;
+    if (re->prefix.len > 0) {
+        long hit = search_find(&re->prefix, s, n);
+        if (hit < 0) return 0;
+        from = (size_t)hit;
+    }
+    size_t stop;
+    if (dfa_first_end(&re->fwd, 1, h, from, n, &stop) < 0) return 0;
+    const unsigned char *starts = mark_starts(re, h, n, n + 1);
+    if (re->seen_cap < n + 1) {
+        re->seen_cap = (n + 1) * 2;
+        re->seen = xrealloc(re->seen, re->seen_cap * sizeof(int));
+    }
+    for (size_t k = 0; k <= n; ++k) re->seen[k] = -1;
+    int flushes = re->fwd.flushes;
+    for (size_t p = from; p <= n; ++p) {
+        const unsigned char *mark = memchr(starts + p, 1, n + 1 - p);
+        if (!mark) break;
+        p = (size_t)(mark - starts);
+        long end = dfa_cover_end(&re->fwd, h, p, n, re->seen, &flushes);
+        if (end > (long)p) cover_add(spans, cap, &nspans, (long)p, end);
+    }
+    return nspans;
+}
@@ -0,0 +1,932 @@
+/*
+ * search.c
+ *
+ * Substring search kernel, matchers and isearch match sets.
+ *
+ * Created at:  18. Oct 2026
+ * Author:      Raphaele Salvatore Licciardo
+ *
+ *
+ * Copyright (c) 2025 Raphaele Salvatore Licciardo
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "includes/search.h"
+
+// The kernels' 16-byte vectors: SSE2 on x86-64, NEON on arm64, and the
+// scalar loops alone elsewhere. v_mask() turns a v_eq() result into a
+// bit mask, bit k for byte k.
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define SEARCH_VEC 1
+typedef __m128i vec16;
+static inline vec16 v_set1(char c) { return _mm_set1_epi8(c); }
+static inline vec16 v_load(const char *s) { return _mm_loadu_si128((const __m128i *)s); }
+static inline vec16 v_or(vec16 a, vec16 b) { return _mm_or_si128(a, b); }
+static inline vec16 v_and(vec16 a, vec16 b) { return _mm_and_si128(a, b); }
+static inline vec16 v_eq(vec16 a, vec16 b) { return _mm_cmpeq_epi8(a, b); }
+static inline unsigned v_mask(vec16 eq) { return (unsigned)_mm_movemask_epi8(eq); }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define SEARCH_VEC 1
+typedef uint8x16_t vec16;
+static inline vec16 v_set1(char c) { return vdupq_n_u8((uint8_t)c); }
+static inline vec16 v_load(const char *s) { return vld1q_u8((const uint8_t *)s); }
+static inline vec16 v_or(vec16 a, vec16 b) { return vorrq_u8(a, b); }
+static inline vec16 v_and(vec16 a, vec16 b) { return vandq_u8(a, b); }
+static inline vec16 v_eq(vec16 a, vec16 b) { return vceqq_u8(a, b); }
+// NEON has no movemask: most vectors have no byte set and leave after
+// one horizontal max; the others weigh each byte by its bit and add up
+// each half.
+static inline unsigned v_mask(vec16 eq) {
+    static const uint8_t bits[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    if (vmaxvq_u8(eq) == 0) return 0;
+    uint8x16_t m = vandq_u8(eq, vld1q_u8(bits));
+    return vaddv_u8(vget_low_u8(m)) | (unsigned)vaddv_u8(vget_high_u8(m)) << 8;
+}
+#endif
+
+#define FOLD_L(c) ((c) >= 'A' && (c) <= 'Z' ? (c) + 32 : (c))
+#define FOLD_U(c) ((c) >= 'a' && (c) <= 'z' ? (c) - 32 : (c))
+#define FOLD_ROW(F, c) F(c), F(c + 1), F(c + 2), F(c + 3), F(c + 4), F(c + 5), F(c + 6), \
+    F(c + 7), F(c + 8), F(c + 9), F(c + 10), F(c + 11), F(c + 12), F(c + 13), F(c + 14), F(c + 15)
+#define FOLD_TABLE(F) \
+    FOLD_ROW(F, 0), FOLD_ROW(F, 16), FOLD_ROW(F, 32), FOLD_ROW(F, 48), \
+    FOLD_ROW(F, 64), FOLD_ROW(F, 80), FOLD_ROW(F, 96), FOLD_ROW(F, 112), \
+    FOLD_ROW(F, 128), FOLD_ROW(F, 144), FOLD_ROW(F, 160), FOLD_ROW(F, 176), \
+    FOLD_ROW(F, 192), FOLD_ROW(F, 208), FOLD_ROW(F, 224), FOLD_ROW(F, 240)
+
+const unsigned char search_fold_lower[256] = { FOLD_TABLE(FOLD_L) };
+const unsigned char search_fold_upper[256] = { FOLD_TABLE(FOLD_U) };
+
+void search_compile(SearchPattern *p, const char *needle, size_t len, int fold) {
+    const unsigned char *nd = (const unsigned char *)needle;
+    p->needle = xmalloc(len + 1);
+    for (size_t i = 0; i < len; ++i) p->needle[i] = (char)(fold ? search_fold_lower[nd[i]] : nd[i]);
+    p->needle[len] = '\0';
+    p->len = len;
+    p->fold = fold;
+    p->or_first = p->or_last = 0;
+    if (fold && len > 0) {
+        unsigned char f = (unsigned char)p->needle[0], l = (unsigned char)p->needle[len - 1];
+        if (search_fold_upper[f] != f) p->or_first = 0x20;
+        if (search_fold_upper[l] != l) p->or_last = 0x20;
+    }
+    // a folded letter shifts the same in either case
+    for (int c = 0; c < 256; ++c) p->skip[c] = p->rskip[c] = len ? len : 1;
+    for (size_t i = 0; i + 1 < len; ++i) {
+        unsigned char c = (unsigned char)p->needle[i];
+        p->skip[c] = len - 1 - i;
+        if (fold) p->skip[search_fold_upper[c]] = len - 1 - i;
+    }
+    for (size_t i = len; i-- > 1;) {
+        unsigned char c = (unsigned char)p->needle[i];
+        p->rskip[c] = i;
+        if (fold) p->rskip[search_fold_upper[c]] = i;
+    }
+}
+
+void search_pattern_free(SearchPattern *p) {
+    free(p->needle);
+    p->needle = NULL;
+    p->len = 0;
+}
+
+// Whether s[0..k) equals needle[off..off + k), through the fold table
+// when the pattern folds.
+static int needle_equal(const SearchPattern *p, const char *s, size_t off, size_t k) {
+    if (!p->fold) return memcmp(s, p->needle + off, k) == 0;
+    const unsigned char *a = (const unsigned char *)s;
+    const unsigned char *b = (const unsigned char *)p->needle + off;
+    for (size_t i = 0; i < k; ++i) {
+        if (search_fold_lower[a[i]] != b[i]) return 0;
+    }
+    return 1;
+}
+
+int search_equal(const SearchPattern *p, const char *s) {
+    // strncmp stops at the NUL; the folded compare stops at the first
+    // mismatch, which the NUL is
+    if (!p->fold) return strncmp(s, p->needle, p->len) == 0;
+    return needle_equal(p, s, 0, p->len);
+}
+
+// memchr for (byte | or) == c. With or == 0 this is plain memchr.
+static const char *memchr_or(const char *s, char c, unsigned char or, size_t n) {
+    if (!or) return memchr(s, c, n);
+    size_t i = 0;
+#ifdef SEARCH_VEC
+    const vec16 vc = v_set1(c);
+    const vec16 vo = v_set1((char)or);
+    for (; i + 16 <= n; i += 16) {
+        unsigned mask = v_mask(v_eq(v_or(v_load(s + i), vo), vc));
+        if (mask) return s + i + __builtin_ctz(mask);
+    }
+#endif
+    for (; i < n; ++i) {
+        if ((char)(s[i] | or) == c) return s + i;
+    }
+    return NULL;
+}
+
+#ifdef SEARCH_VEC
+// Bit k is set if position k of the 16 starting at s passes the
+// first/last byte filter of the short needle search.
+static inline unsigned short_mask(const char *s, size_t m, vec16 vf, vec16 vl, vec16 of,
+                                  vec16 ol, int fold) {
+    vec16 bf = v_load(s);
+    vec16 bl = v_load(s + m - 1);
+    if (fold) {
+        bf = v_or(bf, of);
+        bl = v_or(bl, ol);
+    }
+    return v_mask(v_and(v_eq(bf, vf), v_eq(bl, vl)));
+}
+#endif
+
+// Short needles: candidates are positions where both the first and the
+// last needle byte match; only those are compared in full. With vectors
+// the filter tests 16 positions per vector, two vectors per step. A folding
+// pattern ORs 0x20 into the text bytes tested against a letter; `fold`
+// is a constant at both call sites, so the exact search compiles
+// without that.
+static inline long find_short(const SearchPattern *p, const char *hay, size_t n, int fold) {
+    const char *nd = p->needle;
+    size_t m = p->len;
+    char first = nd[0], last = nd[m - 1];
+    size_t i = 0;
+#ifdef SEARCH_VEC
+    if (n >= m - 1 + 16) {
+        const vec16 vf = v_set1(first);
+        const vec16 vl = v_set1(last);
+        const vec16 of = v_set1((char)p->or_first);
+        const vec16 ol = v_set1((char)p->or_last);
+        size_t end = n - (m - 1) - 16;  // last full window start
+        // two windows per step while both fit
+        for (; i + 16 <= end; i += 32) {
+            unsigned mask = short_mask(hay + i, m, vf, vl, of, ol, fold)
+                            | short_mask(hay + i + 16, m, vf, vl, of, ol, fold) << 16;
+            while (mask) {
+                int bit = __builtin_ctz(mask);
+                if (needle_equal(p, hay + i + bit + 1, 1, m - 2)) return (long)(i + bit);
+                mask &= mask - 1;
+            }
+        }
+        if (i > end) i = end;
+        for (;;) {
+            unsigned mask = short_mask(hay + i, m, vf, vl, of, ol, fold);
+            while (mask) {
+                int bit = __builtin_ctz(mask);
+                if (needle_equal(p, hay + i + bit + 1, 1, m - 2)) return (long)(i + bit);
+                mask &= mask - 1;
+            }
+            if (i == end) return -1;
+            // the final window overlaps the previous one instead of
+            // falling back to a scalar tail
+            i = i + 16 <= end ? i + 16 : end;
+        }
+    }
+#endif
+    while (i + m <= n) {
+        const char *hit = memchr_or(hay + i, first, p->or_first, n - m + 1 - i);
+        if (!hit) return -1;
+        i = (size_t)(hit - hay);
+        if ((char)(hay[i + m - 1] | p->or_last) == last && needle_equal(p, hay + i + 1, 1, m - 2))
+            return (long)i;
+        i++;
+    }
+    return -1;
+}
+
+// Longer needles: Boyer-Moore-Horspool, shifting the window by the
+// precomputed distance of its last byte.
+static long find_horspool(const SearchPattern *p, const char *hay, size_t n) {
+    const unsigned char *h = (const unsigned char *)hay;
+    size_t m = p->len;
+    unsigned char last = (unsigned char)p->needle[m - 1];
+    size_t i = 0;
+    while (i + m <= n) {
+        unsigned char c = h[i + m - 1];
+        if ((c | p->or_last) == last && needle_equal(p, hay + i, 0, m - 1)) return (long)i;
+        i += p->skip[c];
+    }
+    return -1;
+}
+
+long search_find(const SearchPattern *p, const char *hay, size_t n) {
+    size_t m = p->len;
+    if (m == 0) return 0;
+    if (m > n) return -1;
+    if (m == 1) {
+        const char *hit = memchr_or(hay, p->needle[0], p->or_first, n);
+        return hit ? (long)(hit - hay) : -1;
+    }
+    if (m <= SEARCH_SHORT_MAX) return p->fold ? find_short(p, hay, n, 1) : find_short(p, hay, n, 0);
+    return find_horspool(p, hay, n);
+}
+
+// Backward memchr for (byte | or) == c; memrchr is a GNU extension.
+static const char *rmemchr_or(const char *s, char c, unsigned char or, size_t n) {
+#ifdef SEARCH_VEC
+    const vec16 vc = v_set1(c);
+    const vec16 vo = v_set1((char)or);
+    while (n >= 16) {
+        n -= 16;
+        unsigned mask = v_mask(v_eq(v_or(v_load(s + n), vo), vc));
+        if (mask) return s + n + (31 - __builtin_clz(mask));
+    }
+#endif
+    while (n-- > 0) {
+        if ((char)(s[n] | or) == c) return s + n;
+    }
+    return NULL;
+}
+
+// Mirror of find_short: windows are tested from the end of the text
+// towards its start and the highest candidate bit is checked first.
+static inline long rfind_short(const SearchPattern *p, const char *hay, size_t n, int fold) {
+    const char *nd = p->needle;
+    size_t m = p->len;
+    char first = nd[0], last = nd[m - 1];
+#ifdef SEARCH_VEC
+    if (n >= m - 1 + 16) {
+        const vec16 vf = v_set1(first);
+        const vec16 vl = v_set1(last);
+        const vec16 of = v_set1((char)p->or_first);
+        const vec16 ol = v_set1((char)p->or_last);
+        size_t i = n - (m - 1) - 16;
+        for (;;) {
+            // two windows per step while both fit
+            size_t base = i >= 16 ? i - 16 : i;
+            unsigned mask = short_mask(hay + base, m, vf, vl, of, ol, fold);
+            if (base != i) mask |= short_mask(hay + i, m, vf, vl, of, ol, fold) << 16;
+            while (mask) {
+                int bit = 31 - __builtin_clz(mask);
+                if (needle_equal(p, hay + base + bit + 1, 1, m - 2)) return (long)(base + bit);
+                mask &= ~(1u << bit);
+            }
+            if (base == 0) return -1;
+            i = base >= 16 ? base - 16 : 0;
+        }
+    }
+#endif
+    for (size_t i = n - m + 1; i-- > 0;) {
+        if ((char)(hay[i] | p->or_first) == first && (char)(hay[i + m - 1] | p->or_last) == last
+            && needle_equal(p, hay + i + 1, 1, m - 2))
+            return (long)i;
+    }
+    return -1;
+}
+
+// Horspool run backwards: the window's first byte picks the shift.
+static long rfind_horspool(const SearchPattern *p, const char *hay, size_t n) {
+    const unsigned char *h = (const unsigned char *)hay;
+    size_t m = p->len;
+    unsigned char first = (unsigned char)p->needle[0];
+    size_t i = n - m;
+    for (;;) {
+        unsigned char c = h[i];
+        if ((c | p->or_first) == first && needle_equal(p, hay + i + 1, 1, m - 1)) return (long)i;
+        if (i < p->rskip[c]) return -1;
+        i -= p->rskip[c];
+    }
+}
+
+long search_find_last(const SearchPattern *p, const char *hay, size_t n) {
+    size_t m = p->len;
+    if (m == 0) return (long)n;
+    if (m > n) return -1;
+    if (m == 1) {
+        const char *hit = rmemchr_or(hay, p->needle[0], p->or_first, n);
+        return hit ? (long)(hit - hay) : -1;
+    }
+    if (m <= SEARCH_SHORT_MAX) return p->fold ? rfind_short(p, hay, n, 1) : rfind_short(p, hay, n, 0);
+    return rfind_horspool(p, hay, n);
+}
+
+// The first pass runs from the start position to the end of the buffer;
+// the wrapped pass only needs the lines up to and including the start
+// line, since everything after it was already scanned.
+int search_buffer_forward(Buffer *b, const SearchPattern *p, int *y, int *x, int *wrapped) {
+    if (wrapped) *wrapped = 0;
+    int startY = *y, startX = *x;
+    for (int cy = startY; cy < b->nlines; ++cy) {
+        const char *line = b->lines[cy];
+        size_t len = strlen(line);
+        size_t from = (cy == startY) ? (size_t)startX : 0;
+        if (from > len) continue;
+        long hit = search_find(p, line + from, len - from);
+        if (hit >= 0) {
+            *y = cy;
+            *x = (int)(from + hit);
+            return 1;
+        }
+    }
+    if (wrapped) *wrapped = 1;
+    for (int cy = 0; cy <= startY && cy < b->nlines; ++cy) {
+        const char *line = b->lines[cy];
+        long hit = search_find(p, line, strlen(line));
+        if (hit >= 0) {
+            *y = cy;
+            *x = (int)hit;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// ------------------------------------------------------------------
+// matchers
+
+int matcher_init(Matcher *m, const char *q, size_t qlen, int regex, int fold, const char **err) {
+    memset(m, 0, sizeof(*m));
+    if (regex) {
+        m->re = regex_compile(q, qlen, fold, err);
+        if (!m->re) return -1;
+        size_t plen;
+        const char *prefix = regex_prefix(m->re, &plen);
+        trigram_query_init(&m->tq, prefix, plen);
+        return 0;
+    }
+    search_compile(&m->lit, q, qlen, fold);
+    trigram_query_init(&m->tq, q, qlen);
+    return 0;
+}
+
+void matcher_free(Matcher *m) {
+    regex_free(m->re);
+    m->re = NULL;
+    search_pattern_free(&m->lit);
+}
+
+long matcher_find(Matcher *m, const char *line, size_t n, size_t from) {
+    if (m->re) return regex_find(m->re, line, n, from);
+    if (from > n) return -1;
+    long hit = search_find(&m->lit, line + from, n - from);
+    return hit < 0 ? -1 : (long)from + hit;
+}
+
+long matcher_find_last(Matcher *m, const char *line, size_t n, size_t before) {
+    if (m->re) return regex_find_last(m->re, line, n, before);
+    if (before == 0) return -1;
+    // a literal match starting before `before` ends by before - 1 + len
+    if (before - 1 + m->lit.len < n) n = before - 1 + m->lit.len;
+    return search_find_last(&m->lit, line, n);
+}
+
+long matcher_count(Matcher *m, const char *line, size_t n, size_t before) {
+    if (m->re) return regex_count(m->re, line, n, before);
+    long count = 0;
+    size_t step = m->lit.len ? m->lit.len : 1;
+    for (size_t from = 0; from < before && from <= n;) {
+        long hit = search_find(&m->lit, line + from, n - from);
+        if (hit < 0 || from + (size_t)hit >= before) break;
+        count++;
+        from += (size_t)hit + step;
+    }
+    return count;
+}
+
+size_t matcher_match_len(Matcher *m, const char *line, size_t n, size_t at) {
+    if (m->re) {
+        long len = regex_match_len(m->re, line, n, at);
+        return len < 0 ? 0 : (size_t)len;
+    }
+    return m->lit.len;
+}
+
+// ------------------------------------------------------------------
+// isearch match sets
+
+// Positions are ordered by distance from the origin going forward, so
+// positions before the origin sort after everything from the origin to
+// the end of the buffer. A key is (past_end, y, x).
+static int key_cmp(int aw, int ay, int ax, int bw, int by, int bx) {
+    if (aw != bw) return aw - bw;
+    if (ay != by) return ay < by ? -1 : 1;
+    return ax == bx ? 0 : (ax < bx ? -1 : 1);
+}
+
+static int before_origin(const MatchSet *ms, int y, int x) {
+    return y < ms->oy || (y == ms->oy && x < ms->ox);
+}
+
+static int pos_cmp(const MatchSet *ms, SearchPos a, SearchPos b) {
+    return key_cmp(before_origin(ms, a.y, a.x), a.y, a.x, before_origin(ms, b.y, b.x), b.y, b.x);
+}
+
+// Everything before the forward scan point has been scanned.
+static int fwd_cmp(const MatchSet *ms, int w, int y, int x) {
+    return key_cmp(w, y, x, ms->fwrapped, ms->fy, ms->fx);
+}
+
+// Everything from the backward scan point on has been scanned.
+static int back_cmp(const MatchSet *ms, int w, int y, int x) {
+    return key_cmp(w, y, x, !ms->bwrapped, ms->by, ms->bx);
+}
+
+static int match_count(const MatchSet *ms) {
+    return ms->nfwd + ms->nback;
+}
+
+SearchPos *match_set_at(MatchSet *ms, int i) {
+    if (i < ms->nfwd) return &ms->pos[i];
+    return &ms->pos[ms->cap - ms->nback + (i - ms->nfwd)];
+}
+
+static void match_set_grow(MatchSet *ms) {
+    if (match_count(ms) < ms->cap) return;
+    int ncap = ms->cap ? ms->cap * 2 : 64;
+    ms->pos = xrealloc(ms->pos, ncap * sizeof(SearchPos));
+    memmove(&ms->pos[ncap - ms->nback], &ms->pos[ms->cap - ms->nback], ms->nback * sizeof(SearchPos));
+    ms->cap = ncap;
+}
+
+static void push_fwd(MatchSet *ms, int y, int x) {
+    match_set_grow(ms);
+    ms->pos[ms->nfwd].y = y;
+    ms->pos[ms->nfwd].x = x;
+    ms->nfwd++;
+}
+
+static void push_back(MatchSet *ms, int y, int x) {
+    match_set_grow(ms);
+    ms->nback++;
+    ms->pos[ms->cap - ms->nback].y = y;
+    ms->pos[ms->cap - ms->nback].x = x;
+}
+
+void match_set_init(MatchSet *ms, Matcher *m, int oy, int ox) {
+    memset(ms, 0, sizeof(*ms));
+    ms->m = *m;
+    ms->cur = -1;
+    ms->oy = ms->fy = ms->by = oy;
+    ms->ox = ms->fx = ms->bx = ox;
+}
+
+// Every match of the longer query `q` starts at a match of its prefix,
+// so the parent's known matches are filtered in place of a rescan. The
+// scan points are inherited: beyond them nothing is known for either
+// query. A parent that already failed everywhere yields an empty,
+// complete set without touching the buffer.
+void match_set_narrow(MatchSet *ms, const MatchSet *parent, Buffer *b, const char *q, size_t qlen,
+                      int fold) {
+    // a case-sensitive query can narrow a folding parent: its matches
+    // are a subset of the parent's either way
+    Matcher m;
+    matcher_init(&m, q, qlen, 0, fold, NULL);
+    match_set_init(ms, &m, parent->oy, parent->ox);
+    ms->fy = parent->fy; ms->fx = parent->fx; ms->fwrapped = parent->fwrapped;
+    ms->by = parent->by; ms->bx = parent->bx; ms->bwrapped = parent->bwrapped;
+    ms->complete = parent->complete;
+    for (int i = 0; i < parent->nfwd; ++i) {
+        const SearchPos *p = &parent->pos[i];
+        if (search_equal(&ms->m.lit, b->lines[p->y] + p->x)) push_fwd(ms, p->y, p->x);
+    }
+    // backward finds are pushed nearest-to-origin first
+    for (int i = parent->cap - 1; i >= parent->cap - parent->nback; --i) {
+        const SearchPos *p = &parent->pos[i];
+        if (search_equal(&ms->m.lit, b->lines[p->y] + p->x)) push_back(ms, p->y, p->x);
+    }
+}
+
+// Forward scan: find the next match past the forward scan point and
+// append it. The set is complete once the scan reaches the part the
+// backward scan has already covered.
+static int scan_forward(MatchSet *ms, Buffer *b) {
+    while (!ms->complete && back_cmp(ms, ms->fwrapped, ms->fy, ms->fx) < 0) {
+        int last = ms->fwrapped ? ms->oy : b->nlines - 1;
+        if (ms->fwrapped == !ms->bwrapped && ms->by < last) last = ms->by;
+        for (int y = ms->fy, end = y; y <= last && y < b->nlines; ++y) {
+            // skip the blocks the buffer's index rules out
+            if (y >= end && (y = trigram_index_next(b->index, &ms->m.tq, y, &end)) > last) break;
+            const char *line = b->lines[y];
+            size_t len = strlen(line);
+            size_t from = (y == ms->fy) ? (size_t)ms->fx : 0;
+            long hit = matcher_find(&ms->m, line, len, from);
+            if (hit < 0) continue;
+            int x = (int)hit;
+            if ((ms->fwrapped && y == ms->oy && x >= ms->ox)
+                || back_cmp(ms, ms->fwrapped, y, x) >= 0) break;
+            push_fwd(ms, y, x);
+            ms->fy = y;
+            ms->fx = x + 1;
+            return 1;
+        }
+        if (ms->fwrapped) break;
+        ms->fwrapped = 1;
+        ms->fy = ms->fx = 0;
+    }
+    ms->complete = 1;
+    return 0;
+}
+
+// Backward scan: find the last match before the backward scan point with
+// the reverse kernel, moving up to the top of the buffer and then around
+// from its end, until it meets the forward-scanned part.
+static int scan_backward(MatchSet *ms, Buffer *b) {
+    while (!ms->complete && fwd_cmp(ms, !ms->bwrapped, ms->by, ms->bx) >= 0) {
+        int first = ms->bwrapped ? ms->oy : 0;
+        if ((!ms->bwrapped) == ms->fwrapped && ms->fy > first) first = ms->fy;
+        for (int y = ms->by, begin = y + 1; y >= first; --y) {
+            if (y < begin && (y = trigram_index_prev(b->index, &ms->m.tq, y, &begin)) < first) break;
+            const char *line = b->lines[y];
+            size_t len = strlen(line);
+            // on the scan point's line only matches starting before it
+            size_t before = (y == ms->by) ? (size_t)ms->bx : len + 1;
+            long hit = matcher_find_last(&ms->m, line, len, before);
+            if (hit < 0) continue;
+            int x = (int)hit;
+            if ((ms->bwrapped && y == ms->oy && x < ms->ox)
+                || fwd_cmp(ms, !ms->bwrapped, y, x) < 0) break;
+            push_back(ms, y, x);
+            ms->by = y;
+            ms->bx = x;
+            return 1;
+        }
+        if (ms->bwrapped) break;
+        ms->bwrapped = 1;
+        ms->by = b->nlines - 1;
+        ms->bx = (int)strlen(b->lines[ms->by]) + 1;
+    }
+    ms->complete = 1;
+    return 0;
+}
+
+// First logical index whose position is >= from (> from with `upper`).
+static int bound(MatchSet *ms, SearchPos from, int upper) {
+    int lo = 0, hi = match_count(ms);
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int c = pos_cmp(ms, *match_set_at(ms, mid), from);
+        if (c < 0 || (upper && c == 0)) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// The unscanned gap is approached from the side of the origin `from`
+// lies on, so the work done is proportional to its distance from the
+// origin: the forward scan for positions after it, the backward scan
+// for positions before it.
+static void scan_towards(MatchSet *ms, Buffer *b, int fw) {
+    if (fw) scan_backward(ms, b);
+    else scan_forward(ms, b);
+}
+
+int match_set_seek(MatchSet *ms, Buffer *b, SearchPos from, int reverse, int strict,
+                   int *wrapped_around) {
+    int fw = before_origin(ms, from.y, from.x);
+    int at_origin = from.y == ms->oy && from.x == ms->ox;
+    if (!reverse) {
+        for (;;) {
+            int i = bound(ms, from, strict);
+            if (i < ms->nfwd) return ms->cur = i, 1;
+            // the next match may lie in the gap, between `from` and the
+            // backward scan point
+            if (!ms->complete && back_cmp(ms, fw, from.y, from.x) < 0) {
+                scan_towards(ms, b, fw && fwd_cmp(ms, fw, from.y, from.x) >= 0);
+                continue;
+            }
+            if (i < match_count(ms)) return ms->cur = i, 1;
+            break;
+        }
+        // past the last match: go around to the first one after the origin
+        if (ms->nfwd == 0) scan_forward(ms, b);
+        if (match_count(ms) == 0) return ms->cur = -1, 0;
+        *wrapped_around = 1;
+        return ms->cur = 0, 1;
+    }
+    for (;;) {
+        int j = bound(ms, from, !strict) - 1;
+        if (j >= ms->nfwd) return ms->cur = j, 1;
+        // the previous match may lie in the gap, between the forward
+        // scan point and `from`
+        if (!ms->complete && fwd_cmp(ms, fw, from.y, from.x) >= strict) {
+            scan_towards(ms, b, fw);
+            continue;
+        }
+        if (j >= 0) return ms->cur = j, 1;
+        break;
+    }
+    // before the first match: go around to the last one before the origin
+    if (ms->nback == 0) scan_backward(ms, b);
+    if (match_count(ms) == 0) return ms->cur = -1, 0;
+    if (!at_origin) *wrapped_around = 1;
+    return ms->cur = match_count(ms) - 1, 1;
+}
+
+void match_set_free(MatchSet *ms) {
+    matcher_free(&ms->m);
+    free(ms->pos);
+    ms->pos = NULL;
+    ms->nfwd = ms->nback = ms->cap = 0;
+}
+
+// ------------------------------------------------------------------
+// lazy highlighting
+
+void highlight_init(Highlight *h) {
+    memset(h, 0, sizeof(*h));
+}
+
+void highlight_free(Highlight *h) {
+    for (int i = 0; i < h->nrows; ++i) free(h->rows[i].spans);
+    free(h->rows);
+    memset(h, 0, sizeof(*h));
+}
+
+void highlight_set_matcher(Highlight *h, Matcher *m) {
+    h->m = m;
+    for (int i = 0; i < h->nrows; ++i) h->rows[i].y = -1;
+}
+
+static void add_span(HighlightRow *r, int start, int end) {
+    // matches arrive by start column, so only the last span can overlap
+    if (r->nspans > 0 && start <= r->spans[2 * r->nspans - 1]) {
+        if (end > r->spans[2 * r->nspans - 1]) r->spans[2 * r->nspans - 1] = end;
+        return;
+    }
+    if (r->nspans == r->cap) {
+        r->cap = r->cap ? r->cap * 2 : 8;
+        r->spans = xrealloc(r->spans, r->cap * 2 * sizeof(int));
+    }
+    r->spans[2 * r->nspans] = start;
+    r->spans[2 * r->nspans + 1] = end;
+    r->nspans++;
+}
+
+const int *highlight_line(Highlight *h, Buffer *b, int y, int rows, int *nspans) {
+    *nspans = 0;
+    if (!h->m) return NULL;
+    if (rows > h->nrows) {
+        for (int i = 0; i < h->nrows; ++i) free(h->rows[i].spans);
+        h->rows = xrealloc(h->rows, rows * sizeof(HighlightRow));
+        memset(h->rows, 0, rows * sizeof(HighlightRow));
+        for (int i = 0; i < rows; ++i) h->rows[i].y = -1;
+        h->nrows = rows;
+    }
+    HighlightRow *r = &h->rows[y % h->nrows];
+    const char *line = b->lines[y];
+    unsigned long stamp = buffer_line_stamp(b, y);
+    if (r->y != y || r->line != line || r->stamp != stamp) {
+        r->y = y;
+        r->line = line;
+        r->stamp = stamp;
+        r->nspans = 0;
+        // every start isearch can stop at, as in MatchSet; a regex finds
+        // them all in one pass rather than one search per match
+        size_t len = strlen(line);
+        if (h->m->re) {
+            r->nspans = regex_cover(h->m->re, line, len, &r->spans, &r->cap);
+        } else {
+            for (long p = 0; (size_t)p <= len && (p = matcher_find(h->m, line, len, p)) >= 0; ++p) {
+                size_t ml = matcher_match_len(h->m, line, len, p);
+                if (ml > 0) add_span(r, (int)p, (int)(p + ml));
+            }
+        }
+    }
+    *nspans = r->nspans;
+    return r->spans;
+}
+
+// ------------------------------------------------------------------
+// background match counting
+
+// One matcher per worker thread, or NULL with *err set.
+static Matcher *workers_init(int n, const char *q, size_t qlen, int regex, int fold,
+                             const char **err) {
+    Matcher *w = xmalloc(n * sizeof(Matcher));
+    for (int i = 0; i < n; ++i) {
+        if (matcher_init(&w[i], q, qlen, regex, fold, err) < 0) {
+            while (i-- > 0) matcher_free(&w[i]);
+            free(w);
+            return NULL;
+        }
+    }
+    return w;
+}
+
+static void workers_free(Matcher *w, int n) {
+    for (int i = 0; i < n; ++i) matcher_free(&w[i]);
+    free(w);
+}
+
+static void count_chunk(void *ctx, int worker, int item) {
+    MatchCount *mc = ctx;
+    Matcher *m = &mc->workers[worker];
+    Buffer *b = mc->buf;
+    int end = (item + 1) * COUNT_CHUNK_LINES;
+    if (end > b->nlines) end = b->nlines;
+    long n = 0;
+    for (int y = item * COUNT_CHUNK_LINES, block_end = y; y < end; ++y) {
+        if (y >= block_end && (y = trigram_index_next(b->index, &m->tq, y, &block_end)) >= end)
+            break;
+        size_t len = strlen(b->lines[y]);
+        n += matcher_count(m, b->lines[y], len, len + 1);
+    }
+    job_lock(&mc->job);
+    mc->counts[item] = n;
+    job_unlock(&mc->job);
+}
+
+int match_count_start(MatchCount *mc, Buffer *b, const char *q, size_t qlen, int regex,
+                      int fold, const char **err) {
+    memset(mc, 0, sizeof(*mc));
+    int nthreads = job_threads();
+    mc->workers = workers_init(nthreads, q, qlen, regex, fold, err);
+    if (!mc->workers) return -1;
+    mc->nworkers = nthreads;
+    mc->buf = b;
+    mc->nchunks = (b->nlines + COUNT_CHUNK_LINES - 1) / COUNT_CHUNK_LINES;
+    mc->counts = xmalloc(mc->nchunks * sizeof(long));
+    for (int i = 0; i < mc->nchunks; ++i) mc->counts[i] = -1;
+    mc->running = 1;
+    job_start(&mc->job, mc->nchunks, nthreads, count_chunk, mc);
+    return 0;
+}
+
+void match_count_stop(MatchCount *mc) {
+    if (!mc->running) return;
+    job_stop(&mc->job);
+    workers_free(mc->workers, mc->nworkers);
+    free(mc->counts);
+    memset(mc, 0, sizeof(*mc));
+}
+
+long match_count_total(MatchCount *mc, int *complete) {
+    long total = 0;
+    int done = 1;
+    job_lock(&mc->job);
+    for (int i = 0; i < mc->nchunks; ++i) {
+        if (mc->counts[i] < 0) done = 0;
+        else total += mc->counts[i];
+    }
+    job_unlock(&mc->job);
+    *complete = done;
+    return total;
+}
+
+long match_count_before(MatchCount *mc, Matcher *m, int y, int x) {
+    Buffer *b = mc->buf;
+    int chunk = y / COUNT_CHUNK_LINES;
+    long n = 0;
+    job_lock(&mc->job);
+    for (int i = 0; i < chunk && n >= 0; ++i) n = mc->counts[i] < 0 ? -1 : n + mc->counts[i];
+    job_unlock(&mc->job);
+    if (n < 0) return -1;
+    // the rest of y's chunk is counted here
+    for (int l = chunk * COUNT_CHUNK_LINES, end = l; l < y; ++l) {
+        if (l >= end && (l = trigram_index_next(b->index, &m->tq, l, &end)) >= y) break;
+        size_t len = strlen(b->lines[l]);
+        n += matcher_count(m, b->lines[l], len, len + 1);
+    }
+    return n + matcher_count(m, b->lines[y], strlen(b->lines[y]), (size_t)x);
+}
+
+// ------------------------------------------------------------------
+// occur
+
+static void occur_chunk(void *ctx, int worker, int item) {
+    OccurScan *oc = ctx;
+    Matcher *m = &oc->workers[worker];
+    Buffer *b = oc->buf;
+    int end = (item + 1) * OCCUR_CHUNK_LINES;
+    if (end > b->nlines) end = b->nlines;
+    char **out = NULL;
+    int n = 0, cap = 0;
+    for (int y = item * OCCUR_CHUNK_LINES, block_end = y; y < end; ++y) {
+        if (y >= block_end && (y = trigram_index_next(b->index, &m->tq, y, &block_end)) >= end)
+            break;
+        const char *line = b->lines[y];
+        size_t len = strlen(line);
+        if (matcher_find(m, line, len, 0) < 0) continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            out = xrealloc(out, cap * sizeof(char*));
+        }
+        // the line number, right-aligned, then ':' and the line
+        char *s = xmalloc(oc->width + 1 + len + 1);
+        snprintf(s, oc->width + 2, "%*d:", oc->width, y + 1);
+        memcpy(s + oc->width + 1, line, len + 1);
+        out[n++] = s;
+    }
+    job_lock(&oc->job);
+    oc->chunks[item] = out;
+    oc->counts[item] = n;
+    job_unlock(&oc->job);
+}
+
+int occur_start(OccurScan *oc, Buffer *b, const char *q, size_t qlen, int regex, int fold,
+                const char **err) {
+    memset(oc, 0, sizeof(*oc));
+    int nthreads = job_threads();
+    oc->workers = workers_init(nthreads, q, qlen, regex, fold, err);
+    if (!oc->workers) return -1;
+    oc->nworkers = nthreads;
+    oc->buf = b;
+    oc->width = snprintf(NULL, 0, "%d", b->nlines);
+    oc->nchunks = (b->nlines + OCCUR_CHUNK_LINES - 1) / OCCUR_CHUNK_LINES;
+    oc->chunks = xmalloc(oc->nchunks * sizeof(char**));
+    oc->counts = xmalloc(oc->nchunks * sizeof(int));
+    for (int i = 0; i < oc->nchunks; ++i) oc->counts[i] = -1;
+    oc->running = 1;
+    job_start(&oc->job, oc->nchunks, nthreads, occur_chunk, oc);
+    return 0;
+}
+
+void occur_stop(OccurScan *oc) {
+    if (!oc->running) return;
+    job_stop(&oc->job);
+    for (int i = oc->next; i < oc->nchunks; ++i) {
+        if (oc->counts[i] < 0) continue;
+        for (int j = 0; j < oc->counts[i]; ++j) free(oc->chunks[i][j]);
+        free(oc->chunks[i]);
+    }
+    workers_free(oc->workers, oc->nworkers);
+    free(oc->chunks);
+    free(oc->counts);
+    memset(oc, 0, sizeof(*oc));
+}
+
+int occur_take(OccurScan *oc, Buffer *out) {
+    int first = oc->next, added = 0;
+    job_lock(&oc->job);
+    while (oc->next < oc->nchunks && oc->counts[oc->next] >= 0) oc->next++;
+    job_unlock(&oc->job);
+    // the taken chunks are no longer touched by the workers
+    for (int i = first; i < oc->next; ++i) {
+        int n = oc->counts[i];
+        if (n > 0) {
+            int y = out->nlines;
+            buffer_ensure_capacity(out, y + n);
+            memcpy(out->lines + y, oc->chunks[i], n * sizeof(char*));
+            out->nlines += n;
+            buffer_changed(out, y, n, n);
+            added += n;
+        }
+        free(oc->chunks[i]);
+    }
+    return added;
+}
+
+int occur_done(OccurScan *oc) {
+    return oc->next == oc->nchunks;
+}
+
+// ------------------------------------------------------------------
+// line matching
+
+static void line_match_chunk(void *ctx, int worker, int item) {
+    LineMatch *lm = ctx;
+    Matcher *m = &lm->workers[worker];
+    Buffer *b = lm->buf;
+    int y = lm->y0 + item * LINE_MATCH_CHUNK_LINES;
+    int end = y + LINE_MATCH_CHUNK_LINES;
+    if (end > lm->y1) end = lm->y1;
+    // lines in blocks the index rules out keep their 0
+    for (int block_end = y; y < end; ++y) {
+        if (y >= block_end && (y = trigram_index_next(b->index, &m->tq, y, &block_end)) >= end)
+            break;
+        const char *line = b->lines[y];
+        lm->hit[y - lm->y0] = matcher_find(m, line, strlen(line), 0) >= 0;
+    }
+}
+
+int line_match_start(LineMatch *lm, Buffer *b, int y0, int y1, const char *q, size_t qlen,
+                     int regex, int fold, const char **err) {
+    memset(lm, 0, sizeof(*lm));
+    int nthreads = job_threads();
+    lm->workers = workers_init(nthreads, q, qlen, regex, fold, err);
+    if (!lm->workers) return -1;
+    lm->nworkers = nthreads;
+    lm->buf = b;
+    lm->y0 = y0;
+    lm->y1 = y1;
+    lm->hit = xmalloc(y1 - y0 + 1);
+    memset(lm->hit, 0, y1 - y0 + 1);
+    lm->nchunks = (y1 - y0 + LINE_MATCH_CHUNK_LINES - 1) / LINE_MATCH_CHUNK_LINES;
+    lm->running = 1;
+    job_start(&lm->job, lm->nchunks, nthreads, line_match_chunk, lm);
+    return 0;
+}
+
+void line_match_stop(LineMatch *lm) {
+    if (!lm->running) return;
+    job_stop(&lm->job);
+    workers_free(lm->workers, lm->nworkers);
+    free(lm->hit);
+    memset(lm, 0, sizeof(*lm));
+}
+
+int line_match_progress(LineMatch *lm, int *nchunks) {
+    job_lock(&lm->job);
+    int done = lm->job.finished;
+    job_unlock(&lm->job);
+    *nchunks = lm->nchunks;
+    return done;
+}
@@ -0,0 +1,206 @@
+/*
+ * trigram.c
+ *
+ * Per-buffer trigram index that lets searches skip blocks of lines.
+ *
+ * Created at:  18. Oct 2026
+ * Author:      Raphaele Salvatore Licciardo
+ *
+ *
+ * Copyright (c) 2025 Raphaele Salvatore Licciardo
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "includes/trigram.h"
+#include "includes/search.h"
+
+#define SIG_WORDS (TRIGRAM_SIG_BITS / 64)
+
+// Signature bit of the folded trigram in the low 24 bits of t.
+static inline uint32_t trigram_hash(uint32_t t) {
+    return ((t & 0xffffff) * 2654435761u) >> 16;
+}
+
+static uint64_t *block_sig(const TrigramIndex *ix, int k) {
+    return ix->sigs + (size_t)k * SIG_WORDS;
+}
+
+static void index_block(TrigramIndex *ix, int k) {
+    uint64_t *sig = block_sig(ix, k);
+    memset(sig, 0, SIG_WORDS * sizeof(uint64_t));
+    for (int y = ix->start[k]; y < ix->start[k + 1]; ++y) {
+        const unsigned char *s = (const unsigned char *)ix->buf->lines[y];
+        if (!s[0] || !s[1]) continue;
+        uint32_t t = search_fold_lower[s[0]] << 8 | search_fold_lower[s[1]];
+        for (s += 2; *s; ++s) {
+            t = t << 8 | search_fold_lower[*s];
+            uint32_t h = trigram_hash(t);
+            sig[h >> 6] |= (uint64_t)1 << (h & 63);
+        }
+    }
+}
+
+static void build_block(void *ctx, int worker, int item) {
+    TrigramIndex *ix = ctx;
+    (void)worker;
+    index_block(ix, item);
+    job_lock(&ix->job);
+    ix->ready[item] = 1;
+    job_unlock(&ix->job);
+}
+
+// Split the buffer into blocks of about `per` bytes in one pass. Past
+// the block limit, neighbouring blocks are merged pairwise and the
+// target size doubles.
+static void split_blocks(TrigramIndex *ix) {
+    Buffer *b = ix->buf;
+    int max = (int)(TRIGRAM_MAX_BYTES / (SIG_WORDS * sizeof(uint64_t)));
+    size_t per = TRIGRAM_BLOCK_BYTES, acc = 0;
+    ix->start = xmalloc((max + 1) * sizeof(int));
+    ix->nblocks = 1;
+    ix->start[0] = 0;
+    for (int y = 0; y + 1 < b->nlines; ++y) {
+        acc += strlen(b->lines[y]) + 1;
+        if (acc < per) continue;
+        acc = 0;
+        if (ix->nblocks == max) {
+            for (int k = 0; 2 * k < max; ++k) ix->start[k] = ix->start[2 * k];
+            ix->nblocks = (max + 1) / 2;
+            per *= 2;
+        }
+        ix->start[ix->nblocks++] = y + 1;
+    }
+    ix->start[ix->nblocks] = b->nlines;
+}
+
+TrigramIndex *trigram_index_start(Buffer *b) {
+    TrigramIndex *ix = xmalloc(sizeof(TrigramIndex));
+    memset(ix, 0, sizeof(*ix));
+    ix->buf = b;
+    split_blocks(ix);
+    ix->sigs = xmalloc((size_t)ix->nblocks * SIG_WORDS * sizeof(uint64_t));
+    ix->ready = xmalloc(ix->nblocks);
+    memset(ix->ready, 0, ix->nblocks);
+    job_start(&ix->job, ix->nblocks, job_threads(), build_block, ix);
+    return ix;
+}
+
+void trigram_index_free(TrigramIndex *ix) {
+    if (!ix) return;
+    job_stop(&ix->job);
+    free(ix->start);
+    free(ix->sigs);
+    free(ix->ready);
+    free(ix);
+}
+
+int trigram_index_progress(TrigramIndex *ix, int *nblocks) {
+    job_lock(&ix->job);
+    int done = ix->job.finished;
+    job_unlock(&ix->job);
+    *nblocks = ix->nblocks;
+    return done;
+}
+
+size_t trigram_index_size(const TrigramIndex *ix) {
+    return (size_t)ix->nblocks * SIG_WORDS * sizeof(uint64_t);
+}
+
+// The block holding line y: the last one starting at or before it.
+static int block_of(const TrigramIndex *ix, int y) {
+    int lo = 0, hi = ix->nblocks - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (ix->start[mid] <= y) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+void trigram_index_edit(TrigramIndex *ix, int y, int n, int delta) {
+    int k = block_of(ix, y);
+    if (delta != 0) {
+        for (int j = k + 1; j < ix->nblocks; ++j) {
+            int s = ix->start[j];
+            // a block starting inside removed lines now starts at y
+            ix->start[j] = delta < 0 && s <= y - delta ? y : s + delta;
+        }
+        ix->start[ix->nblocks] += delta;
+    }
+    int end = y + (n > 0 ? n : 1);
+    job_lock(&ix->job);
+    for (; k < ix->nblocks && ix->start[k] < end; ++k) ix->ready[k] = 0;
+    job_unlock(&ix->job);
+}
+
+void trigram_index_refresh(TrigramIndex *ix) {
+    if (!ix || !job_done(&ix->job)) return;
+    int left = TRIGRAM_REFRESH_MAX;
+    for (int k = 0; k < ix->nblocks && left > 0; ++k) {
+        if (ix->ready[k] || ix->start[k] == ix->start[k + 1]) continue;
+        index_block(ix, k);
+        job_lock(&ix->job);
+        ix->ready[k] = 1;
+        job_unlock(&ix->job);
+        left--;
+    }
+}
+
+void trigram_query_init(TrigramQuery *tq, const char *s, size_t len) {
+    const unsigned char *u = (const unsigned char *)s;
+    tq->n = 0;
+    for (size_t i = 0; i + 3 <= len && tq->n < TRIGRAM_QUERY_MAX; ++i) {
+        uint32_t t = search_fold_lower[u[i]] << 16 | search_fold_lower[u[i + 1]] << 8
+            | search_fold_lower[u[i + 2]];
+        tq->h[tq->n++] = (uint16_t)trigram_hash(t);
+    }
+}
+
+// Whether block k may hold a match. Call with the job lock held.
+static int may_match(const TrigramIndex *ix, const TrigramQuery *tq, int k) {
+    if (ix->start[k] == ix->start[k + 1]) return 0;
+    if (!ix->ready[k]) return 1;
+    const uint64_t *sig = block_sig(ix, k);
+    for (int i = 0; i < tq->n; ++i) {
+        if (!(sig[tq->h[i] >> 6] >> (tq->h[i] & 63) & 1)) return 0;
+    }
+    return 1;
+}
+
+int trigram_index_next(TrigramIndex *ix, const TrigramQuery *tq, int y, int *end) {
+    if (!ix || tq->n == 0) {
+        *end = INT_MAX;
+        return y;
+    }
+    int k = block_of(ix, y);
+    job_lock(&ix->job);
+    while (k < ix->nblocks && !may_match(ix, tq, k)) ++k;
+    job_unlock(&ix->job);
+    if (k == ix->nblocks) {
+        *end = INT_MAX;
+        return ix->start[k];
+    }
+    *end = ix->start[k + 1];
+    return y > ix->start[k] ? y : ix->start[k];
+}
+
+int trigram_index_prev(TrigramIndex *ix, const TrigramQuery *tq, int y, int *begin) {
+    if (!ix || tq->n == 0) {
+        *begin = INT_MIN;
+        return y;
+    }
+    int k = block_of(ix, y);
+    job_lock(&ix->job);
+    while (k >= 0 && !may_match(ix, tq, k)) --k;
+    job_unlock(&ix->job);
+    if (k < 0) {
+        *begin = INT_MIN;
+        return -1;
+    }
+    *begin = ix->start[k];
+    return y < ix->start[k + 1] ? y : ix->start[k + 1] - 1;
+}